@@ -24,6 +24,144 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// The dirty block set.  Clean blocks are mapped read-only, so the first
+// write to one faults, and bc_pgfault adds it to the set and makes it
+// writable; writing a block out makes it read-only again.  Bit n of
+// bc_dirty is block n, and bit n of bc_dirtysum says whether word n of
+// bc_dirty has any bits set, so that finding the dirty blocks of a big,
+// mostly clean disk takes a handful of comparisons.
+#define NDIRTYWORDS	(DISKSIZE / BLKSIZE / 32)
+
+static uint32_t bc_dirty[NDIRTYWORDS];
+static uint32_t bc_dirtysum[NDIRTYWORDS / 32];
+
+static bool
+bc_is_dirty(uint32_t blockno)
+{
+	return (bc_dirty[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+static void
+bc_set_dirty(uint32_t blockno)
+{
+	uint32_t w = blockno / 32;
+
+	bc_dirty[w] |= 1 << (blockno % 32);
+	bc_dirtysum[w / 32] |= 1 << (w % 32);
+}
+
+static void
+bc_clear_dirty(uint32_t blockno)
+{
+	uint32_t w = blockno / 32;
+
+	bc_dirty[w] &= ~(1 << (blockno % 32));
+	if (bc_dirty[w] == 0)
+		bc_dirtysum[w / 32] &= ~(1 << (w % 32));
+}
+
+// Return the first dirty block in [blockno, end), or end if there is none.
+static uint32_t
+bc_next_dirty(uint32_t blockno, uint32_t end)
+{
+	uint32_t w, bits;
+
+	for (w = blockno / 32; w < NDIRTYWORDS && w * 32 < end; w++) {
+		if (w % 32 == 0 && bc_dirtysum[w / 32] == 0) {
+			w += 31;
+			continue;
+		}
+		bits = bc_dirty[w];
+		if (w == blockno / 32)
+			bits &= ~0U << (blockno % 32);
+		if (bits)
+			return MIN(w * 32 + __builtin_ctz(bits), end);
+	}
+	return end;
+}
+
+// A cached block's page may also be mapped into other environments,
+// by serve_map, and they must keep seeing the block as it was when
+// they mapped it.  So a shared block is only ever mapped read-only here,
+// and before it changes, bc_pgfault moves it to a page of its own,
+// copying it through BCCOPY, just below BCSTAGE.
+#define BCCOPY		0xD7FFF000
+
+// Give the cached block at blk a page of its own with the same contents,
+// leaving the environments it is shared with the old one.
+static void
+bc_unshare(void *blk)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) BCCOPY, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_unshare: sys_page_alloc: %e", r);
+	memmove((void *) BCCOPY, blk, BLKSIZE);
+	if ((r = sys_page_map(0, (void *) BCCOPY, 0, blk, PTE_P|PTE_U)) < 0)
+		panic("bc_unshare: sys_page_map: %e", r);
+	sys_page_unmap(0, (void *) BCCOPY);
+}
+
+// Map the cached block at blk at va as well, read-only, for sending to
+// another environment.  The block's own mapping becomes read-only too,
+// if it is not already, so that the block's next change faults and
+// gets a page of its own (see bc_unshare).
+int
+bc_share(void *blk, void *va)
+{
+	int r;
+
+	// Fault the block in so there is a page to share
+	*(volatile char *) blk;
+
+	if ((r = sys_page_map(0, blk, 0, va, PTE_P|PTE_U)) < 0)
+		return r;
+	if (uvpt[PGNUM(blk)] & PTE_W)
+		return sys_page_map(0, blk, 0, blk, PTE_P|PTE_U);
+	return 0;
+}
+
+// Is esp on the exception stack, which every thread shares?
+static bool
+on_xstack(uintptr_t esp)
+{
+	return esp >= UXSTACKTOP - PGSIZE && esp < UXSTACKTOP;
+}
+
+// Read block blockno into the block cache for a faulting thread, on its
+// own stack, where waiting for the disk can let other threads run, and
+// where the thread can wait for another one to finish with the disk.
+static void __attribute__((used))
+bc_fault_in(uint32_t blockno)
+{
+	bc_prefetch(blockno, 1);
+
+	// Check that the block we read was allocated. (exercise for
+	// the reader: why do we do this *after* reading the block
+	// in?)
+	if (bitmap && block_is_free(blockno))
+		panic("reading free block %08x\n", blockno);
+}
+
+// bc_pgfault returns to bc_fault_stub, on the faulting thread's stack,
+// with the block number on top of that stack and the faulting eip
+// under it.  The stub calls bc_fault_in, saving every register and the
+// flags around the call, and then returns to the faulting instruction.
+void bc_fault_stub(void);
+
+asm(".text\n"
+    "bc_fault_stub:\n"
+    "	pushal\n"
+    "	pushfl\n"
+    "	cld\n"
+    "	pushl 36(%esp)\n"	// the block number
+    "	call bc_fault_in\n"
+    "	addl $4, %esp\n"
+    "	popfl\n"
+    "	popal\n"
+    "	addl $4, %esp\n"
+    "	ret\n");
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -42,6 +180,36 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	// A write to a clean or shared cached block: it becomes dirty, and
+	// private if it was shared.
+	if (utf->utf_err & FEC_PR) {
+		if (!(utf->utf_err & FEC_WR) || !va_is_mapped(addr))
+			panic("page fault in FS: eip %08x, va %08x, err %04x",
+			      utf->utf_eip, addr, utf->utf_err);
+		if (pageref(addr) > 1)
+			bc_unshare(ROUNDDOWN(addr, PGSIZE));
+		bc_set_dirty(blockno);
+		if ((r = sys_page_map(0, ROUNDDOWN(addr, PGSIZE),
+				      0, ROUNDDOWN(addr, PGSIZE),
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		return;
+	}
+
+	// A fault on a thread's own stack is sent back to that stack to
+	// read the block in with bc_fault_in.  Reading it in here, on the
+	// exception stack, would mean we could neither let other threads
+	// run while the disk works nor wait for one that is using it.
+	if (!on_xstack(utf->utf_esp)) {
+		uint32_t *sp = (uint32_t *) utf->utf_esp;
+
+		*--sp = utf->utf_eip;
+		*--sp = blockno;
+		utf->utf_esp = (uintptr_t) sp;
+		utf->utf_eip = (uintptr_t) bc_fault_stub;
+		return;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
@@ -63,12 +231,17 @@ bc_pgfault(struct UTrapframe *utf)
 	}
 
 	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
+	// block from disk.  The block stays read-only until it is written,
+	// unless that is what faulted.
+	if (utf->utf_err & FEC_WR)
+		bc_set_dirty(blockno);
+	else
+		bc_clear_dirty(blockno);
 	if ((r = sys_page_map(0,
 			      ROUNDDOWN(addr, PGSIZE),
 			      0,
 			      ROUNDDOWN(addr, PGSIZE),
-			      uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) {
+			      PTE_P|PTE_U|(utf->utf_err & FEC_WR ? PTE_W : 0))) < 0) {
 		panic("in bc_pgfault, sys_page_map: %e", r);
 	}
 
@@ -80,41 +253,108 @@ bc_pgfault(struct UTrapframe *utf)
 }
 
 
-// Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
-void
-flush_block(void *addr)
-{
-	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+// Largest transfer ide_read and ide_write can do in one command, in blocks.
+#define BC_MAXRUN	(256 / BLKSECTS)
 
-	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
-		panic("flush_block of bad va %08x", addr);
+// Blocks being read by bc_prefetch land here, and only move into the
+// block cache once the read completes; the disk read may let other
+// threads run, and they must not see half-read blocks.
+#define BCSTAGE		0xD8000000
 
-	// LAB 5: Your code here.
-	static_assert(PGSIZE == BLKSIZE);
+static bool bc_staging;		// BCSTAGE is in use
 
-	if (!va_is_mapped(addr) || !va_is_dirty(addr)) {
-		return;
-	}
+// Read the nblocks disk blocks starting at blockno into the block cache,
+// skipping blocks that are already cached.  Each run of missing blocks is
+// fetched with a single multi-sector disk read instead of one page fault
+// per block.
+//
+// Unlike faulting blocks in, this lets other file server threads run
+// while the disk works, so code that may run alongside other requests
+// must load blocks with it before touching them.
+void
+bc_prefetch(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t i, n;
+	int r;
 
-	int err;
-	if ((err = write_block_to_disk(blockno, addr) < 0)) {
-		panic("write_block failed");
+	while (nblocks > 0) {
+		while (!va_is_mapped(diskaddr(blockno)) && bc_staging)
+			fs_yield();
+		if (va_is_mapped(diskaddr(blockno))) {
+			blockno++;
+			nblocks--;
+			continue;
+		}
+
+		bc_staging = 1;
+		for (n = 0; n < MIN(nblocks, BC_MAXRUN); n++) {
+			if (va_is_mapped(diskaddr(blockno + n)))
+				break;
+			if ((r = sys_page_alloc(0, (void *) BCSTAGE + n * BLKSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("bc_prefetch: sys_page_alloc: %e", r);
+		}
+
+		if ((r = ide_read(blockno * BLKSECTS, (void *) BCSTAGE,
+				  n * BLKSECTS)) < 0)
+			panic("bc_prefetch: ide_read failed");
+
+		// Moving the pages gives them fresh, clean, read-only mappings.
+		for (i = 0; i < n; i++) {
+			if ((r = sys_page_map(0, (void *) BCSTAGE + i * BLKSIZE,
+					      0, diskaddr(blockno + i),
+					      PTE_P|PTE_U)) < 0)
+				panic("bc_prefetch: sys_page_map: %e", r);
+			sys_page_unmap(0, (void *) BCSTAGE + i * BLKSIZE);
+		}
+		bc_staging = 0;
+
+		blockno += n;
+		nblocks -= n;
 	}
+}
 
-	if ((err = sys_page_map(0,
-				ROUNDDOWN(addr, PGSIZE),
-				0,
-				ROUNDDOWN(addr, PGSIZE),
-				uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) {
-		panic ("sys_page_map error: %x", err);
+// Write the dirty blocks among the nblocks starting at blockno to disk,
+// in block order, and mark them clean.  Each run of adjacent dirty blocks
+// goes out in a single multi-sector disk write, straight from the block
+// cache, where the run is contiguous too.
+void
+flush_blocks(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t end = blockno + nblocks, i, n;
+	int r;
+
+	for (blockno = bc_next_dirty(blockno, end); blockno < end;
+	     blockno = bc_next_dirty(blockno + n, end)) {
+		for (n = 1; n < BC_MAXRUN && blockno + n < end
+			     && bc_is_dirty(blockno + n); n++)
+			;
+
+		// Make the run read-only before writing it, so that a change
+		// made while the disk works marks its block dirty again.
+		for (i = 0; i < n; i++) {
+			bc_clear_dirty(blockno + i);
+			if ((r = sys_page_map(0, diskaddr(blockno + i),
+					      0, diskaddr(blockno + i),
+					      PTE_P|PTE_U)) < 0)
+				panic("flush_blocks: sys_page_map: %e", r);
+		}
+		if ((r = ide_write(blockno * BLKSECTS, diskaddr(blockno),
+				   n * BLKSECTS)) < 0)
+			panic("flush_blocks: ide_write failed");
 	}
+}
+
+// Flush the contents of the block containing VA out to disk if
+// necessary.  If the block is not in the block cache or is not dirty,
+// does nothing.
+void
+flush_block(void *addr)
+{
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("flush_block of bad va %08x", addr);
 
+	flush_blocks(((uint32_t)addr - DISKMAP) / BLKSIZE, 1);
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -3,6 +3,16 @@
 
 #include "fs.h"
 
+// The most metadata blocks each kind of journal operation changes.
+// Allocating a file block can take three allocations (the bitmap blocks
+// for them), the block holding the File, the double-indirect block and
+// an indirect block.  Creating a file adds the new File's block and, in
+// an indexed directory, an index leaf allocation (bitmap, root, leaf).
+// Freeing one block changes the bitmap and the block pointing to it.
+#define JBLOCKS_GETBLOCK	6
+#define JBLOCKS_CREATE		(JBLOCKS_GETBLOCK + 4)
+#define JBLOCKS_FREE		2
+
 // --------------------------------------------------------------
 // Super block
 // --------------------------------------------------------------
@@ -11,7 +21,7 @@
 void
 check_super(void)
 {
-	if (super->s_magic != FS_MAGIC)
+	if (super->s_magic != FS_MAGIC && super->s_magic != FS_MAGIC_V2)
 		panic("bad file system magic number");
 
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
@@ -43,23 +53,12 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	journal_add(&bitmap[blockno/32]);
 	bitmap[blockno/32] |= 1<<(blockno%32);
 }
 
-inline int
-write_block_to_disk(int blockno, void *addr)
-{
-	if (super && blockno >= super->s_nblocks)
-		panic("bad block number %08x in diskaddr", blockno);
-	return ide_write((BLKSIZE / SECTSIZE) * blockno,
-			 ROUNDDOWN(addr, PGSIZE),
-			 BLKSIZE / SECTSIZE );
-}
-
-
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it.  The changed
+// bitmap block joins the current journal transaction.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
@@ -100,18 +99,9 @@ alloc_block(void)
 	}
 
 	// clear the chosen bit
+	journal_add(&bitmap[i]);
 	bitmap[i] &= ~(1 << j);
 
-	// write back the bitmap to disk
-	for (int k = 0, bmb = DIVCEIL(super->s_nblocks, BLKBITSIZE); k < bmb; k++) {
-		uint32_t *bmaddr = &bitmap[k * (BLKSIZE / 32)];
-		int err;
-		// start writing at block 2
-		if ((err = write_block_to_disk(2 + k, bmaddr)) < 0) {
-			panic("failed write_block: %x", err);
-		}
-	}
-
 	return blockno;
 }
 
@@ -139,7 +129,7 @@ check_bitmap(void)
 // File system structures
 // --------------------------------------------------------------
 
-
+static void fs_upgrade(void);
 
 // Initialize the file system
 void
@@ -160,15 +150,45 @@ fs_init(void)
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
+	journal_init();
 	check_bitmap();
 
+	if (super->s_magic == FS_MAGIC)
+		fs_upgrade();
+}
+
+// Make sure the indirect block whose number is stored in *pblockno exists,
+// allocating and clearing one if necessary and 'alloc' is set, and set
+// *pblk to its contents.
+//
+// Returns 0 on success, -E_NOT_FOUND if the block is missing and alloc
+// was 0, or -E_NO_DISK if there's no space on the disk for it.
+static int
+indirect_block(uint32_t *pblockno, bool alloc, uint32_t **pblk)
+{
+	int blocknum;
+
+	if (*pblockno == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((blocknum = alloc_block()) < 0)
+			return -E_NO_DISK;
+		journal_add(pblockno);
+		*pblockno = blocknum;
+		journal_add(diskaddr(blocknum));
+		memset(diskaddr(blocknum), 0, BLKSIZE);
+	} else
+		bc_prefetch(*pblockno, 1);
+	*pblk = (uint32_t *) diskaddr(*pblockno);
+	return 0;
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
 // The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// or an entry in the indirect block,
+// or an entry in a block hanging off the double-indirect block.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -176,15 +196,17 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= MAXFILESIZE / BLKSIZE).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
 	// LAB 5: Your code here.
-	if (filebno >= NDIRECT + NINDIRECT) {
+	uint32_t *blk;
+	int r;
+
+	if (filebno >= MAXFILESIZE / BLKSIZE) {
 		return -E_INVAL;
 	}
 
@@ -193,22 +215,131 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 		*ppdiskbno = &f->f_direct[filebno];
 		return 0;
 	}
+	filebno -= NDIRECT;
 
-	// handle allocation of the indirect block
-	if (f->f_indirect == 0 && !alloc) {
-		return -E_NOT_FOUND;
-	} else if (f->f_indirect == 0 && alloc) {
-		int blocknum = alloc_block();
-		if (blocknum < 0) {
-			return -E_NO_DISK;
+	// get info from indirect block
+	if (filebno < NINDIRECT) {
+		if ((r = indirect_block(&f->f_indirect, alloc, &blk)) < 0)
+			return r;
+		*ppdiskbno = &blk[filebno];
+		return 0;
+	}
+	filebno -= NINDIRECT;
+
+	// two levels down through the double-indirect block
+	if ((r = indirect_block(&f->f_dindirect, alloc, &blk)) < 0)
+		return r;
+	if ((r = indirect_block(&blk[filebno / NINDIRECT], alloc, &blk)) < 0)
+		return r;
+	*ppdiskbno = &blk[filebno % NINDIRECT];
+	return 0;
+}
+
+// Number of file blocks covered by f's extents.
+static uint32_t
+file_extent_blocks(struct File *f)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < f->f_nextents; i++)
+		n += f->f_extents[i].e_len;
+	return n;
+}
+
+// Record that file block 'filebno' of f now lives at disk block 'diskbno'.
+// Extents only describe a prefix of the file, so blocks allocated out of
+// order (or beyond the last extent slot) are simply not summarized.
+static void
+file_extent_add(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	struct Extent *e;
+
+	if (filebno != file_extent_blocks(f))
+		return;
+	if (f->f_nextents > 0) {
+		e = &f->f_extents[f->f_nextents - 1];
+		if (e->e_start + e->e_len == diskbno) {
+			e->e_len++;
+			return;
 		}
-		f->f_indirect = blocknum;
-		memset(diskaddr(f->f_indirect), 0, BLKSIZE);
 	}
+	if (f->f_nextents < NEXTENT) {
+		e = &f->f_extents[f->f_nextents++];
+		e->e_start = diskbno;
+		e->e_len = 1;
+	}
+}
 
-	// get info from indirect block
-	uint32_t *blk = (uint32_t *)diskaddr(f->f_indirect);
-	*ppdiskbno = &blk[filebno - NDIRECT];
+// Drop the parts of f's extents that describe blocks >= nblocks.
+static void
+file_extent_truncate(struct File *f, uint32_t nblocks)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < f->f_nextents; i++) {
+		if (n + f->f_extents[i].e_len >= nblocks) {
+			f->f_extents[i].e_len = nblocks - n;
+			f->f_nextents = i + (nblocks > n);
+			return;
+		}
+		n += f->f_extents[i].e_len;
+	}
+}
+
+// Rebuild f's extents from its block pointers.
+static void
+file_extent_rebuild(struct File *f)
+{
+	uint32_t i, nblocks, *pdiskbno;
+
+	f->f_nextents = 0;
+	nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	for (i = 0; i < nblocks; i++) {
+		if (file_block_walk(f, i, &pdiskbno, 0) < 0 || *pdiskbno == 0)
+			return;
+		file_extent_add(f, i, *pdiskbno);
+		if (file_extent_blocks(f) != i + 1)
+			return;
+	}
+}
+
+// Read file blocks [filebno, filebno + nblocks) into the block cache,
+// using the extents to turn runs of them into multi-block disk reads.
+// Blocks not covered by an extent are left to be faulted in one by one.
+static void
+file_prefetch(struct File *f, uint32_t filebno, uint32_t nblocks)
+{
+	uint32_t i, n, lstart = 0;
+	struct Extent *e;
+
+	for (i = 0; i < f->f_nextents && nblocks > 0; i++) {
+		e = &f->f_extents[i];
+		if (filebno < lstart + e->e_len) {
+			n = MIN(nblocks, lstart + e->e_len - filebno);
+			bc_prefetch(e->e_start + (filebno - lstart), n);
+			filebno += n;
+			nblocks -= n;
+		}
+		lstart += e->e_len;
+	}
+}
+
+// Allocate the 'filebno'th block of f, and any indirect blocks it needs.
+static int
+file_get_block_alloc(struct File *f, uint32_t filebno, uint32_t **ppdiskbno)
+{
+	int r;
+
+	if ((r = file_block_walk(f, filebno, ppdiskbno, true)) < 0)
+		return r;
+	if (**ppdiskbno == 0) {
+		if ((r = alloc_block()) < 0)
+			return -E_NO_DISK;
+		journal_add(*ppdiskbno);
+		journal_add(f);
+		**ppdiskbno = r;
+		file_extent_add(f, filebno, r);
+	}
 	return 0;
 }
 
@@ -224,26 +355,392 @@ int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	// LAB 5: Your code here.
-	if (filebno >= NDIRECT + NINDIRECT) {
+	if (filebno >= MAXFILESIZE / BLKSIZE) {
 		return -E_INVAL;
 	}
 
 	uint32_t *ppdiskbno = NULL;
 	int err;
-	if ((err = file_block_walk(f, filebno, &ppdiskbno, true)) < 0) {
+	err = file_block_walk(f, filebno, &ppdiskbno, false);
+	if (err < 0 && err != -E_NOT_FOUND) {
 		return err;
 	}
-	if (*ppdiskbno == 0) {
-		int blockno = alloc_block();
-		if (blockno < 0) {
-			return -E_NO_DISK;
+	if (err < 0 || *ppdiskbno == 0) {
+		journal_begin(JBLOCKS_GETBLOCK);
+		err = file_get_block_alloc(f, filebno, &ppdiskbno);
+		journal_end();
+		if (err < 0) {
+			return err;
 		}
-		*ppdiskbno = blockno;
 	}
+	bc_prefetch(*ppdiskbno, 1);
 	*blk = (char *)diskaddr(*ppdiskbno);
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Directory index
+// --------------------------------------------------------------
+
+// Directories this many blocks long or longer get a hashed index when
+// a file is created in them.  Smaller ones are cheaper to scan.
+// Lookups never change the file system: an unindexed directory is
+// simply scanned.
+#define DIRHASH_MINBLOCKS	2
+
+// Hash a file name (32-bit FNV-1a).
+static uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
+// Set *file to the slot'th struct File in dir.
+static int
+dir_slot(struct File *dir, uint32_t slot, struct File **file)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(dir, slot / BLKFILES, &blk)) < 0)
+		return r;
+	*file = (struct File*) blk + slot % BLKFILES;
+	return 0;
+}
+
+// The i'th index entry to probe for a name with this hash is entry
+// *pentry of leaf *pleaf.  Probing runs linearly through the name's own
+// leaf and on into the leaves after it, so a full leaf overflows into
+// the next one.
+static void
+dir_index_pos(uint32_t hash, uint32_t i, uint32_t *pleaf, uint32_t *pentry)
+{
+	*pleaf = (hash + i / DIRHASH_NLEAF) % DIRHASH_NROOT;
+	*pentry = (hash / DIRHASH_NROOT + i) % DIRHASH_NLEAF;
+}
+
+// Set *pe to the i'th index entry to probe for a name with this hash,
+// allocating the root and the entry's leaf if they are missing and
+// 'alloc' is set.
+//
+// Returns 0 on success, -E_NOT_FOUND if the entry's leaf is missing
+// and alloc was 0, or -E_NO_DISK.
+static int
+dir_index_probe(struct File *dir, uint32_t hash, uint32_t i, bool alloc,
+		uint32_t **pe)
+{
+	int r;
+	uint32_t l, e, *root, *leaf;
+
+	dir_index_pos(hash, i, &l, &e);
+	if ((r = indirect_block(&dir->f_dirindex, alloc, &root)) < 0
+	    || (r = indirect_block(&root[l], alloc, &leaf)) < 0)
+		return r;
+	*pe = &leaf[e];
+	return 0;
+}
+
+// Record that the slot'th struct File in dir is named 'name'.
+//
+// Returns 0 on success, -E_NO_DISK if the disk or the whole index is full.
+static int
+dir_index_insert(struct File *dir, const char *name, uint32_t slot)
+{
+	int r;
+	uint32_t hash, i, *e;
+
+	hash = dir_hash(name);
+	for (i = 0; i < DIRHASH_NENTRY; i++) {
+		if ((r = dir_index_probe(dir, hash, i, 1, &e)) < 0)
+			return r;
+		if (*e == 0 || *e == DIRHASH_DELETED) {
+			journal_add(e);
+			*e = slot + 1;
+			return 0;
+		}
+	}
+	return -E_NO_DISK;
+}
+
+// Look 'name' up in dir's index.  Same contract as dir_lookup.
+static int
+dir_index_lookup(struct File *dir, const char *name, struct File **file)
+{
+	int r;
+	uint32_t hash, i, *pe, e;
+	struct File *f;
+
+	hash = dir_hash(name);
+	for (i = 0; i < DIRHASH_NENTRY; i++) {
+		if ((r = dir_index_probe(dir, hash, i, 0, &pe)) < 0)
+			return r;
+		if ((e = *pe) == 0)
+			break;
+		if (e == DIRHASH_DELETED)
+			continue;
+		if ((r = dir_slot(dir, e - 1, &f)) < 0)
+			return r;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			return 0;
+		}
+	}
+	return -E_NOT_FOUND;
+}
+
+// Directories whose index could not be built or kept up to date, for
+// want of disk space, are scanned from then on instead of being
+// reindexed on every create.  Truncating one gives it another chance.
+#define NNOINDEX	16
+
+static struct File *noindex[NNOINDEX];
+static uint32_t noindex_next;
+
+static bool
+dir_index_wanted(struct File *dir)
+{
+	int i;
+
+	if (dir->f_size / BLKSIZE < DIRHASH_MINBLOCKS)
+		return false;
+	for (i = 0; i < NNOINDEX; i++)
+		if (noindex[i] == dir)
+			return false;
+	return true;
+}
+
+// Detach dir's index, as part of the current journal operation, and
+// return its root block (0 if there was none).  Lookups fall back to
+// scanning until it is rebuilt.
+static uint32_t
+dir_index_unlink(struct File *dir)
+{
+	uint32_t root = dir->f_dirindex;
+
+	if (root) {
+		journal_add(dir);
+		dir->f_dirindex = 0;
+	}
+	return root;
+}
+
+// Free the blocks of a detached index rooted at 'root'.  Nothing refers
+// to them any more, so each is freed in an operation of its own: a
+// crash part way through only leaks the rest.
+static void
+dir_index_free_blocks(uint32_t root)
+{
+	uint32_t i, *rootp;
+
+	if (root == 0)
+		return;
+	rootp = diskaddr(root);
+	for (i = 0; i < DIRHASH_NROOT; i++)
+		if (rootp[i]) {
+			journal_begin(1);
+			free_block(rootp[i]);
+			journal_end();
+		}
+	journal_begin(1);
+	free_block(root);
+	journal_end();
+}
+
+// Drop dir's index.
+static void
+dir_index_free(struct File *dir)
+{
+	uint32_t root;
+
+	journal_begin(1);
+	root = dir_index_unlink(dir);
+	journal_end();
+	dir_index_free_blocks(root);
+}
+
+// Free the detached index 'root' of dir after a failed insert, and do
+// not rebuild it.
+static void
+dir_index_give_up(struct File *dir, uint32_t root)
+{
+	dir_index_free_blocks(root);
+	noindex[noindex_next++ % NNOINDEX] = dir;
+}
+
+// Forget that dir could not be indexed.
+static void
+dir_index_retry(struct File *dir)
+{
+	int i;
+
+	for (i = 0; i < NNOINDEX; i++)
+		if (noindex[i] == dir)
+			noindex[i] = 0;
+}
+
+// Set *pe to the i'th entry to probe for hash in an index under
+// construction, rooted at rootp, allocating the entry's leaf if it is
+// missing.  Returns 0 or -E_NO_DISK.
+static int
+dir_index_build_probe(uint32_t *rootp, uint32_t hash, uint32_t i, uint32_t **pe)
+{
+	int r;
+	uint32_t l, e;
+
+	dir_index_pos(hash, i, &l, &e);
+	if (rootp[l] == 0) {
+		// Until dir points at it, a crash only leaks the new block,
+		// so it is allocated by an operation of its own.
+		journal_begin(1);
+		r = alloc_block();
+		journal_end();
+		if (r < 0)
+			return -E_NO_DISK;
+		rootp[l] = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+	}
+	*pe = (uint32_t *) diskaddr(rootp[l]) + e;
+	return 0;
+}
+
+// Index every name in dir.  On failure, leave dir unindexed for good.
+//
+// A whole index is more blocks than a journal transaction holds, so it
+// is filled in off to the side, block by block in the block cache, and
+// written in place before a one-block operation attaches it to dir.
+static void
+dir_index_build(struct File *dir)
+{
+	int r;
+	uint32_t slot, nslot, hash, i, l, root, *rootp, *e;
+	struct File *f;
+
+	journal_begin(1);
+	r = alloc_block();
+	journal_end();
+	if (r < 0) {
+		dir_index_give_up(dir, 0);
+		return;
+	}
+	root = r;
+	rootp = diskaddr(root);
+	memset(rootp, 0, BLKSIZE);
+
+	nslot = dir->f_size / BLKSIZE * BLKFILES;
+	for (slot = 0; slot < nslot; slot++) {
+		if (dir_slot(dir, slot, &f) < 0)
+			goto fail;
+		if (f->f_name[0] == '\0')
+			continue;
+		hash = dir_hash(f->f_name);
+		for (i = 0; i < DIRHASH_NENTRY; i++) {
+			if (dir_index_build_probe(rootp, hash, i, &e) < 0)
+				goto fail;
+			if (*e == 0)
+				break;
+		}
+		if (i == DIRHASH_NENTRY)
+			goto fail;
+		*e = slot + 1;
+	}
+
+	// The blocks may have been freed by operations that are not yet
+	// committed; commit those before overwriting the blocks in place.
+	journal_commit();
+	for (l = 0; l < DIRHASH_NROOT; l++)
+		if (rootp[l])
+			flush_block(diskaddr(rootp[l]));
+	flush_block(rootp);
+
+	journal_begin(1);
+	journal_add(dir);
+	dir->f_dirindex = root;
+	journal_end();
+	return;
+
+fail:
+	dir_index_give_up(dir, root);
+}
+
+// Remove the index entry saying the slot'th struct File in dir is
+// named 'name'.
+static void
+dir_index_remove(struct File *dir, const char *name, uint32_t slot)
+{
+	uint32_t hash, i, *e;
+
+	hash = dir_hash(name);
+	for (i = 0; i < DIRHASH_NENTRY; i++) {
+		if (dir_index_probe(dir, hash, i, 0, &e) < 0 || *e == 0)
+			return;
+		if (*e == slot + 1) {
+			journal_add(e);
+			*e = DIRHASH_DELETED;
+			return;
+		}
+	}
+}
+
+// --------------------------------------------------------------
+// Directory entry cache
+// --------------------------------------------------------------
+
+// Recent dir_lookup results, keyed by (directory, name).  A null
+// d_file records that the name is known to be absent.  The cache is
+// direct-mapped, so it never holds more than NDCACHE names; file_create
+// and file_remove update the entries they affect, and anything that
+// frees directory slots wholesale purges the cache.
+#define NDCACHE		512
+
+struct Dentry {
+	struct File *d_dir;		// directory searched, 0 if unused
+	struct File *d_file;		// what was found, 0 if nothing
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDCACHE];
+static struct Fsret_stats dcstats;
+
+static struct Dentry *
+dcache_entry(struct File *dir, const char *name)
+{
+	return &dcache[(dir_hash(name) ^ ((uintptr_t) dir / sizeof(struct File)))
+		       % NDCACHE];
+}
+
+// Remember that looking up 'name' in dir yields file (0 if absent).
+static void
+dcache_set(struct File *dir, const char *name, struct File *file)
+{
+	struct Dentry *d = dcache_entry(dir, name);
+
+	d->d_dir = dir;
+	d->d_file = file;
+	strcpy(d->d_name, name);
+}
+
+// Forget every name cached under dir, or everything if dir is 0.
+static void
+dcache_purge(struct File *dir)
+{
+	int i;
+
+	for (i = 0; i < NDCACHE; i++)
+		if (dir == 0 || dcache[i].d_dir == dir)
+			dcache[i].d_dir = 0;
+}
+
+// Report how well the dentry cache is doing.
+void
+dcache_stats(struct Fsret_stats *ret)
+{
+	*ret = dcstats;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -255,12 +752,29 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	uint32_t i, j, nblock;
 	char *blk;
 	struct File *f;
+	struct Dentry *d;
+
+	dcstats.ret_lookups++;
+	d = dcache_entry(dir, name);
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+		dcstats.ret_hits++;
+		if (d->d_file == 0) {
+			dcstats.ret_neghits++;
+			return -E_NOT_FOUND;
+		}
+		*file = d->d_file;
+		return 0;
+	}
 
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
+	if (dir->f_dirindex) {
+		r = dir_index_lookup(dir, name, file);
+		goto done;
+	}
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
@@ -268,16 +782,23 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
 				*file = &f[j];
-				return 0;
+				r = 0;
+				goto done;
 			}
 	}
-	return -E_NOT_FOUND;
+	r = -E_NOT_FOUND;
+
+done:
+	if (r == 0 || r == -E_NOT_FOUND)
+		dcache_set(dir, name, r == 0 ? *file : 0);
+	return r;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *slot to its
+// position in the directory.  The caller is responsible for filling in
+// the File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *slot)
 {
 	int r;
 	uint32_t nblock, i, j;
@@ -286,21 +807,28 @@ dir_alloc_file(struct File *dir, struct File **file)
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	j = dir->f_dirfree % BLKFILES;
+	for (i = dir->f_dirfree / BLKFILES; i < nblock; i++, j = 0) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+		for (; j < BLKFILES; j++)
+			if (f[j].f_name[0] == '\0')
+				goto found;
 	}
+	i = nblock;
+	j = 0;
+	journal_add(dir);
 	dir->f_size += BLKSIZE;
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
-	*file = &f[0];
+
+found:
+	*file = &f[j];
+	*slot = i * BLKFILES + j;
+	journal_add(dir);
+	dir->f_dirfree = *slot + 1;
 	return 0;
 }
 
@@ -380,18 +908,34 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t slot, dropped = 0;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
-		return r;
 
+	journal_begin(JBLOCKS_CREATE);
+	if ((r = dir_alloc_file(dir, &f, &slot)) < 0) {
+		journal_end();
+		return r;
+	}
+	journal_add(f);
+	memset(f, 0, sizeof(struct File));
 	strcpy(f->f_name, name);
+	if (dir->f_dirindex && dir_index_insert(dir, name, slot) < 0)
+		dropped = dir_index_unlink(dir);
+	journal_end();
+
+	// A directory gets its index once it has grown long enough to be
+	// worth one, which includes the name just added.
+	if (dropped)
+		dir_index_give_up(dir, dropped);
+	else if (dir->f_dirindex == 0 && dir_index_wanted(dir))
+		dir_index_build(dir);
+	dcache_set(dir, name, f);
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -405,24 +949,37 @@ file_open(const char *path, struct File **pf)
 
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
+// Holes read as zeros rather than being filled in, so reading never
+// changes the file system and several reads can be in progress at once.
 // Returns the number of bytes read, < 0 on error.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
 	int r, bn;
 	off_t pos;
-	char *blk;
+	uint32_t *pdiskbno;
 
 	if (offset >= f->f_size)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	if (count == 0)
+		return 0;
+
+	file_prefetch(f, offset / BLKSIZE,
+		      (offset + count - 1) / BLKSIZE - offset / BLKSIZE + 1);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
-			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
+		r = file_block_walk(f, pos / BLKSIZE, &pdiskbno, 0);
+		if (r == -E_NOT_FOUND || (r == 0 && *pdiskbno == 0))
+			memset(buf, 0, bn);
+		else if (r < 0)
+			return r;
+		else {
+			bc_prefetch(*pdiskbno, 1);
+			memmove(buf, (char *) diskaddr(*pdiskbno) + pos % BLKSIZE, bn);
+		}
 		pos += bn;
 		buf += bn;
 	}
@@ -467,11 +1024,16 @@ file_free_block(struct File *f, uint32_t filebno)
 	int r;
 	uint32_t *ptr;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) == -E_NOT_FOUND)
+		return 0;
+	if (r < 0)
 		return r;
 	if (*ptr) {
+		journal_begin(JBLOCKS_FREE);
 		free_block(*ptr);
+		journal_add(ptr);
 		*ptr = 0;
+		journal_end();
 	}
 	return 0;
 }
@@ -484,22 +1046,58 @@ file_free_block(struct File *f, uint32_t filebno)
 // been allocated (f->f_indirect != 0), then free the indirect block too.
 // (Remember to clear the f->f_indirect pointer so you'll know
 // whether it's valid!)
+// Likewise free the blocks under the double-indirect block that no
+// longer hold any pointers, and the double-indirect block itself.
 // Do not change f->f_size.
+//
+// Each block is freed by a journal operation of its own, along with the
+// pointer to it, so the file is consistent (if partly truncated) after
+// a crash at any point.  The extents go first, since they must never
+// describe a freed block.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, *dind;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	journal_begin(1);
+	journal_add(f);
+	file_extent_truncate(f, new_nblocks);
+	journal_end();
+
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
 
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
+		journal_begin(JBLOCKS_FREE);
 		free_block(f->f_indirect);
+		journal_add(f);
 		f->f_indirect = 0;
+		journal_end();
+	}
+
+	if (f->f_dindirect) {
+		dind = (uint32_t *) diskaddr(f->f_dindirect);
+		bno = new_nblocks > NDIRECT + NINDIRECT ?
+			new_nblocks - NDIRECT - NINDIRECT : 0;
+		for (bno = (bno + NINDIRECT - 1) / NINDIRECT; bno < NINDIRECT; bno++)
+			if (dind[bno]) {
+				journal_begin(JBLOCKS_FREE);
+				free_block(dind[bno]);
+				journal_add(dind);
+				dind[bno] = 0;
+				journal_end();
+			}
+		if (new_nblocks <= NDIRECT + NINDIRECT) {
+			journal_begin(JBLOCKS_FREE);
+			free_block(f->f_dindirect);
+			journal_add(f);
+			f->f_dindirect = 0;
+			journal_end();
+		}
 	}
 }
 
@@ -507,41 +1105,165 @@ file_truncate_blocks(struct File *f, off_t newsize)
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	if (f->f_size > newsize) {
+		if (f->f_type == FTYPE_DIR) {
+			dir_index_free(f);
+			dir_index_retry(f);
+			dcache_purge(0);
+		}
 		file_truncate_blocks(f, newsize);
+	}
+	journal_begin(1);
+	journal_add(f);
 	f->f_size = newsize;
-	flush_block(f);
+	journal_end();
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
+// The metadata goes out by committing the journal transaction, which
+// must come first: a directory's contents are metadata too.
+// Then loop over all the blocks in file.
 // Translate the file block number into a disk block number
 // and then check whether that disk block is dirty.  If so, write it out.
 void
 file_flush(struct File *f)
 {
-	int i;
+	uint32_t i, n, covered, nblocks;
 	uint32_t *pdiskbno;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
+	journal_commit();
+
+	// The extents give the file's leading blocks as disk runs, so only
+	// blocks past them need to be looked up one by one.
+	nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	for (i = covered = 0; i < f->f_nextents && covered < nblocks; i++) {
+		n = MIN(f->f_extents[i].e_len, nblocks - covered);
+		flush_blocks(f->f_extents[i].e_start, n);
+		covered += n;
+	}
+	for (i = covered; i < nblocks; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
 		flush_block(diskaddr(*pdiskbno));
 	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Remove a file.  Directories must be empty, and a file a client has
+// open is busy (-E_BUSY).
+int
+file_remove(const char *path)
+{
+	int r;
+	uint32_t i, nblock, slot, nslot;
+	char *blk;
+	struct File *dir, *f, *child;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (dir == 0)
+		return -E_INVAL;
+	// Clients only open files with fslock held exclusively, as the
+	// caller holds it, so f cannot be opened from here on.
+	if (file_in_use(f))
+		return -E_BUSY;
+
+	if (f->f_type == FTYPE_DIR) {
+		nslot = f->f_size / BLKSIZE * BLKFILES;
+		for (slot = 0; slot < nslot; slot++) {
+			if ((r = dir_slot(f, slot, &child)) < 0)
+				return r;
+			if (child->f_name[0] != '\0')
+				return -E_INVAL;
+		}
+	}
+
+	// Find f's slot in dir
+	nblock = dir->f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		if ((r = file_get_block(dir, i, &blk)) < 0)
+			return r;
+		if (f >= (struct File*) blk && f < (struct File*) blk + BLKFILES)
+			break;
+	}
+	assert(i < nblock);
+	slot = i * BLKFILES + (f - (struct File*) blk);
+
+	file_set_size(f, 0);
+	dcache_purge(f);
+	dcache_set(dir, f->f_name, 0);
+
+	// The index leaf, f's block and dir's block.
+	journal_begin(3);
+	if (dir->f_dirindex)
+		dir_index_remove(dir, f->f_name, slot);
+	journal_add(f);
+	memset(f, 0, sizeof(struct File));
+	if (slot < dir->f_dirfree) {
+		journal_add(dir);
+		dir->f_dirfree = slot;
+	}
+	journal_end();
+	return 0;
+}
+
+// Sync the entire file system.  The checkpoint writes out every dirty
+// block, not just the journaled ones.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	journal_commit();
+	journal_checkpoint();
 }
 
+
+// Convert the version 1 tree rooted at directory 'dir' to version 2.
+// Version 1 never initialized the bytes that now hold f_dindirect and the
+// extents, so clear them (and unused slots entirely) before trusting them.
+static void
+fs_upgrade_dir(struct File *dir)
+{
+	uint32_t i, j, nblock;
+	char *blk;
+	struct File *f;
+
+	assert((dir->f_size % BLKSIZE) == 0);
+	nblock = dir->f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		if (file_get_block(dir, i, &blk) < 0)
+			panic("fs_upgrade: cannot read directory %s", dir->f_name);
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++) {
+			if (f[j].f_name[0] == '\0') {
+				memset(&f[j], 0, sizeof(struct File));
+				continue;
+			}
+			memset(&f[j].f_dindirect, 0,
+			       sizeof(struct File) - offsetof(struct File, f_dindirect));
+			file_extent_rebuild(&f[j]);
+			if (f[j].f_type == FTYPE_DIR)
+				fs_upgrade_dir(&f[j]);
+		}
+		flush_block(blk);
+	}
+}
+
+// Upgrade a version 1 (FS_MAGIC) file system to version 2 in place.
+// The version 1 File layout is a prefix of the version 2 one, so only
+// the new fields need to be initialized.
+static void
+fs_upgrade(void)
+{
+	struct File *root = &super->s_root;
+
+	memset(&root->f_dindirect, 0,
+	       sizeof(struct File) - offsetof(struct File, f_dindirect));
+	file_extent_rebuild(root);
+	fs_upgrade_dir(root);
+
+	super->s_magic = FS_MAGIC_V2;
+	flush_block(super);
+	cprintf("file system upgraded to version 2\n");
+}
@@ -26,8 +26,19 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	flush_blocks(uint32_t blockno, uint32_t nblocks);
+void	bc_prefetch(uint32_t blockno, uint32_t nblocks);
+int	bc_share(void *blk, void *va);
 void	bc_init(void);
 
+/* journal.c */
+void	journal_init(void);
+void	journal_begin(uint32_t nblocks);
+void	journal_end(void);
+void	journal_add(void *addr);
+void	journal_commit(void);
+void	journal_checkpoint(void);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
@@ -39,11 +50,15 @@ int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
+void	dcache_stats(struct Fsret_stats *ret);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
-int     write_block_to_disk(int blockno, void *addr);
+
+/* serv.c */
+bool	fs_yield(void);
+bool	file_in_use(struct File *f);
 
 /* test.c */
 void	fs_test(void);
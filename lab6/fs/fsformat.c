@@ -33,6 +33,8 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+// The file server can't address more than 3GB of disk (DISKSIZE in fs/fs.h).
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
 
 struct Dir
 {
@@ -42,6 +44,7 @@ struct Dir
 };
 
 uint32_t nblocks;
+uint32_t njournal = NJOURNAL;
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
@@ -92,6 +95,7 @@ void
 opendisk(const char *name)
 {
 	int r, diskfd, nbitblocks;
+	struct JournalSuper *js;
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -109,7 +113,7 @@ opendisk(const char *name)
 	diskpos = diskmap;
 	alloc(BLKSIZE);
 	super = alloc(BLKSIZE);
-	super->s_magic = FS_MAGIC;
+	super->s_magic = FS_MAGIC_V2;
 	super->s_nblocks = nblocks;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
@@ -117,6 +121,14 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	if (njournal > 0) {
+		js = alloc(njournal * BLKSIZE);
+		js->js_magic = JOURNAL_MAGIC;
+		js->js_seq = 1;
+		super->s_journal = blockof(js);
+		super->s_njournal = njournal;
+	}
 }
 
 void
@@ -134,24 +146,44 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	uint32_t i, n, *ind, *dind;
+
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
+	n = ROUNDUP(len, BLKSIZE) / BLKSIZE;
+	for (i = 0; i < n && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
+	if (i < n) {
+		ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < n && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i < n) {
+		dind = alloc(BLKSIZE);
+		f->f_dindirect = blockof(dind);
+		for (; i < n; ++i) {
+			uint32_t j = i - NDIRECT - NINDIRECT;
+			if (j % NINDIRECT == 0)
+				dind[j / NINDIRECT] = blockof(alloc(BLKSIZE));
+			ind = (uint32_t *) (diskmap + dind[j / NINDIRECT] * BLKSIZE);
+			ind[j % NINDIRECT] = start + i;
+		}
+	}
+
+	// The data was laid out contiguously, so one extent covers it all.
+	f->f_nextents = 0;
+	if (n > 0) {
+		f->f_nextents = 1;
+		f->f_extents[0].e_start = start;
+		f->f_extents[0].e_len = n;
+	}
 }
 
 void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -211,7 +243,7 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-j JOURNALBLOCKS] fs.img NBLOCKS files...\n");
 	exit(2);
 }
 
@@ -224,11 +256,19 @@ main(int argc, char **argv)
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		njournal = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2]
+		    || (njournal != 0 && njournal < JOURNAL_MAXTXN + 2))
+			usage();
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 3)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
 	opendisk(argv[1]);
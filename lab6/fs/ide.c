@@ -14,19 +14,38 @@
 
 static int diskno = 1;
 
+// Set while a command is in progress.  Waiting for the disk lets other
+// file server threads run, and they must not start commands of their own.
+static bool ide_busy;
+
+// Wait for the disk.  Other threads run meanwhile; once they are all
+// waiting too, the dispatcher puts the file server to sleep between
+// polls (see serve).
 static int
 ide_wait_ready(bool check_error)
 {
 	int r;
 
 	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
-		/* do nothing */;
+		fs_yield();
 
 	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
 		return -1;
 	return 0;
 }
 
+// Threads only read blocks in on their own stacks, where they can wait
+// (see bc_pgfault); the page fault handler never needs the disk while a
+// thread is using it.
+static void
+ide_lock(void)
+{
+	while (ide_busy)
+		if (!fs_yield())
+			panic("ide: disk busy, and cannot wait for it here");
+	ide_busy = 1;
+}
+
 bool
 ide_probe_disk1(void)
 {
@@ -63,10 +82,11 @@ ide_set_disk(int d)
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
-	int r;
+	int r = 0;
 
 	assert(nsecs <= 256);
 
+	ide_lock();
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -78,20 +98,22 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			break;
 		insl(0x1F0, dst, SECTSIZE/4);
 	}
 
-	return 0;
+	ide_busy = 0;
+	return r;
 }
 
 int
 ide_write(uint32_t secno, const void *src, size_t nsecs)
 {
-	int r;
+	int r = 0;
 
 	assert(nsecs <= 256);
 
+	ide_lock();
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -103,10 +125,11 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			break;
 		outsl(0x1F0, src, SECTSIZE/4);
 	}
 
-	return 0;
+	ide_busy = 0;
+	return r;
 }
 
@@ -0,0 +1,229 @@
+/*
+ * Write-ahead metadata journal.
+ *
+ * Code that changes a metadata block calls journal_add() first.  The
+ * blocks named since the last commit form the current transaction;
+ * journal_commit() writes it to the journal with a single disk command
+ * (see inc/fs.h for the layout).  Committed blocks stay dirty in the
+ * block cache, and are written in place only at a checkpoint, once the
+ * journal fills up or the file system is synced.
+ *
+ * Each file system operation runs between journal_begin(), which names
+ * the most blocks it can change, and journal_end().  A transaction only
+ * ever holds whole operations: journal_begin() commits first if the
+ * operation might not fit, and nothing commits until journal_end().
+ *
+ * Data blocks are not journaled, so after a crash a file may hold stale
+ * data, but the file system structure is always consistent.  (Long jobs
+ * such as truncation run as a series of operations, each leaving the
+ * structure consistent; at worst a crash leaks blocks that nothing
+ * refers to.)
+ *
+ * Disks without a journal (s_journal == 0, e.g. upgraded version 1
+ * disks) get the old synchronous behavior: a commit writes the changed
+ * blocks in place.
+ */
+
+#include "fs.h"
+
+#define debug 0
+
+static uint32_t jstart;		// first journal block
+static uint32_t jsize;		// journal length, 0 if there is none
+static uint32_t jseq;		// sequence number of the next transaction
+static uint32_t jhead;		// where it goes, relative to jstart
+
+// The current transaction.
+static uint32_t txn[JOURNAL_MAXTXN];
+static uint32_t ntxn;
+static uint32_t nested;		// journal_begin()s not yet ended
+
+// A transaction is assembled here, so it can go out in one disk command.
+static char jbuf[(JOURNAL_MAXTXN + 1) * BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+static uint32_t
+journal_cksum(struct JournalHeader *h, const char *blocks)
+{
+	uint32_t i, c = 2166136261U;
+	const uint32_t *w = (const uint32_t *) blocks;
+
+	c = (c ^ h->jh_seq) * 16777619U;
+	c = (c ^ h->jh_nblocks) * 16777619U;
+	for (i = 0; i < h->jh_nblocks; i++)
+		c = (c ^ h->jh_blocknos[i]) * 16777619U;
+	for (i = 0; i < h->jh_nblocks * BLKSIZE / 4; i++)
+		c = (c ^ w[i]) * 16777619U;
+	return c;
+}
+
+// Write the journal super block, recording that the next transaction
+// is jseq and goes right after it.
+static void
+journal_write_super(void)
+{
+	struct JournalSuper *js = (struct JournalSuper *) jbuf;
+
+	memset(jbuf, 0, BLKSIZE);
+	js->js_magic = JOURNAL_MAGIC;
+	js->js_seq = jseq;
+	if (ide_write(jstart * BLKSECTS, jbuf, BLKSECTS) < 0)
+		panic("journal: cannot write journal super block");
+	jhead = 1;
+}
+
+// Write every block committed since the last checkpoint in place, and
+// start the journal over.  There must be no uncommitted changes, so
+// this simply writes out all dirty blocks, data included.
+void
+journal_checkpoint(void)
+{
+	assert(ntxn == 0);
+	flush_blocks(0, super->s_nblocks);
+	if (jsize && jhead > 1)
+		journal_write_super();
+}
+
+// Write the current transaction to the journal.
+void
+journal_commit(void)
+{
+	struct JournalHeader *h = (struct JournalHeader *) jbuf;
+	uint32_t i;
+
+	if (nested)
+		panic("journal_commit inside an operation");
+	if (ntxn == 0)
+		return;
+	if (debug)
+		cprintf("journal_commit %d: %d blocks at %d\n", jseq, ntxn, jhead);
+
+	if (jsize == 0) {
+		for (i = 0; i < ntxn; i++)
+			flush_block(diskaddr(txn[i]));
+		ntxn = 0;
+		return;
+	}
+
+	memset(h, 0, BLKSIZE);
+	h->jh_magic = JOURNAL_MAGIC;
+	h->jh_seq = jseq;
+	h->jh_nblocks = ntxn;
+	for (i = 0; i < ntxn; i++) {
+		h->jh_blocknos[i] = txn[i];
+		memmove(jbuf + (i + 1) * BLKSIZE, diskaddr(txn[i]), BLKSIZE);
+	}
+	h->jh_cksum = journal_cksum(h, jbuf + BLKSIZE);
+	if (ide_write((jstart + jhead) * BLKSECTS, jbuf,
+		      (ntxn + 1) * BLKSECTS) < 0)
+		panic("journal: cannot write transaction");
+
+	jhead += ntxn + 1;
+	jseq++;
+	ntxn = 0;
+
+	// Make sure the next transaction will fit
+	if (jhead + JOURNAL_MAXTXN + 1 > jsize)
+		journal_checkpoint();
+}
+
+// Start an operation that changes at most nblocks metadata blocks,
+// committing the current transaction first if they might not fit.
+// Operations nest; an inner one counts against the outer's reservation.
+void
+journal_begin(uint32_t nblocks)
+{
+	assert(nblocks <= JOURNAL_MAXTXN);
+	if (nested == 0 && ntxn + nblocks > JOURNAL_MAXTXN)
+		journal_commit();
+	nested++;
+}
+
+// End the operation started by the matching journal_begin().
+void
+journal_end(void)
+{
+	assert(nested > 0);
+	nested--;
+}
+
+// Note that the metadata block containing addr is about to change.
+// Call this before making the change.  Outside an operation, the
+// change is an operation of its own.
+void
+journal_add(void *addr)
+{
+	uint32_t i, blockno;
+
+	if (addr < (void *) DISKMAP || addr >= (void *) (DISKMAP + DISKSIZE))
+		panic("journal_add of bad va %08x", addr);
+	blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+
+	for (i = 0; i < ntxn; i++)
+		if (txn[i] == blockno)
+			return;
+	if (ntxn == JOURNAL_MAXTXN) {
+		if (nested)
+			panic("journal_add: operation changes more blocks than it reserved");
+		journal_commit();
+	}
+	txn[ntxn++] = blockno;
+}
+
+// Find the journal and replay any transactions in it.
+void
+journal_init(void)
+{
+	struct JournalSuper *js = (struct JournalSuper *) jbuf;
+	struct JournalHeader *h = (struct JournalHeader *) jbuf;
+	uint32_t i, n;
+
+	jstart = super->s_journal;
+	jsize = jstart ? super->s_njournal : 0;
+	if (jsize == 0)
+		return;
+	if (jsize < JOURNAL_MAXTXN + 2 || jstart + jsize > super->s_nblocks)
+		panic("journal: bad journal at %d, %d blocks", jstart, jsize);
+	for (i = 0; i < jsize; i++)
+		if (block_is_free(jstart + i))
+			panic("journal: block %d is free", jstart + i);
+
+	if (ide_read(jstart * BLKSECTS, jbuf, BLKSECTS) < 0)
+		panic("journal: cannot read journal super block");
+	if (js->js_magic != JOURNAL_MAGIC)
+		panic("journal: bad journal super block");
+	jseq = js->js_seq;
+
+	for (jhead = 1, n = 0; jhead + 1 < jsize; jhead += h->jh_nblocks + 1, n++) {
+		if (ide_read((jstart + jhead) * BLKSECTS, jbuf, BLKSECTS) < 0)
+			panic("journal: cannot read transaction header");
+		if (h->jh_magic != JOURNAL_MAGIC || h->jh_seq != jseq
+		    || h->jh_nblocks == 0 || h->jh_nblocks > JOURNAL_MAXTXN
+		    || jhead + 1 + h->jh_nblocks > jsize)
+			break;
+		if (ide_read((jstart + jhead + 1) * BLKSECTS, jbuf + BLKSIZE,
+			     h->jh_nblocks * BLKSECTS) < 0)
+			panic("journal: cannot read transaction");
+		if (h->jh_cksum != journal_cksum(h, jbuf + BLKSIZE))
+			break;
+
+		// Replay it into the block cache; the checkpoint below
+		// writes the blocks in place.  (Load them explicitly: the
+		// fault handler would object to blocks that the bitmap on
+		// disk still calls free.)
+		for (i = 0; i < h->jh_nblocks; i++) {
+			if (h->jh_blocknos[i] == 0
+			    || h->jh_blocknos[i] >= super->s_nblocks)
+				panic("journal: bad block %d", h->jh_blocknos[i]);
+			bc_prefetch(h->jh_blocknos[i], 1);
+			memmove(diskaddr(h->jh_blocknos[i]),
+				jbuf + (i + 1) * BLKSIZE, BLKSIZE);
+		}
+		jseq++;
+	}
+
+	if (n > 0) {
+		journal_checkpoint();
+		cprintf("journal: replayed %d transactions\n", n);
+	} else
+		jhead = 1;
+}
@@ -5,6 +5,7 @@
 
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <arch/thread.h>
 
 #include "fs.h"
 
@@ -46,7 +47,80 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// A bulk window or ring being set up arrives in the FSREQPAGES pages
+// starting here.
+#define FSREQPAGES	(1 + FSRINGDATAPAGES)
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - FSREQPAGES * PGSIZE);
+
+#if FSBULKPAGES > FSREQPAGES
+#error "a bulk window does not fit at fsreq"
+#endif
+
+// Clients' bulk transfer windows, mapped at BULKVA + i * FSBULKSIZE.
+#define NBULK		16
+#define BULKVA		(DISKMAP - FSREQPAGES * PGSIZE - NBULK * FSBULKSIZE)
+
+envid_t bulktab[NBULK];
+
+// Requests are served by cooperative threads (net/lwip/jos/arch), one
+// per request, so that requests the block cache can answer do not queue
+// up behind ones waiting for the disk.  The dispatcher thread in serve()
+// receives requests and hands each one, with its request page, to a new
+// worker thread.  Threads switch only in fs_yield (while waiting for the
+// disk) and while waiting for fslock.
+#define NREQ		32
+#define REQVA		(BULKVA - NREQ * PGSIZE)
+
+// Pages sent by a map request are gathered at MAPVA + i * FSMAPPAGES *
+// PGSIZE, for the request in reqtab[i], since IPC only sends contiguous
+// pages.
+#define MAPVA		(REQVA - NREQ * FSMAPPAGES * PGSIZE)
+
+struct Request {
+	envid_t rq_whom;	// client
+	uint32_t rq_req;	// request code
+	union Fsipc *rq_ipc;	// request page, at REQVA; 0 if slot is free
+};
+
+struct Request reqtab[NREQ];
+int nworkers;			// worker threads alive
+int nwaiting;			// threads switched out in fs_yield
+
+// When every worker is waiting for the disk, the dispatcher sleeps this
+// long (ns) at a time, instead of switching threads until one is done.
+// A request arriving ends the sleep.
+#define DISKWAIT	(100 * 1000)
+
+// Clients' request rings, each followed by its data pages, mapped at
+// RINGVA + i * RINGSIZE for the client in ringtab[i].  The dispatcher
+// takes submissions off the rings whenever it looks for work, and
+// serves each one in a worker thread of its own, with the request in
+// ringreqs[].
+#define NRING		16
+#define RINGSIZE	((1 + FSRINGDATAPAGES) * PGSIZE)
+#define RINGVA		(MAPVA - NRING * RINGSIZE)
+#define RING(i)		((struct Fsring *) (RINGVA + (i) * RINGSIZE))
+
+struct Ring {
+	envid_t ri_owner;	// client, 0 if the slot is free
+	uint32_t ri_busy;	// requests taken but not yet completed
+};
+
+struct RingRequest {
+	bool rr_used;
+	int rr_ring;		// ringtab slot
+	struct Fsring_sqe rr_sqe;
+};
+
+struct Ring ringtab[NRING];
+struct RingRequest ringreqs[NREQ];
+
+// Requests that only look at the file system hold fslock shared, so any
+// number of them may wait for the disk at once; the rest hold it
+// exclusively.  A waiting exclusive holder keeps new shared ones out.
+static int fslock_shared;
+static bool fslock_excl;
+static int fslock_waiting;
 
 void
 serve_init(void)
@@ -133,6 +207,12 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 				cprintf("file_create failed: %e", r);
 			return r;
 		}
+		if (req->req_omode & O_MKDIR) {
+			journal_begin(1);
+			journal_add(f);
+			f->f_type = FTYPE_DIR;
+			journal_end();
+		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
@@ -150,12 +230,6 @@ try_open:
 			return r;
 		}
 	}
-	if ((r = file_open(path, &f)) < 0) {
-		if (debug)
-			cprintf("file_open failed: %e", r);
-		return r;
-	}
-
 	// Save the file pointer
 	o->o_file = f;
 
@@ -223,7 +297,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	ssize_t count;
 	if ((count = file_read(op->o_file,
 			       ret->ret_buf,
-			       req->req_n,
+			       MIN(req->req_n, sizeof(ret->ret_buf)),
 			       op->o_fd->fd_offset)) < 0) {
 		return count;
 	}
@@ -253,7 +327,7 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	int count;
 	if ((count = file_write(op->o_file,
 				req->req_buf,
-				req->req_n,
+				MIN(req->req_n, sizeof(req->req_buf)),
 				op->o_fd->fd_offset)) < 0) {
 		return count;
 	}
@@ -299,6 +373,23 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Remove the file req->req_path.  A file that is open (or mapped, which
+// keeps it open) cannot be removed: its blocks and its struct File must
+// stay put while anyone can still reach them through an OpenFile.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	return file_remove(path);
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -307,6 +398,211 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Adopt the npages pages just received at fsreq as envid's bulk window,
+// replacing any window it had before.  Windows belonging to
+// environments that have exited are reused.
+int
+serve_bulk_setup(envid_t envid, size_t npages)
+{
+	int i, slot, r;
+	const volatile struct Env *e;
+
+	if (debug)
+		cprintf("serve_bulk_setup %08x %d\n", envid, npages);
+
+	if (npages != FSBULKPAGES)
+		return -E_INVAL;
+
+	slot = -1;
+	for (i = 0; i < NBULK; i++) {
+		e = &envs[ENVX(bulktab[i])];
+		if (bulktab[i] == envid) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 && (bulktab[i] == 0 || e->env_id != bulktab[i]
+				 || e->env_status == ENV_FREE))
+			slot = i;
+	}
+	if (slot < 0)
+		return -E_MAX_OPEN;
+
+	bulktab[slot] = 0;
+	for (i = 0; i < FSBULKPAGES; i++)
+		if ((r = sys_page_map(0, (char *) fsreq + i * PGSIZE,
+				      0, (char *) BULKVA + slot * FSBULKSIZE + i * PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	bulktab[slot] = envid;
+	return 0;
+}
+
+// Adopt the ring page and data pages just received at fsreq as envid's
+// request ring, replacing any ring it had before.  Rings belonging to
+// environments that have exited are reused once their requests are
+// done.
+int
+serve_ring_setup(envid_t envid, size_t npages)
+{
+	int i, slot, r;
+	const volatile struct Env *e;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x %d\n", envid, npages);
+
+	if (npages != 1 + FSRINGDATAPAGES)
+		return -E_INVAL;
+
+	slot = -1;
+	for (i = 0; i < NRING; i++) {
+		e = &envs[ENVX(ringtab[i].ri_owner)];
+		if (ringtab[i].ri_owner == envid) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 && ringtab[i].ri_busy == 0
+		    && (ringtab[i].ri_owner == 0 || e->env_id != ringtab[i].ri_owner
+			|| e->env_status == ENV_FREE))
+			slot = i;
+	}
+	if (slot < 0)
+		return -E_MAX_OPEN;
+	if (ringtab[slot].ri_busy)
+		return -E_INVAL;
+
+	ringtab[slot].ri_owner = 0;
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_map(0, (char *) fsreq + i * PGSIZE,
+				      0, (char *) RING(slot) + i * PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	ringtab[slot].ri_owner = envid;
+	return 0;
+}
+
+// Find envid's bulk window.
+static int
+bulk_lookup(envid_t envid, char **pwin)
+{
+	int i;
+
+	for (i = 0; i < NBULK; i++)
+		if (bulktab[i] == envid) {
+			*pwin = (char *) BULKVA + i * FSBULKSIZE;
+			return 0;
+		}
+	return -E_INVAL;
+}
+
+// Read up to ipc->bulk.req_n bytes from the current seek position in
+// ipc->bulk.req_fileid into the caller's bulk window, and update the
+// seek position.  Returns the number of bytes read, or < 0 on error.
+int
+serve_bulk_read(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_bulk *req = &ipc->bulk;
+	struct OpenFile *o;
+	char *win;
+	int r;
+
+	if (debug)
+		cprintf("serve_bulk_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((r = bulk_lookup(envid, &win)) < 0)
+		return r;
+	if ((r = file_read(o->o_file, win, MIN(req->req_n, FSBULKSIZE),
+			   o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Write ipc->bulk.req_n bytes from the caller's bulk window at the
+// current seek position in ipc->bulk.req_fileid, and update the seek
+// position.  Returns the number of bytes written, or < 0 on error.
+int
+serve_bulk_write(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_bulk *req = &ipc->bulk;
+	struct OpenFile *o;
+	char *win;
+	int r;
+
+	if (debug)
+		cprintf("serve_bulk_write %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((r = bulk_lookup(envid, &win)) < 0)
+		return r;
+	if ((r = file_write(o->o_file, win, MIN(req->req_n, FSBULKSIZE),
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Find the block cache pages holding the req->req_npages pages of
+// req->req_fileid starting at req->req_offset, storing the first of
+// them, their number, and the permissions with which to map them into
+// the calling environment in *pg_store, *npages_store and *perm_store.
+// The pages are gathered at 'stage', and shared with the block cache
+// until the cache changes them (see bc_share), so the client gets a
+// snapshot of the file that later writes, truncation or removal do not
+// touch.  Private mappings are marked copy-on-write; shared ones are
+// read-only, since the server could not see the client's writes to mark
+// the blocks dirty.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, void *stage,
+	  void **pg_store, size_t *npages_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	size_t i, npages = req->req_npages;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %d\n", envid, req->req_fileid,
+			req->req_offset, npages);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (req->req_offset < 0 || req->req_offset % PGSIZE != 0
+	    || req->req_offset >= o->o_file->f_size
+	    || npages < 1 || npages > FSMAPPAGES
+	    || npages > ROUNDUP(o->o_file->f_size - req->req_offset, PGSIZE) / PGSIZE)
+		return -E_INVAL;
+
+	for (i = 0; i < npages; i++) {
+		if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE + i,
+					&blk)) < 0
+		    || (r = bc_share(blk, stage + i * PGSIZE)) < 0)
+			goto fail;
+	}
+
+	*pg_store = stage;
+	*npages_store = npages;
+	*perm_store = PTE_P|PTE_U|(req->req_private ? PTE_COW : 0);
+	return 0;
+
+ fail:
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, stage + i * PGSIZE);
+	return r;
+}
+
+// Return the file server's statistics in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	dcache_stats(&ipc->statsRet);
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -317,23 +613,308 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_BULK_READ] =	serve_bulk_read,
+	[FSREQ_BULK_WRITE] =	serve_bulk_write
 };
 
+// Carry out the ring request sqe for envid, whose data pages are at
+// data.  Returns what goes in the completion.
+static int
+ring_execute(envid_t envid, struct Fsring_sqe *sqe, char *data)
+{
+	struct Fsret_stat *st;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("ring_execute %08x %d %08x %08x %08x\n", envid,
+			sqe->sqe_op, sqe->sqe_fileid, sqe->sqe_offset, sqe->sqe_n);
+
+	if (sqe->sqe_buf > FSRINGDATASIZE
+	    || sqe->sqe_n > FSRINGDATASIZE - sqe->sqe_buf || sqe->sqe_offset < 0)
+		return -E_INVAL;
+	if ((r = openfile_lookup(envid, sqe->sqe_fileid, &o)) < 0)
+		return r;
+
+	switch (sqe->sqe_op) {
+	case FSRING_READ:
+		return file_read(o->o_file, data + sqe->sqe_buf, sqe->sqe_n,
+				 sqe->sqe_offset);
+	case FSRING_WRITE:
+		return file_write(o->o_file, data + sqe->sqe_buf, sqe->sqe_n,
+				  sqe->sqe_offset);
+	case FSRING_STAT:
+		if (sqe->sqe_n < sizeof(struct Fsret_stat))
+			return -E_INVAL;
+		st = (struct Fsret_stat *) (data + sqe->sqe_buf);
+		strcpy(st->ret_name, o->o_file->f_name);
+		st->ret_size = o->o_file->f_size;
+		st->ret_isdir = (o->o_file->f_type == FTYPE_DIR);
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Let the other file server threads run, while the caller waits for
+// the disk or for another thread.  Returns false if the caller is the
+// page fault handler, which runs on the exception stack that every
+// thread shares and so cannot be switched away from.
+bool
+fs_yield(void)
+{
+	uint32_t esp = read_esp();
+
+	if (esp >= UXSTACKTOP - PGSIZE && esp < UXSTACKTOP)
+		return 0;
+	nwaiting++;
+	thread_yield();
+	nwaiting--;
+	return 1;
+}
+
+// Whether a client has f open, so that it must not be removed.
+bool
+file_in_use(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f && pageref(opentab[i].o_fd) > 1)
+			return 1;
+	return 0;
+}
+
+static void
+fslock_acquire(bool excl)
+{
+	if (excl) {
+		fslock_waiting++;
+		while (fslock_excl || fslock_shared > 0)
+			fs_yield();
+		fslock_waiting--;
+		fslock_excl = 1;
+	} else {
+		while (fslock_excl || fslock_waiting > 0)
+			fs_yield();
+		fslock_shared++;
+	}
+}
+
+static void
+fslock_release(bool excl)
+{
+	if (excl)
+		fslock_excl = 0;
+	else
+		fslock_shared--;
+}
+
+// Worker thread: serve reqtab[i], reply, and exit.
+static void
+serve_request(uint32_t i)
+{
+	struct Request *rq = &reqtab[i];
+	void *stage = (void *) MAPVA + i * FSMAPPAGES * PGSIZE;
+	bool excl;
+	void *pg;
+	size_t npages, j;
+	int perm, r;
+
+	excl = !(rq->rq_req == FSREQ_READ || rq->rq_req == FSREQ_BULK_READ
+		 || rq->rq_req == FSREQ_STAT || rq->rq_req == FSREQ_STATS);
+	fslock_acquire(excl);
+
+	pg = NULL;
+	npages = 1;
+	perm = 0;
+	if (rq->rq_req == FSREQ_OPEN) {
+		r = serve_open(rq->rq_whom, &rq->rq_ipc->open, &pg, &perm);
+	} else if (rq->rq_req == FSREQ_MAP) {
+		r = serve_map(rq->rq_whom, &rq->rq_ipc->map, stage,
+			      &pg, &npages, &perm);
+	} else if (rq->rq_req < ARRAY_SIZE(handlers) && handlers[rq->rq_req]) {
+		r = handlers[rq->rq_req](rq->rq_whom, rq->rq_ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", rq->rq_req, rq->rq_whom);
+		r = -E_INVAL;
+	}
+
+	fslock_release(excl);
+	ipc_send_pages(rq->rq_whom, r, pg, npages, perm);
+	if (pg == stage)
+		for (j = 0; j < npages; j++)
+			sys_page_unmap(0, stage + j * PGSIZE);
+	sys_page_unmap(0, rq->rq_ipc);
+	rq->rq_ipc = 0;
+	nworkers--;
+}
+
+// Worker thread: serve ringreqs[i], post its completion, and exit.
+static void
+serve_ring_request(uint32_t i)
+{
+	struct RingRequest *rr = &ringreqs[i];
+	struct Ring *ri = &ringtab[rr->rr_ring];
+	struct Fsring *ring = RING(rr->rr_ring);
+	struct Fsring_cqe *cqe;
+	bool excl;
+	int r;
+
+	excl = !(rr->rr_sqe.sqe_op == FSRING_READ
+		 || rr->rr_sqe.sqe_op == FSRING_STAT);
+	fslock_acquire(excl);
+	r = ring_execute(ri->ri_owner, &rr->rr_sqe, (char *) ring + PGSIZE);
+	fslock_release(excl);
+
+	cqe = &ring->r_cq[ring->r_cqtail % FSRINGNENT];
+	cqe->cqe_res = r;
+	cqe->cqe_data = rr->rr_sqe.sqe_data;
+	__sync_synchronize();
+	ring->r_cqtail++;
+	__sync_synchronize();
+	if (ring->r_waiting)
+		sys_futex_wake(&ring->r_cqtail, NENV);
+
+	ri->ri_busy--;
+	rr->rr_used = 0;
+	nworkers--;
+}
+
+// Can ring i's next submission be taken now?  Only if its completion
+// will have somewhere to go: a client that keeps to its limit always
+// leaves room, and one that does not just has to wait.
+static bool
+ring_ready(int i)
+{
+	struct Fsring *ring = RING(i);
+
+	return ringtab[i].ri_owner && ring->r_sqhead != ring->r_sqtail
+		&& ring->r_cqtail - ring->r_cqhead + ringtab[i].ri_busy < FSRINGNENT;
+}
+
+// Start a worker for every ring submission there is room for.
+// Returns the number started.
+static int
+ring_poll(void)
+{
+	struct Fsring *ring;
+	int i, j, n, r;
+
+	n = 0;
+	for (i = 0; i < NRING; i++) {
+		ring = RING(i);
+		while (ring_ready(i)) {
+			for (j = 0; j < NREQ && ringreqs[j].rr_used; j++)
+				/* find a free request */;
+			if (j == NREQ)
+				return n;
+			ringreqs[j].rr_ring = i;
+			ringreqs[j].rr_sqe = ring->r_sq[ring->r_sqhead % FSRINGNENT];
+			__sync_synchronize();
+			ring->r_sqhead++;
+			if ((r = thread_create(0, "fs_ring", serve_ring_request, j)) < 0) {
+				cprintf("FS: cannot serve ring request from %08x: %e\n",
+					ringtab[i].ri_owner, r);
+				return n;
+			}
+			ringreqs[j].rr_used = 1;
+			ringtab[i].ri_busy++;
+			nworkers++;
+			n++;
+		}
+	}
+	return n;
+}
+
+// The dispatcher is about to wait for IPC: ask clients to ring the
+// doorbell when they submit (or, if clear is set, stop asking).
+// Returns false if a submission arrived in the meantime after all.
+static bool
+ring_idle(bool idle)
+{
+	int i;
+
+	for (i = 0; i < NRING; i++)
+		if (ringtab[i].ri_owner)
+			RING(i)->r_idle = idle;
+	if (!idle)
+		return true;
+	__sync_synchronize();
+	for (i = 0; i < NRING; i++)
+		if (ring_ready(i)) {
+			ring_idle(false);
+			return false;
+		}
+	return true;
+}
+
+// Move the request just received at fsreq to a free reqtab slot.
+// Returns the slot, or < 0 if all are in use.
+static int
+request_alloc(envid_t whom, uint32_t req)
+{
+	int i, r;
+
+	for (i = 0; i < NREQ; i++)
+		if (!reqtab[i].rq_ipc)
+			break;
+	if (i == NREQ)
+		return -E_NO_MEM;
+	if ((r = sys_page_map(0, fsreq, 0, (void *) REQVA + i * PGSIZE,
+			      PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	reqtab[i].rq_whom = whom;
+	reqtab[i].rq_req = req;
+	reqtab[i].rq_ipc = (union Fsipc *) (REQVA + i * PGSIZE);
+	return i;
+}
+
+// The dispatcher thread.
 void
-serve(void)
+serve(uint32_t arg)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int perm, slot, r;
+	size_t i, npages;
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Arm the receive, then run workers until a request arrives;
+		// with no workers left, sleep until one does.  Workers that
+		// are all waiting (in the end, for the disk) get the disk a
+		// little time before they look again.
+		if ((r = sys_ipc_recv_pages(fsreq, FSREQPAGES, IPC_NOWAIT)) < 0)
+			panic("serve: sys_ipc_recv: %e", r);
+		while (thisenv->env_ipc_recving) {
+			if (ring_poll() > 0)
+				continue;
+			if (nworkers > nwaiting)
+				thread_yield();
+			else if (ring_idle(true)) {
+				if (nworkers > 0)
+					sys_sleep_until(vdso_time_nsec() + DISKWAIT);
+				else
+					sys_ipc_recv_pages(0, 0, IPC_WAITARMED);
+				ring_idle(false);
+				if (nworkers > 0)
+					thread_yield();
+			}
+		}
+		req = thisenv->env_ipc_value;
+		whom = thisenv->env_ipc_from;
+		perm = thisenv->env_ipc_perm;
+		npages = thisenv->env_ipc_npages;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		// The doorbell only needed to wake us up
+		if (req == FSREQ_RING_KICK)
+			continue;
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("FS: Invalid request from %08x: no argument page\n",
@@ -341,23 +922,37 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+		if (req == FSREQ_BULK_SETUP) {
+			r = serve_bulk_setup(whom, npages);
+			ipc_send(whom, r, NULL, 0);
+		} else if (req == FSREQ_RING_SETUP) {
+			r = serve_ring_setup(whom, npages);
+			ipc_send(whom, r, NULL, 0);
 		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+			while ((slot = request_alloc(whom, req)) == -E_NO_MEM)
+				thread_yield();
+			if ((r = slot) >= 0 && (r = thread_create(0, "fs_request",
+						serve_request, slot)) < 0) {
+				sys_page_unmap(0, reqtab[slot].rq_ipc);
+				reqtab[slot].rq_ipc = 0;
+			}
+			if (r < 0) {
+				cprintf("FS: cannot serve request from %08x: %e\n",
+					whom, r);
+				ipc_send(whom, r, NULL, 0);
+			} else
+				nworkers++;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		for (i = 0; i < npages; i++)
+			sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	int r;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -368,6 +963,11 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
-	serve();
+
+	// Jump into the dispatcher thread; we never come back here.
+	thread_init();
+	if ((r = thread_create(0, "fs_dispatch", serve, 0)) < 0)
+		panic("thread_create: %e", r);
+	thread_yield();
 }
 
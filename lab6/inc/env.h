@@ -11,23 +11,24 @@ typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+1+-------------18---------------+--------12--------+
+// |0|X|          Uniqueifier         |   Environment    |
+// | | |                              |   Index (low)    |
+// +-+-+------------------------------+------------------+
 //
 // The environment index ENVX(eid) equals the environment's index in the
-// 'envs[]' array.  The uniqueifier distinguishes environments that were
+// 'envs[]' array.  Its low 12 bits are the low bits of the envid, and its
+// top bit is bit X, so that the first environments keep the small ids
+// they always had.  The uniqueifier distinguishes environments that were
 // created at different times, but share the same environment index.
 //
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV		10
+#define LOG2NENV		13
 #define NENV			(1 << LOG2NENV)
-#define ENVX(envid)		((envid) & (NENV - 1))
+#define ENVX(envid)		(((envid) & 0xFFF) | (((envid) >> 18) & 0x1000))
 
 // Values of env_status in struct Env
 enum {
@@ -45,21 +46,49 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Scheduling classes.  SCHED_SERVER environments (the file and network
+// servers, and whatever they fork) run before any SCHED_FAIR ones,
+// taking turns among themselves, until they have had a few time slices
+// more than the SCHED_FAIR ones waiting for them.  SCHED_FAIR
+// environments share what is left in proportion to weights set by
+// their nice values, as in Unix: each nice step is worth about 10% of
+// CPU time.
+enum {
+	SCHED_FAIR = 0,
+	SCHED_SERVER
+};
+
+#define NICE_MIN	(-20)
+#define NICE_MAX	19
+
+// Flags for sys_ipc_recv.  With IPC_NOWAIT the receive is only armed:
+// the call returns at once, and env_ipc_recving drops to 0 once a
+// message has been delivered.  IPC_WAITARMED blocks until the receive
+// armed earlier completes, returning at once if it already has.
+#define IPC_NOWAIT	0x1
+#define IPC_WAITARMED	0x2
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
-	struct Env *env_link;		// Next free Env
+	struct Env *env_link;		// Next live Env (see env_alloc)
+	struct Env *env_prev;		// Previous live Env
+	struct Env *env_qnext;		// Next Env on env_cpunum's queue
+	struct Env *env_qprev;		// Previous Env on that queue
 	envid_t env_id;			// Unique environment identifier
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
-	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_syscalls;		// Number of system calls made
+	int env_cpunum;			// The CPU whose queue it is on (where it
+					// last ran, unless moved since)
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of its user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -67,6 +96,29 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_npages;		// Pages wanted at dstva / received
+
+	// Blocking sends (sys_ipc_send, sys_ipc_call)
+	struct Env *env_ipc_sendq;	// Envs waiting to send to us, in order
+	struct Env *env_ipc_sendto;	// Env whose queue we wait in, or NULL
+	struct Env *env_ipc_sendlink;	// Next env in that queue
+	struct IpcSend *env_ipc_send;	// The message we wait to send
+	bool env_ipc_call;		// Receive the reply once it is sent
+	envid_t env_ipc_handoff;	// Receiver we woke, to run when we block
+
+	// Scheduling
+	int env_sched_class;		// SCHED_FAIR or SCHED_SERVER
+	int env_nice;			// NICE_MIN to NICE_MAX: SCHED_FAIR weight
+	uint64_t env_vruntime;		// Run time in ns, scaled by weight
+	uint64_t env_runtime;		// Run time in ns
+	uint64_t env_run_start;		// When it last got a CPU, 0 if not since
+	uint32_t env_cpumask;		// CPUs it may run on: bit n for CPU n
+
+	// sys_futex_wait, sys_sleep_until
+	physaddr_t env_futex_pa;	// Word waited on, 0 if none
+	uint64_t env_futex_deadline;	// time_nsec() to give up at, or 0
+	int env_futex_cpu;		// CPU whose timed waits we are on
+	uint32_t env_futex_slot;	// Our place in that CPU's heap of them
 };
 
 #endif // !JOS_INC_ENV_H
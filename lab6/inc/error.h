@@ -29,6 +29,12 @@ enum {
 	// Network specific errors
 	E_NIC_BUSY       ,      // NIC is busy processing other packets
 	E_RX_EMPTY       ,      // NIC receive queue is empty
+
+	// Codes added later go here, so that the ones above keep their
+	// values.
+	E_TIMEOUT	,	// Wait timed out
+	E_BUSY		,	// File is in use
+	E_INTR		,	// Wait interrupted
 	MAXERROR
 };
 
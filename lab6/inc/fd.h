@@ -50,6 +50,9 @@ struct Stat {
 	struct Dev *st_dev;
 };
 
+// Pages in the data area that each file descriptor may use
+#define FDDATAPAGES	16
+
 char*	fd2data(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
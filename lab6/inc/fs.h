@@ -23,8 +23,23 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reachable through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Version 1 file systems only have direct and indirect blocks.
+#define MAXFILESIZE_V1	((NDIRECT + NINDIRECT) * BLKSIZE)
+// The double-indirect block reaches further than a (signed) off_t can,
+// so version 2 files are capped just below 2GB.
+#define MAXFILESIZE	0x7FFFF000
+
+// Number of extents kept inline in a File descriptor
+#define NEXTENT		6
+
+// A run of e_len consecutive disk blocks starting at e_start.
+struct Extent {
+	uint32_t e_start;
+	uint32_t e_len;
+} __attribute__((packed));
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -36,14 +51,43 @@ struct File {
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
 
+	// The fields below only exist on version 2 (FS_MAGIC_V2) disks.
+	uint32_t f_dindirect;		// double-indirect block
+
+	// Extents describe the file's leading blocks as contiguous disk
+	// runs: f_extents[0] covers file blocks [0, e_len), the next one
+	// picks up where it leaves off, and so on.  They summarize the
+	// block pointers above (which stay authoritative) so that
+	// sequential reads can be issued as multi-block disk transfers.
+	uint32_t f_nextents;		// number of valid f_extents
+	struct Extent f_extents[NEXTENT];
+
+	// Directories only.  f_dirindex is the root of the hashed name
+	// index (0 until the directory grows large enough to need one);
+	// no slot below f_dirfree is free.
+	uint32_t f_dirindex;		// hashed index root block
+	uint32_t f_dirfree;		// free-slot search hint
+
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - 8 - 8*NEXTENT - 8];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
+// Hashed directory index.  The root block holds DIRHASH_NROOT leaf block
+// numbers, indexed by a name's hash modulo DIRHASH_NROOT.  Each leaf is
+// an open-addressed table of DIRHASH_NLEAF slot references, probed
+// linearly starting from the remaining hash bits; a name whose leaf is
+// full goes on into the next leaf, and so on around the root.  A
+// reference is (slot number + 1), where slot n is the n'th struct File in
+// the directory; 0 marks an empty entry and DIRHASH_DELETED a removed one.
+#define DIRHASH_NROOT	64
+#define DIRHASH_NLEAF	(BLKSIZE / 4)
+#define DIRHASH_NENTRY	(DIRHASH_NROOT * DIRHASH_NLEAF)
+#define DIRHASH_DELETED	0xFFFFFFFF
+
 // File types
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
@@ -52,11 +96,40 @@ struct File {
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+// Version 2 adds double-indirect blocks and extents to struct File.
+// fs_init() upgrades version 1 (FS_MAGIC) disks in place.
+#define FS_MAGIC_V2	0x4A0530AF
 
 struct Super {
-	uint32_t s_magic;		// Magic number: FS_MAGIC
+	uint32_t s_magic;		// Magic number: FS_MAGIC_V2
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// First journal block, 0 if none
+	uint32_t s_njournal;		// Journal length in blocks
+};
+
+// Metadata journal.  Changes to bitmap, directory and indirect blocks
+// are grouped into transactions, each written to the journal as one
+// header block followed by copies of the changed blocks, before any of
+// them is written in place.  The journal's first block is a struct
+// JournalSuper naming the sequence number of the transaction expected
+// in the block after it; transactions follow back to back.  Recovery
+// replays every transaction that is intact and in sequence.
+#define JOURNAL_MAGIC	0x4A4E4C31	// 'JNL1'
+#define NJOURNAL	64		// journal blocks made by fsformat
+#define JOURNAL_MAXTXN	31		// blocks changed per transaction
+
+struct JournalSuper {
+	uint32_t js_magic;		// JOURNAL_MAGIC
+	uint32_t js_seq;		// sequence number of first transaction
+};
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// transaction sequence number
+	uint32_t jh_nblocks;		// blocks in the transaction
+	uint32_t jh_cksum;		// checksum of the above and the blocks
+	uint32_t jh_blocknos[JOURNAL_MAXTXN];	// where each block belongs
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +143,86 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Stats returns a Fsret_stats on the request page
+	FSREQ_STATS,
+	// Bulk reads and writes move data through the client's bulk window,
+	// which the client shares with the server once, by sending its
+	// FSBULKPAGES pages (rather than a request page) with
+	// FSREQ_BULK_SETUP.
+	FSREQ_BULK_SETUP,
+	FSREQ_BULK_READ,
+	FSREQ_BULK_WRITE,
+	// Map replies with the block cache pages holding the requested
+	// pages of the file
+	FSREQ_MAP,
+	// Ring setup sends the client's ring page followed by its
+	// FSRINGDATAPAGES data pages (see struct Fsring).
+	FSREQ_RING_SETUP,
+	// The doorbell: sent with no page and never answered, it just wakes
+	// the server to look at the rings.
+	FSREQ_RING_KICK
+};
+
+// The size of a client's bulk transfer window, FSBULKPAGES pages or
+// FSBULKSIZE bytes, is in inc/memlayout.h along with its address.
+
+// Most pages a single map request returns
+#define FSMAPPAGES	32
+
+// Asynchronous requests.  A client that sets up a ring with the server
+// queues requests in r_sq and collects their results from r_cq, as
+// many at a time as it likes, without an IPC round trip for each.  The
+// server takes submissions in order but may complete them out of
+// order; sqe_data comes back in the completion to say which is which.
+// Data moves through the client's FSRINGDATAPAGES data pages, which
+// follow the ring page: sqe_buf is an offset into them.
+//
+// Each side only writes its own index (the client r_sqtail and
+// r_cqhead, the server r_sqhead and r_cqtail) and advances it only once
+// the entries it covers are written or read.  The server sets r_idle
+// when it is about to wait for IPC; a client that submits while it is
+// set rings the doorbell (FSREQ_RING_KICK).  A client waiting for a
+// completion counts itself in r_waiting and sleeps in sys_futex_wait on
+// r_cqtail, which the server wakes.  A client may have at most
+// FSRINGNENT requests outstanding, so the completion queue never fills.
+#define FSRINGNENT	64
+#define FSRINGDATAPAGES	64
+#define FSRINGDATASIZE	(FSRINGDATAPAGES * PGSIZE)
+
+#if (1 + FSRINGDATAPAGES) * PGSIZE > PTSIZE
+#error "a ring does not fit in the space inc/memlayout.h leaves at FSRINGVA"
+#endif
+
+enum {
+	FSRING_READ = 1,	// read sqe_n bytes at sqe_offset into sqe_buf
+	FSRING_WRITE,		// write sqe_n bytes from sqe_buf at sqe_offset
+	FSRING_STAT		// store a struct Fsret_stat at sqe_buf
+};
+
+struct Fsring_sqe {
+	uint32_t sqe_op;		// FSRING_*
+	int sqe_fileid;
+	off_t sqe_offset;		// file position (seek position unused)
+	uint32_t sqe_n;			// bytes
+	uint32_t sqe_buf;		// offset into the data pages
+	uint32_t sqe_data;		// for the client
+};
+
+struct Fsring_cqe {
+	int32_t cqe_res;		// bytes read or written, or < 0 error
+	uint32_t cqe_data;		// the request's sqe_data
+};
+
+struct Fsring {
+	volatile uint32_t r_sqhead;	// next submission the server takes
+	volatile uint32_t r_sqtail;	// next free submission slot
+	volatile uint32_t r_cqhead;	// next completion the client takes
+	volatile uint32_t r_cqtail;	// next free completion slot
+	volatile uint32_t r_idle;	// server waiting for IPC
+	volatile uint32_t r_waiting;	// clients asleep on r_cqtail
+	struct Fsring_sqe r_sq[FSRINGNENT];
+	struct Fsring_cqe r_cq[FSRINGNENT];
 };
 
 union Fsipc {
@@ -108,6 +260,21 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_bulk {
+		int req_fileid;
+		size_t req_n;
+	} bulk;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;	// page-aligned
+		size_t req_npages;	// 1 to FSMAPPAGES
+		int req_private;	// mark the pages copy-on-write
+	} map;
+	struct Fsret_stats {
+		uint32_t ret_lookups;	// directory lookups
+		uint32_t ret_hits;	// ... answered by the dentry cache
+		uint32_t ret_neghits;	// ... of those, "no such file"
+	} statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
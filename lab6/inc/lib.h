@@ -15,6 +15,7 @@
 #include <inc/assert.h>
 #include <inc/env.h>
 #include <inc/memlayout.h>
+#include <inc/vdso.h>
 #include <inc/syscall.h>
 #include <inc/trap.h>
 #include <inc/fs.h>
@@ -28,17 +29,52 @@
 // main user program
 void	umain(int argc, char **argv);
 
+// Threads (see sfork) each have a THREADSLOT-byte slot of their own in
+// the NTHREAD slots below UXSTACKTOP.  From the top down, a slot holds
+// the thread's exception stack page, an empty page, THREADSTACK bytes
+// of stack, and another empty page.  Slot 0 is the first thread's,
+// with the usual exception stack and stack.
+#define NTHREAD		64
+#define THREADSLOT	(16 * PGSIZE)
+#define THREADSTACK	(THREADSLOT - 3 * PGSIZE)
+#define UTHREADS	(UXSTACKTOP - NTHREAD * THREADSLOT)
+
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+extern const volatile struct Env *thread_env[NTHREAD];
 extern const volatile struct Env envs[NENV];
+extern const volatile struct Vdso vdso;
 extern const volatile struct PageInfo pages[];
 
+// The calling thread's slot, going by the stack it is running on.  Code
+// on any other stack, such as the network server's user-level threads,
+// counts as slot 0.
+static inline int
+thread_slot(void)
+{
+	uintptr_t sp = (uintptr_t) &sp;
+
+	if (sp < UTHREADS || sp >= UXSTACKTOP)
+		return 0;
+	return (UXSTACKTOP - 1 - sp) / THREADSLOT;
+}
+
+// The calling thread's Env
+#define thisenv		(thread_env[thread_slot()])
+
+// Where the calling thread's page fault handlers map pages temporarily
+static inline void *
+thread_pftemp(void)
+{
+	return (void *) PFTEMP - thread_slot() * PGSIZE;
+}
+
 // exit.c
 void	exit(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+void	add_pgfault_handler(int (*handler)(struct UTrapframe *utf));
 
 // readline.c
 char*	readline(const char *buf);
@@ -50,6 +86,7 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+static envid_t sys_exothread(void *xstacktop);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
@@ -57,11 +94,22 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_vm_reserve(envid_t env, void *va, size_t len, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int	sys_ipc_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_pages(void *rcv_pg, size_t npages, int flags);
 unsigned int sys_time_msec(void);
 int     sys_transmit_packet(char *buf, int size);
 int     sys_receive_packet(char *buf, int size);
+int	sys_net_wait(bool tx);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_sleep_until(uint64_t nsec);
+int	sys_env_set_priority(envid_t env, int sched_class, int nice);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -74,15 +122,31 @@ sys_exofork(void)
 	return ret;
 }
 
+// Like sys_exofork, this must be inlined: the new thread starts out
+// with the caller's registers, and so on the caller's stack frame.
+static inline envid_t __attribute__((always_inline))
+sys_exothread(void *xstacktop)
+{
+	envid_t ret;
+	asm volatile("int %2"
+		     : "=a" (ret)
+		     : "a" (SYS_exothread), "i" (T_SYSCALL), "d" (xstacktop)
+		     : "cc", "memory");
+	return ret;
+}
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, size_t npages, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void (*entry)(void *), void *arg);
 
 // fd.c
 int	close(int fd);
@@ -100,6 +164,31 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fsstats(struct Fsret_stats *st);
+int	read_map(int fd, off_t offset, void *dstva, size_t npages, bool private);
+
+// mmap.c
+void*	mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int	munmap(void *addr, size_t len);
+
+// mmap returns a negative error code, cast to a pointer, on failure; no
+// mapping starts that close to the top of memory.  Recover it, or 0.
+static inline int
+mmap_error(void *p)
+{
+	return (uintptr_t) p >= (uintptr_t) -MAXERROR ? (int) p : 0;
+}
+
+// vdso.c
+envid_t	vdso_getenvid(void);
+unsigned int vdso_time_msec(void);
+uint64_t vdso_time_nsec(void);
+
+// fsring.c
+int	fsring_setup(void);
+char*	fsring_data(void);
+int	fsring_submit(int op, int fd, off_t offset, size_t n, size_t buf, uint32_t data);
+int	fsring_complete(struct Fsring_cqe *cqe, bool block);
 
 // pageref.c
 int	pageref(void *addr);
@@ -151,4 +240,12 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections and flags */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+
+#define	MAP_SHARED	0x01		/* see the file server's copy */
+#define	MAP_PRIVATE	0x02		/* writes are private to this env */
+#define	MAP_FIXED	0x10		/* replace what is at addr */
+
 #endif	// !JOS_INC_LIB_H
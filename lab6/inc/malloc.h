@@ -2,6 +2,8 @@
 #define JOS_INC_MALLOC_H 1
 
 void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *addr, size_t size);
 void free(void *addr);
 
 #endif
@@ -50,8 +50,12 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *                     |           RO VDSO            | R-/R-  PGSIZE
+ *    UVDSO     ---->  +------------------------------+ 0xeefff000
+ *                     |           RO ENVS            | R-/R-  PTSIZE/2-PGSIZE
+ *    UENVS     ---->  +------------------------------+ 0xeee00000
+ *                     |           RW ENVS            | RW/--  PTSIZE/2
+ * UTOP,KENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
@@ -112,15 +116,20 @@
 #define UVPT		(ULIM - PTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES		(UVPT - PTSIZE)
+// The global env structures, as the kernel writes them.  Pages are
+// mapped here and at UENVS as the table grows (see env_alloc).
+#define KENVS		(UPAGES - PTSIZE)
 // Read-only copies of the global env structures
-#define UENVS		(UPAGES - PTSIZE)
+#define UENVS		(KENVS + PTSIZE / 2)
+// Read-only kernel data for user code (struct Vdso)
+#define UVDSO		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
  */
 
 // Top of user-accessible VM
-#define UTOP		UENVS
+#define UTOP		KENVS
 // Top of one-page user exception stack
 #define UXSTACKTOP	UTOP
 // Next page left invalid to guard against exception stack overflow; then:
@@ -130,6 +139,16 @@
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
 
+// Each file system client's bulk transfer window, which it shares with
+// the file server (see lib/file.c), and right after it the client's
+// request ring (see lib/fsring.c), which gets up to a page table's
+// worth of pages.  They lie in the empty memory well above program data
+// and heap and well below the user stack.
+#define FSBULKVA	0xE0000000
+#define FSBULKPAGES	64
+#define FSBULKSIZE	(FSBULKPAGES * PGSIZE)
+#define FSRINGVA	(FSBULKVA + FSBULKSIZE)
+
 // Used for temporary page mappings.  Typed 'void*' for convenience
 #define UTEMP		((void*) PTSIZE)
 // Used for temporary page mappings for the user page-fault handler
@@ -143,6 +162,10 @@
 
 #ifndef __ASSEMBLER__
 
+#if FSBULKVA < UTEXT + 64 * PTSIZE || FSRINGVA + PTSIZE > USTACKTOP - PTSIZE
+#error "FSBULKVA crowds program data or the user stack"
+#endif
+
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
@@ -185,6 +208,12 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Number of environments in sys_futex_wait on a word in this page.
+	uint16_t pp_nwaiters;
+
+	// For a page of kernel objects, the slab it holds (kern/kmalloc.c).
+	struct Kslab *pp_slab;
 };
 
 #endif /* !__ASSEMBLER__ */
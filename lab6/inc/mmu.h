@@ -69,6 +69,10 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 #define PTE_COW         0x800   // Copy on write
+// In a PTE without PTE_P, PTE_DZERO reserves the page for demand-zero
+// allocation (see sys_vm_reserve): the first touch maps a zeroed page
+// there, with the permissions in the rest of the PTE.
+#define PTE_DZERO	0x200
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -20,6 +20,16 @@ enum {
 	SYS_time_msec,
 	SYS_transmit_packet,
 	SYS_receive_packet,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_net_wait,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_sleep_until,
+	SYS_env_set_priority,
+	SYS_env_set_affinity,
+	SYS_exothread,
+	SYS_vm_reserve,
 	NSYSCALLS
 };
 
@@ -36,8 +36,12 @@
 #define IRQ_KBD          1
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
+#define IRQ_PCI_FIRST    9	// lines PCI devices may be routed to
+#define IRQ_PCI_LAST    11
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_WAKEUP      20	// IPI: something to run on a halted CPU
+#define IRQ_TLB         21	// IPI: flush the TLB (see tlb_invalidate)
 
 #ifndef __ASSEMBLER__
 
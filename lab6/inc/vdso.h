@@ -0,0 +1,45 @@
+// The vDSO page: kernel data that every environment can read at UVDSO,
+// so that asking for the time or its own env id does not take a trap.
+// See lib/vdso.c for how user code reads it consistently.
+
+#ifndef JOS_INC_VDSO_H
+#define JOS_INC_VDSO_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// CPUs described by vd_cpu (at least NCPU)
+#define VDSO_NCPU	8
+
+#define NSEC_PER_MSEC	1000000
+
+struct VdsoCpu {
+	// vc_gen changes whenever the CPU switches environments, after
+	// vc_curenv has been updated.
+	volatile uint32_t vc_gen;
+	volatile envid_t vc_curenv;	// env running on the CPU, 0 if idle
+	volatile uint32_t vc_ticks;	// timer interrupts taken by the CPU
+	uint32_t vc_pad;
+};
+
+struct Vdso {
+	// The time is the TSC's count since vd_tsc_base, at vd_tsc_per_ms
+	// cycles per millisecond.  Both are set once, at boot.
+	uint64_t vd_tsc_base;
+	uint32_t vd_tsc_per_ms;
+	// Entries of envs[] mapped so far; it only grows.  Entries past it
+	// are not mapped at all.
+	volatile uint32_t vd_nenv;
+
+	struct VdsoCpu vd_cpu[VDSO_NCPU];
+};
+
+// Convert a count of TSC cycles to nanoseconds.
+static inline uint64_t
+vdso_tsc2nsec(uint64_t cycles, uint32_t per_ms)
+{
+	return cycles / per_ms * NSEC_PER_MSEC
+		+ cycles % per_ms * NSEC_PER_MSEC / per_ms;
+}
+
+#endif /* !JOS_INC_VDSO_H */
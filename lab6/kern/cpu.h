@@ -22,6 +22,9 @@ struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	struct Env *cpu_queue;          // Envs on its queue (see sched_yield)
+	volatile bool cpu_in_user;      // Running cpu_env's user code
+	volatile bool cpu_tlb_stale;    // Asked to flush its TLB
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
 };
 
@@ -42,5 +45,8 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_set(uint32_t count);
+uint32_t lapic_timer_left(void);
 
 #endif
@@ -1,6 +1,10 @@
 #include <kern/e1000.h>
 #include <kern/pci.h>
 #include <kern/pmap.h>
+#include <kern/picirq.h>
+#include <kern/futex.h>
+#include <kern/time.h>
+#include <kern/kmalloc.h>
 
 #include <inc/stdio.h>
 #include <inc/string.h>
@@ -27,33 +31,67 @@ static volatile uint32_t *nic;
 #define TX_QUEUE_SIZE 64
 #define RX_QUEUE_SIZE 128
 
-struct eth_packet_buffer
-{
-	char data[DATA_PACKET_BUFFER_SIZE];
-};
+// Packet buffers, one per descriptor, come from their own object cache;
+// the descriptor rings are kmalloc'd, which aligns them to their size.
+static struct Kcache *packet_cache;
 
 // transmit buffers
-struct eth_packet_buffer tx_queue_data[TX_QUEUE_SIZE];
+static char *tx_queue_data[TX_QUEUE_SIZE];
 struct e1000_tx_desc *tx_queue_desc;
 
 // receive buffers
-struct eth_packet_buffer rx_queue_data[RX_QUEUE_SIZE];
+static char *rx_queue_data[RX_QUEUE_SIZE];
 struct e1000_rx_desc *rx_queue_desc;
 
+// Allocate the descriptor rings and the packet buffers.
+// Returns 0 or -E_NO_MEM.
+static int
+e1000_alloc(void)
+{
+	int i;
+
+	packet_cache = kcache_create("e1000_packet", DATA_PACKET_BUFFER_SIZE,
+				     16, NULL);
+	tx_queue_desc = kmalloc(TX_QUEUE_SIZE * sizeof(struct e1000_tx_desc));
+	rx_queue_desc = kmalloc(RX_QUEUE_SIZE * sizeof(struct e1000_rx_desc));
+	if (!tx_queue_desc || !rx_queue_desc)
+		return -E_NO_MEM;
+	memset(tx_queue_desc, 0, TX_QUEUE_SIZE * sizeof(struct e1000_tx_desc));
+	memset(rx_queue_desc, 0, RX_QUEUE_SIZE * sizeof(struct e1000_rx_desc));
+	for (i = 0; i < TX_QUEUE_SIZE; i++)
+		if (!(tx_queue_data[i] = kcache_alloc(packet_cache)))
+			return -E_NO_MEM;
+	for (i = 0; i < RX_QUEUE_SIZE; i++)
+		if (!(rx_queue_data[i] = kcache_alloc(packet_cache)))
+			return -E_NO_MEM;
+	return 0;
+}
+
+// Interrupts.  The NIC's PCI interrupt line, if trap.c has a handler for
+// it, or 0, in which case waiters just sleep for E1000_TICK ms and look
+// again.
+uint8_t e1000_irq;
+#define E1000_TICK	10
+
+// Environments waiting for a packet, or for room to send one, sleep
+// on these words (see e1000_wait).
+static uint32_t rx_wait, tx_wait;
+
 int e1000_attach(struct pci_func *pcif)
 {
+	int r;
+
+	if ((r = e1000_alloc()) < 0)
+		return r;
 	pci_func_enable(pcif);
 	nic = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
 
 	// Transmit Initialization
-	struct PageInfo *p = page_alloc(ALLOC_ZERO);
-	physaddr_t tx_queue_base = page2pa(p);
-	NIC_REG(E1000_TDBAL) = tx_queue_base;
+	NIC_REG(E1000_TDBAL) = PADDR(tx_queue_desc);
 	NIC_REG(E1000_TDBAH) = 0;
 	NIC_REG(E1000_TDLEN) = TX_QUEUE_SIZE * sizeof(struct e1000_tx_desc);
-	tx_queue_desc = page2kva(p);
 	for (int i = 0; i < TX_QUEUE_SIZE; i++) {
-		tx_queue_desc[i].addr = (uint64_t)PADDR(&tx_queue_data[i]);
+		tx_queue_desc[i].addr = (uint64_t)PADDR(tx_queue_data[i]);
 		// Report Status on, and mark descriptor as end of packet
 		tx_queue_desc[i].cmd = (1 << 3) | (1 << 0);
 		// set Descriptor Done so we can use this descriptor
@@ -75,11 +113,8 @@ int e1000_attach(struct pci_func *pcif)
 	NIC_REG(E1000_RAH) |= E1000_RAH_AV; // set the address valid bit
 	// MTA initialized to 0b
 	NIC_REG(E1000_MTA) = 0;
-	// Allocate memory for the receive descriptor list & init registers
-	struct PageInfo *rx_desc_pg = page_alloc(ALLOC_ZERO);
-	rx_queue_desc = page2kva(rx_desc_pg);
-	physaddr_t rx_desc_base = page2pa(rx_desc_pg);
-	NIC_REG(E1000_RDBAL) = rx_desc_base;
+	// Init the receive descriptor list registers
+	NIC_REG(E1000_RDBAL) = PADDR(rx_queue_desc);
 	NIC_REG(E1000_RDBAH) = 0;
 	NIC_REG(E1000_RDLEN) = RX_QUEUE_SIZE * sizeof(struct e1000_rx_desc);
 
@@ -87,15 +122,65 @@ int e1000_attach(struct pci_func *pcif)
 	NIC_REG(E1000_RDH) = 0;
 	NIC_REG(E1000_RDT) = RX_QUEUE_SIZE - 1;
 	for (int i = 0; i < RX_QUEUE_SIZE; i++) {
-		rx_queue_desc[i].addr = (uint64_t)PADDR(&rx_queue_data[i]);
+		rx_queue_desc[i].addr = (uint64_t)PADDR(rx_queue_data[i]);
 		// clear Descriptor Done so we know we are not allowed to read it
 		rx_queue_desc[i].status &= ~E1000_RXD_STAT_DD;
 	}
 	// enable and strip CRC
 	NIC_REG(E1000_RCTL) |= E1000_RCTL_EN | E1000_RCTL_SECRC;
+
+	// Interrupt on every received packet.  Transmit interrupts are
+	// only wanted while someone waits for the queue to drain.
+	if (pcif->irq_line >= IRQ_PCI_FIRST && pcif->irq_line <= IRQ_PCI_LAST) {
+		e1000_irq = pcif->irq_line;
+		NIC_REG(E1000_IMS) = E1000_IMS_RXT0;
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
+	}
 	return 0;
 }
 
+// Handle an interrupt from the NIC: wake whoever it is waiting for.
+void
+e1000_intr(void)
+{
+	uint32_t icr = NIC_REG(E1000_ICR);	// reading clears it
+
+	if (icr & E1000_ICR_RXT0)
+		futex_wake(PADDR(&rx_wait), sizeof(rx_wait), NENV);
+	if (icr & E1000_ICR_TXDW) {
+		NIC_REG(E1000_IMC) = E1000_IMC_TXDW;
+		futex_wake(PADDR(&tx_wait), sizeof(tx_wait), NENV);
+	}
+}
+
+// How long e1000_wait waits: until the interrupt, if there is one.
+static uint64_t
+e1000_wait_deadline(void)
+{
+	return e1000_irq ? 0 : time_nsec() + E1000_TICK * NSEC_PER_MSEC;
+}
+
+// If the receive queue is empty (or, if tx, the transmit queue is
+// full), block e until that may have changed and return true.
+// Otherwise return false.
+bool
+e1000_wait(struct Env *e, bool tx)
+{
+	if (tx) {
+		if (tx_queue_desc[NIC_REG(E1000_TDT)].status & E1000_TXD_STAT_DD)
+			return false;
+		if (e1000_irq)
+			NIC_REG(E1000_IMS) = E1000_IMS_TXDW;
+		futex_block(e, PADDR(&tx_wait), e1000_wait_deadline());
+	} else {
+		if (rx_queue_desc[(NIC_REG(E1000_RDT) + 1) % RX_QUEUE_SIZE].status
+		    & E1000_RXD_STAT_DD)
+			return false;
+		futex_block(e, PADDR(&rx_wait), e1000_wait_deadline());
+	}
+	return true;
+}
+
 int tx_packet(char *buf, int size)
 {
 	assert(size <= ETH_MAX_PACKET_SIZE);
@@ -104,7 +189,7 @@ int tx_packet(char *buf, int size)
 		return -E_NIC_BUSY; // queue is full
 	}
 	tx_queue_desc[tail_indx].status &= ~E1000_TXD_STAT_DD;
-	memmove(&tx_queue_data[tail_indx].data, buf, size);
+	memmove(tx_queue_data[tail_indx], buf, size);
 	tx_queue_desc[tail_indx].length = size;
 	// update the TDT to "submit" this packet for transmission
 	NIC_REG(E1000_TDT) = (tail_indx + 1) % TX_QUEUE_SIZE;
@@ -119,7 +204,7 @@ int rx_packet(char *buf, int size)
 	}
 	rx_queue_desc[next_indx].status &= ~E1000_TXD_STAT_DD;
 	int rx_size = MIN(rx_queue_desc[next_indx].length, size);
-	memmove(buf, rx_queue_data[next_indx].data, rx_size);
+	memmove(buf, rx_queue_data[next_indx], rx_size);
 	NIC_REG(E1000_RDT) = next_indx;
 	return rx_size;
 }
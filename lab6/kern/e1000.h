@@ -5,9 +5,15 @@
 #define ETH_MAX_PACKET_SIZE 1518
 #define DATA_PACKET_BUFFER_SIZE 2048
 
+struct Env;
+
+extern uint8_t e1000_irq;
+
 int e1000_attach(struct pci_func *pcif);
 int tx_packet(char *buf, int size);
 int rx_packet(char *buf, int size);
+void e1000_intr(void);
+bool e1000_wait(struct Env *e, bool tx);
 
 // copy pasta from QEMU's e1000_hw.h header
 
@@ -14,12 +14,25 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
+#include <kern/vdso.h>
 
 struct Env *envs = NULL;		// All environments
-static struct Env *env_free_list;	// Free environment list
-					// (linked by Env->env_link)
+struct Env *env_live;			// Live environments
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+// envs[] starts out empty and grows ENVGROW entries at a time, up to
+// NENV, as env_alloc needs them.  A bit of env_used is set for each
+// entry in use.  No free entry lies below word env_hint of it.
+#define ENVGROW		32
+static int nenv;
+static uint32_t env_used[NENV / 32];
+static int env_hint;
+
+#define ENVGENSHIFT	12		// ENVX bits below the uniqueifier
+#define ENVGENMASK	(((1 << 18) - 1) << ENVGENSHIFT)
+// The envid bits that hold environment index x (see ENVX)
+#define ENVXBITS(x)	(((x) & 0xFFF) | (((x) & 0x1000) << 18))
 
 // Global descriptor table.
 //
@@ -88,6 +101,10 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (ENVX(envid) >= nenv) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
 	if (e->env_status == ENV_FREE || e->env_id != envid) {
 		*env_store = 0;
@@ -97,9 +114,11 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// Check that the calling environment has legitimate permission
 	// to manipulate the specified environment.
 	// If checkperm is set, the specified environment
-	// must be either the current environment
-	// or an immediate child of the current environment.
-	if (checkperm && e != curenv && e->env_parent_id != curenv->env_id) {
+	// must be either the current environment,
+	// an immediate child of the current environment,
+	// or a thread sharing its address space.
+	if (checkperm && e != curenv && e->env_parent_id != curenv->env_id
+	    && e->env_pgdir != curenv->env_pgdir) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -108,24 +127,14 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Make sure the environments are in the free list in the same order
-// they are in the envs array (i.e., so that the first call to
-// env_alloc() returns envs[0]).
+// There is nothing to set up for 'envs', which starts out empty: the
+// first call to env_alloc() maps its first entries and returns envs[0].
 //
 void
 env_init(void)
 {
-	// Set up envs array
-	// LAB 3: Your code here.
-	env_free_list = &envs[0];
-	envs[0].env_id = 0;
-	for (int i = 1; i < NENV; i++) {
-		envs[i - 1].env_link =  &envs[i];
-		envs[i].env_id = 0;
-	}
-	envs[NENV - 1].env_link = NULL;
+	static_assert(NENV * sizeof(struct Env) <= UENVS - KENVS);
+	static_assert(NENV * sizeof(struct Env) <= UVDSO - UENVS);
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -159,15 +168,25 @@ env_init_percpu(void)
 // Do NOT (yet) map anything into the user portion
 // of the environment's virtual address space.
 //
+// If share is not NULL, e is a thread: it shares the address space
+// whose page directory is share instead, which counts one more user
+// in the page directory's pp_ref.
+//
 // Returns 0 on success, < 0 on error.  Errors include:
 //	-E_NO_MEM if page directory or table could not be allocated.
 //
 static int
-env_setup_vm(struct Env *e)
+env_setup_vm(struct Env *e, pde_t *share)
 {
 	int i;
 	struct PageInfo *p = NULL;
 
+	if (share) {
+		pa2page(PADDR(share))->pp_ref++;
+		e->env_pgdir = share;
+		return 0;
+	}
+
 	// Allocate a page for the page directory
 	if (!(p = page_alloc(ALLOC_ZERO)))
 		return -E_NO_MEM;
@@ -199,39 +218,167 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+// Map ENVGROW more entries at the end of envs[], zeroed, which makes
+// them ENV_FREE.  Each page goes at both KENVS and UENVS.  mem_init
+// made the page table for them, which every address space shares, so
+// they show up everywhere at once.
+//
+// Returns 0 on success, -E_NO_FREE_ENV if envs[] has all NENV entries
+// already, or -E_NO_MEM.
+static int
+env_grow(void)
+{
+	uintptr_t off = ROUNDUP(nenv * sizeof(struct Env), PGSIZE);
+	uintptr_t end = (nenv + ENVGROW) * sizeof(struct Env);
+	struct PageInfo *pp;
+
+	if (nenv == NENV)
+		return -E_NO_FREE_ENV;
+	for (; off < end; off += PGSIZE) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		if (page_insert(kern_pgdir, pp, (void *) (KENVS + off), PTE_W) < 0
+		    || page_insert(kern_pgdir, pp, (void *) (UENVS + off), PTE_U) < 0)
+			panic("env_grow: no page table for envs[]");
+	}
+	nenv += ENVGROW;
+	vdso->vd_nenv = nenv;
+	return 0;
+}
+
+// Find the first free entry of envs[], growing it if there is none.
+// Returns its index, or an error from env_grow.
+static int
+env_slot(void)
+{
+	int w, r;
+
+	for (w = env_hint; w < nenv / 32 && env_used[w] == ~0U; w++)
+		/* all in use */;
+	env_hint = w;
+	if (w == nenv / 32 && (r = env_grow()) < 0)
+		return r;
+	return w * 32 + __builtin_ctz(~env_used[w]);
+}
+
+// Each CPU's queue holds the environments homed there that can run:
+// those ENV_RUNNABLE, ENV_RUNNING or ENV_DYING.  It is a circular list
+// linked by env_qnext and env_qprev.
+static bool
+env_queued(unsigned status)
+{
+	return status != ENV_FREE && status != ENV_NOT_RUNNABLE;
+}
+
+// Put e at the end of the queue of CPU e->env_cpunum.
+static void
+env_enqueue(struct Env *e)
+{
+	struct Env **q = &cpus[e->env_cpunum].cpu_queue;
+
+	if (!*q) {
+		e->env_qnext = e->env_qprev = e;
+		*q = e;
+	} else {
+		e->env_qnext = *q;
+		e->env_qprev = (*q)->env_qprev;
+		e->env_qprev->env_qnext = e;
+		(*q)->env_qprev = e;
+	}
+}
+
+static void
+env_dequeue(struct Env *e)
+{
+	struct Env **q = &cpus[e->env_cpunum].cpu_queue;
+
+	if (e->env_qnext == e)
+		*q = NULL;
+	else {
+		e->env_qprev->env_qnext = e->env_qnext;
+		e->env_qnext->env_qprev = e->env_qprev;
+		if (*q == e)
+			*q = e->env_qnext;
+	}
+}
+
+// Set e's status, which may put it on its CPU's queue or take it off.
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	bool was = env_queued(e->env_status);
+
+	e->env_status = status;
+	if (was && !env_queued(status))
+		env_dequeue(e);
+	else if (!was && env_queued(status))
+		env_enqueue(e);
+}
+
+// Make cpu e's home, moving e to its queue if e is on one.
+void
+env_set_cpu(struct Env *e, int cpu)
+{
+	if (e->env_cpunum == cpu)
+		return;
+	if (env_queued(e->env_status)) {
+		env_dequeue(e);
+		e->env_cpunum = cpu;
+		env_enqueue(e);
+	} else
+		e->env_cpunum = cpu;
+}
+
 //
-// Allocates and initializes a new environment.
+// Allocates and initializes a new environment, with an address space
+// of its own or, if share is not NULL, sharing the one with page
+// directory share.
 // On success, the new environment is stored in *newenv_store.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENV environments are allocated
 //	-E_NO_MEM on memory exhaustion
 //
-int
-env_alloc(struct Env **newenv_store, envid_t parent_id)
+// The new environment takes the first free entry of envs[], mapping in
+// more of envs[] if need be.
+//
+static int
+env_alloc_vm(struct Env **newenv_store, envid_t parent_id, pde_t *share)
 {
 	int32_t generation;
-	int r;
+	int i, r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	if ((i = env_slot()) < 0)
+		return i;
+	e = &envs[i];
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e, share)) < 0)
 		return r;
 
 	// Generate an env_id for this environment.
-	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
-	if (generation <= 0)	// Don't create a negative env_id.
+	generation = ((e->env_id & ENVGENMASK) + (1 << ENVGENSHIFT)) & ENVGENMASK;
+	if (generation == 0)	// Don't create an env_id 0.
 		generation = 1 << ENVGENSHIFT;
-	e->env_id = generation | (e - envs);
+	e->env_id = generation | ENVXBITS(i);
 
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_syscalls = 0;
+
+	// Scheduling parameters are inherited (sys_exofork) or set by
+	// env_create.
+	e->env_sched_class = SCHED_FAIR;
+	e->env_nice = 0;
+	e->env_vruntime = 0;
+	e->env_runtime = 0;
+	e->env_run_start = 0;
+	e->env_cpunum = cpunum();
+	e->env_cpumask = ~0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -260,18 +407,51 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and send queue.
 	e->env_ipc_recving = 0;
-
-	// commit the allocation
-	env_free_list = e->env_link;
+	e->env_ipc_sendq = NULL;
+	e->env_ipc_sendto = NULL;
+	e->env_ipc_send = NULL;
+	e->env_ipc_call = false;
+	e->env_ipc_handoff = 0;
+
+	// commit the allocation: mark the entry used, and put e on the
+	// live list and, as it is ENV_RUNNABLE, this CPU's queue
+	env_used[i / 32] |= 1U << (i % 32);
+	e->env_prev = NULL;
+	if ((e->env_link = env_live))
+		env_live->env_prev = e;
+	env_live = e;
+	env_enqueue(e);
 	*newenv_store = e;
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
 }
 
+//
+// Allocates and initializes a new environment with an empty address
+// space of its own.
+//
+int
+env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	return env_alloc_vm(newenv_store, parent_id, NULL);
+}
+
+//
+// Allocates and initializes a new thread of parent: an environment
+// sharing parent's address space.  Each of them keeps it alive until
+// it is freed.
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *parent)
+{
+	return env_alloc_vm(newenv_store, parent->env_id, parent->env_pgdir);
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -297,7 +477,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	uintptr_t lo_addr = ROUNDDOWN((uintptr_t)va, PGSIZE);
 	uintptr_t page_count = (hi_addr - lo_addr)/PGSIZE;
 	for (int i = 0; i < page_count; i++) {
-		struct PageInfo *pp =  page_alloc(0);
+		struct PageInfo *pp =  page_alloc(ALLOC_ZERO);
 		assert(pp);
 		void *addr = (void *)(lo_addr + i * PGSIZE);
 		if (page_insert(e->env_pgdir, pp, addr, PTE_W | PTE_U) < 0) {
@@ -306,6 +486,22 @@ region_alloc(struct Env *e, void *va, size_t len)
 	}
 }
 
+//
+// Reserve len bytes of user memory for environment e, starting at va,
+// for demand-zero allocation (see page_reserve), like region_alloc.
+// Pages region_alloc has already mapped stay as they are.
+//
+static void
+region_reserve(struct Env *e, void *va, size_t len)
+{
+	uintptr_t a = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+
+	for (; a < end; a += PGSIZE)
+		if (page_reserve(e->env_pgdir, (void *) a, PTE_W | PTE_U) < 0)
+			panic("region_reserve: out of memory");
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -323,7 +519,9 @@ region_alloc(struct Env *e, void *va, size_t len)
 // loader also needs to read the code from disk.  Take a look at
 // boot/main.c to get ideas.
 //
-// Finally, this function maps one page for the program's initial stack.
+// Only the pages holding data from the file are allocated now: the rest
+// of each segment, the bss, is reserved for demand-zero allocation, and
+// so is the one page for the program's initial stack.
 //
 // load_icode panics if it encounters problems.
 //  - How might load_icode fail?  What might be wrong with the given input?
@@ -374,15 +572,16 @@ load_icode(struct Env *e, uint8_t *binary)
 		if (header->p_type != ELF_PROG_LOAD) {
 			continue;
 		}
-		region_alloc(e, (void *)header->p_va, header->p_memsz);
-		memset((void*)header->p_va, 0, header->p_memsz);
+		// region_alloc's pages come zeroed.
+		region_alloc(e, (void *)header->p_va, header->p_filesz);
 		void *foffset = (void *)(binary + header->p_offset);
 		memcpy((void *)header->p_va, foffset, header->p_filesz);
+		region_reserve(e, (void *)(header->p_va + header->p_filesz),
+			       header->p_memsz - header->p_filesz);
 	}
 
-	// Now map one page for the program's initial stack
-	region_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
-	memset((void *)(USTACKTOP - PGSIZE), 0, PGSIZE);
+	// Now reserve one page for the program's initial stack
+	region_reserve(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
 
 	// switch back to kern_pgdir to be on the safe side
 	lcr3(PADDR(kern_pgdir));
@@ -407,6 +606,8 @@ env_create(uint8_t *binary, enum EnvType type)
 	}
 	load_icode(e, binary);
 	e->env_type = type;
+	if (type != ENV_TYPE_USER)
+		e->env_sched_class = SCHED_SERVER;
 
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 5: Your code here.
@@ -424,6 +625,8 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	bool shared;
+	int i;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
@@ -433,10 +636,14 @@ env_free(struct Env *e)
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	futex_cancel(e);
+	ipc_free(e);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// unless other threads still share it.
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	shared = pa2page(PADDR(e->env_pgdir))->pp_ref > 1;
+	for (pdeno = 0; !shared && pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
@@ -462,10 +669,17 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	// take the environment off its lists and free its entry
+	env_set_status(e, ENV_FREE);
+	if (e->env_prev)
+		e->env_prev->env_link = e->env_link;
+	else
+		env_live = e->env_link;
+	if (e->env_link)
+		e->env_link->env_prev = e->env_prev;
+	i = e - envs;
+	env_used[i / 32] &= ~(1U << (i % 32));
+	env_hint = MIN(env_hint, i / 32);
 //	cprintf("finished env_free for %x\n", curenv->env_id);
 }
 
@@ -481,7 +695,7 @@ env_destroy(struct Env *e)
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
 	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+		env_set_status(e, ENV_DYING);
 		return;
 	}
 
@@ -503,9 +717,6 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
-
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
@@ -537,13 +748,30 @@ env_run(struct Env *e)
 	// Step 2: Use env_pop_tf() to restore the environment's
 	//	   registers and drop into user mode in the
 	//	   environment.
+
+	// e joins this CPU's queue, unless it is the current environment
+	// and has just been moved to another CPU's queue, in which case it
+	// must go there.
+	if (curenv != e)
+		env_set_cpu(e, cpunum());
+	else if (e->env_cpunum != cpunum())
+		sched_yield();
+
+	if (curenv != NULL && curenv != e) {
+		sched_charge(curenv);
+		curenv->env_run_start = 0;
+	}
 	if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
-		curenv->env_status = ENV_RUNNABLE;
+		env_set_status(curenv, ENV_RUNNABLE);
+		if (curenv != e)
+			sched_wakeup(curenv);
 	}
 	curenv = e;
-	curenv->env_status = ENV_RUNNING;
+	env_set_status(curenv, ENV_RUNNING);
 	curenv->env_runs++;
 	lcr3(PADDR(curenv->env_pgdir));
+	vdso_run(curenv);
+	sched_leave(curenv);
 
 	// Hint: This function loads the new environment's state from
 	//	e->env_tf.  Go back through the code you wrote above
@@ -551,6 +779,7 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
+	thiscpu->cpu_in_user = true;
 	unlock_kernel();
 	env_pop_tf(&curenv->env_tf);
 	panic("env_pop_tf somehow returned...");
@@ -7,15 +7,19 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern struct Env *env_live;		// Those not ENV_FREE (by env_link)
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc_thread(struct Env **e, struct Env *parent);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
+void	env_set_cpu(struct Env *e, int cpu);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -0,0 +1,151 @@
+// Kernel waits for user-space synchronization (sys_futex_wait).
+//
+// An environment blocked on a word records the word's physical address
+// in env_futex_pa, so environments sharing a page meet there wherever
+// each of them maps it.  Wakeups scan the live environments; the
+// waiter count in the word's PageInfo lets the usual case, nobody
+// waiting, skip the scan.
+//
+// A wait with a deadline is also kept in a binary min-heap of the timed
+// waits of the CPU it started on, ordered by deadline, so that the CPU
+// can set its timer for the first of them and expire them when it goes
+// off.  Starting and ending a timed wait take O(log n) time.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
+#include <kern/futex.h>
+
+// Each CPU's timed waits.  The children of futex_heap[c][i] are at
+// 2i+1 and 2i+2, and no wait has an earlier deadline than its parent.
+static struct Env *futex_heap[NCPU][NENV];
+static uint32_t futex_nheap[NCPU];
+
+static void
+futex_heap_put(int cpu, uint32_t i, struct Env *e)
+{
+	futex_heap[cpu][i] = e;
+	e->env_futex_slot = i;
+}
+
+// Put e in slot i of cpu's heap, which is either new or being vacated,
+// and move it up or down until the heap is in order again.
+static void
+futex_heap_fix(int cpu, uint32_t i, struct Env *e)
+{
+	struct Env **h = futex_heap[cpu];
+	uint32_t c, n = futex_nheap[cpu];
+
+	while (i > 0 && h[(i - 1) / 2]->env_futex_deadline > e->env_futex_deadline) {
+		futex_heap_put(cpu, i, h[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && h[c + 1]->env_futex_deadline < h[c]->env_futex_deadline)
+			c++;
+		if (h[c]->env_futex_deadline >= e->env_futex_deadline)
+			break;
+		futex_heap_put(cpu, i, h[c]);
+		i = c;
+	}
+	futex_heap_put(cpu, i, e);
+}
+
+// Forget that e is waiting, if it is.
+void
+futex_cancel(struct Env *e)
+{
+	int cpu = e->env_futex_cpu;
+	uint32_t n;
+
+	if (e->env_futex_pa)
+		pa2page(e->env_futex_pa)->pp_nwaiters--;
+	if (e->env_futex_deadline) {
+		assert(futex_heap[cpu][e->env_futex_slot] == e);
+		n = --futex_nheap[cpu];
+		if (e->env_futex_slot < n)
+			futex_heap_fix(cpu, e->env_futex_slot, futex_heap[cpu][n]);
+	}
+	e->env_futex_pa = 0;
+	e->env_futex_deadline = 0;
+}
+
+// Block e, which is running on this CPU, on the word at physical
+// address pa until woken, or until time_nsec() reaches deadline unless
+// that is 0.  If pa is 0, e just sleeps until the deadline.
+void
+futex_block(struct Env *e, physaddr_t pa, uint64_t deadline)
+{
+	futex_cancel(e);
+	e->env_futex_pa = pa;
+	if (pa)
+		pa2page(pa)->pp_nwaiters++;
+	if (deadline) {
+		e->env_futex_deadline = deadline;
+		e->env_futex_cpu = cpunum();
+		futex_heap_fix(e->env_futex_cpu, futex_nheap[e->env_futex_cpu]++, e);
+	}
+	env_set_status(e, ENV_NOT_RUNNABLE);
+}
+
+static void
+futex_unblock(struct Env *e)
+{
+	futex_cancel(e);
+	if (e->env_status == ENV_NOT_RUNNABLE) {
+		env_set_status(e, ENV_RUNNABLE);
+		sched_wakeup(e);
+	}
+}
+
+// Wake up to n environments waiting on words in [pa, pa + len), which
+// must lie within one page.  Returns the number woken.
+int
+futex_wake(physaddr_t pa, size_t len, int n)
+{
+	struct Env *e;
+	int woken = 0;
+
+	if (!pa2page(pa)->pp_nwaiters)
+		return 0;
+	for (e = env_live; e && woken < n; e = e->env_link)
+		if (e->env_futex_pa && e->env_futex_pa >= pa
+		    && e->env_futex_pa < pa + len) {
+			futex_unblock(e);
+			woken++;
+		}
+	return woken;
+}
+
+// Return the deadline of the first timed wait on this CPU, or
+// TIME_NEVER if there is none.
+uint64_t
+futex_next(void)
+{
+	int cpu = cpunum();
+
+	return futex_nheap[cpu] ? futex_heap[cpu][0]->env_futex_deadline
+		: TIME_NEVER;
+}
+
+// Called when this CPU's timer goes off: end the timed waits on this
+// CPU whose time is up.  A sys_futex_wait that times out returns
+// -E_TIMEOUT.
+void
+futex_expire(uint64_t now)
+{
+	struct Env *e;
+	int cpu = cpunum();
+
+	while (futex_nheap[cpu]
+	       && (e = futex_heap[cpu][0])->env_futex_deadline <= now) {
+		if (e->env_status == ENV_NOT_RUNNABLE && e->env_futex_pa)
+			e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+		futex_unblock(e);
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void futex_block(struct Env *e, physaddr_t pa, uint64_t deadline);
+int futex_wake(physaddr_t pa, size_t len, int n);
+void futex_cancel(struct Env *e);
+uint64_t futex_next(void);
+void futex_expire(uint64_t now);
+
+#endif	// !JOS_KERN_FUTEX_H
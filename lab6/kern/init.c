@@ -7,6 +7,8 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/ipc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -39,9 +41,11 @@ i386_init(void)
 	cprintf("6828 decimal is %o octal!\n", 6828);
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmalloc_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	ipc_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -0,0 +1,255 @@
+// IPC message delivery and the queues of blocked senders.
+//
+// A sender whose target is not receiving (sys_ipc_send, sys_ipc_call)
+// joins the end of the target's env_ipc_sendq with its message saved
+// in its own struct Env, and sleeps.  When the target next arms a
+// receive, ipc_arm hands it the message at the head of the queue
+// instead of letting it block.  A caller (sys_ipc_call) goes from
+// sending straight to receiving its reply, without ever running in
+// between.
+//
+// When an environment blocks right after waking a receiver, as a client
+// does after sending a request and a server does after replying and
+// going back to receive, ipc_yield runs that receiver on this CPU
+// straight away instead of scanning envs[] for something to run.  The
+// receiver moves to this CPU's queue, if it may run here, and so ends
+// up on the same CPU as the clients keeping it busy.
+//
+// A waiting sender's message is kept in a struct IpcSend from
+// ipc_send_cache, only for as long as it waits.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/futex.h>
+#include <kern/kmalloc.h>
+#include <kern/ipc.h>
+
+struct IpcSend {
+	uint32_t is_value;
+	void *is_srcva;
+	unsigned is_perm;
+	size_t is_npages;
+};
+
+static struct Kcache *ipc_send_cache;
+
+void
+ipc_init(void)
+{
+	ipc_send_cache = kcache_create("ipc_send", sizeof(struct IpcSend), 0,
+				       NULL);
+}
+
+// Check the arguments of a send of npages pages at srcva.
+// Returns 0 or -E_INVAL.
+int
+ipc_check_send(void *srcva, unsigned perm, size_t npages)
+{
+	uintptr_t va = (uintptr_t) srcva;
+
+	if (va >= UTOP)
+		return 0;
+	if (va % PGSIZE != 0 || npages > (UTOP - va) / PGSIZE
+	    || (perm & ~PTE_SYSCALL) != 0)
+		return -E_INVAL;
+	return 0;
+}
+
+// Deliver a message from src to dst, which must be receiving, and wake
+// dst up if it is waiting for it.  The pages are looked up in src's
+// address space now, so they must still be mapped.
+//
+// Returns 0 on success, < 0 on error, in which case dst keeps waiting:
+//	-E_INVAL if one of the pages is not mapped in src, or
+//		(perm & PTE_W) but one of them is read-only in src.
+//	-E_NO_MEM if there's not enough memory to map the pages in dst.
+int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm, size_t npages)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	size_t i;
+	int r;
+
+	assert(dst->env_ipc_recving);
+	if ((uintptr_t) srcva >= UTOP)
+		npages = 0;
+	npages = MIN(npages, dst->env_ipc_npages);
+	for (i = 0; i < npages; i++) {
+		if ((r = page_demand(src->env_pgdir, srcva + i * PGSIZE)) < 0)
+			return r;
+		if (!page_lookup(src->env_pgdir, srcva + i * PGSIZE, &pte))
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*pte & PTE_W))
+			return -E_INVAL;
+	}
+	for (i = 0; i < npages; i++) {
+		pp = page_lookup(src->env_pgdir, srcva + i * PGSIZE, NULL);
+		if ((r = page_insert(dst->env_pgdir, pp,
+				     dst->env_ipc_dstva + i * PGSIZE, perm)) < 0) {
+			while (i-- > 0)
+				page_remove(dst->env_pgdir,
+					    dst->env_ipc_dstva + i * PGSIZE);
+			return r;
+		}
+	}
+
+	dst->env_ipc_value = value;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_perm = npages > 0 ? perm : 0;
+	dst->env_ipc_npages = npages;
+
+	dst->env_ipc_recving = false;
+	// A receiver that armed the receive with IPC_NOWAIT may be running
+	// right now, on this or another CPU; leave it be.  If it is asleep
+	// in sys_futex_wait instead, the message ends that wait.  If it is
+	// blocked in a send of its own, it stays blocked until that send is
+	// done, and finds the message then.
+	if (dst->env_status == ENV_NOT_RUNNABLE && !dst->env_ipc_sendto) {
+		futex_cancel(dst);
+		env_set_status(dst, ENV_RUNNABLE);
+		src->env_ipc_handoff = dst->env_id;
+		sched_wakeup(dst);
+	}
+	return 0;
+}
+
+// The current environment has blocked.  Run the receiver it last woke,
+// if that is still waiting for a CPU, or else whatever sched_yield
+// picks.
+void
+ipc_yield(void)
+{
+	struct Env *e;
+	envid_t id = curenv->env_ipc_handoff;
+
+	curenv->env_ipc_handoff = 0;
+	if (id && envid2env(id, &e, false) == 0 && e->env_status == ENV_RUNNABLE
+	    && (e->env_cpumask & (1U << cpunum())))
+		env_run(e);
+	sched_yield();
+}
+
+// Put e, which is sending a message to dst, at the end of dst's queue
+// of senders and block it.  e->env_ipc_call says what happens to it
+// once the message has been delivered.
+// Returns 0, or -E_NO_MEM if there is no memory to keep the message in.
+int
+ipc_enqueue(struct Env *e, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm, size_t npages)
+{
+	struct IpcSend *is;
+	struct Env **pp;
+
+	assert(!e->env_ipc_sendto && e != dst);
+	if (!(is = kcache_alloc(ipc_send_cache)))
+		return -E_NO_MEM;
+	is->is_value = value;
+	is->is_srcva = srcva;
+	is->is_perm = perm;
+	is->is_npages = npages;
+	e->env_ipc_send = is;
+	e->env_ipc_sendto = dst;
+	e->env_ipc_sendlink = NULL;
+	for (pp = &dst->env_ipc_sendq; *pp; pp = &(*pp)->env_ipc_sendlink)
+		/* find the end */;
+	*pp = e;
+	env_set_status(e, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// Take e out of the queue it is waiting in, and return its message,
+// which the caller frees.
+static struct IpcSend *
+ipc_dequeue(struct Env *e)
+{
+	struct IpcSend *is = e->env_ipc_send;
+	struct Env **pp;
+
+	for (pp = &e->env_ipc_sendto->env_ipc_sendq; *pp != e;
+	     pp = &(*pp)->env_ipc_sendlink)
+		assert(*pp);
+	*pp = e->env_ipc_sendlink;
+	e->env_ipc_sendto = NULL;
+	e->env_ipc_sendlink = NULL;
+	e->env_ipc_send = NULL;
+	return is;
+}
+
+// The queued send by e, just taken off its queue, has finished with
+// result r (0 or an error).  Let e run with that result, or, for a
+// successful sys_ipc_call, start it receiving the reply.
+static void
+ipc_sent(struct Env *e, int r)
+{
+	// Nothing else wakes a sender while it is queued (changing its
+	// status cancels the send first), so e is still asleep in this
+	// send.
+	assert(e->env_status == ENV_NOT_RUNNABLE);
+	e->env_tf.tf_regs.reg_eax = r;
+	if (r == 0 && e->env_ipc_call) {
+		e->env_ipc_call = false;
+		ipc_arm(e, e->env_ipc_dstva, e->env_ipc_npages);
+		return;
+	}
+	e->env_ipc_call = false;
+	env_set_status(e, ENV_RUNNABLE);
+	sched_wakeup(e);
+}
+
+// Start e receiving up to npages pages at dstva (dstva >= UTOP for
+// none).  If somebody is waiting to send to e, deliver the first
+// message that goes through and return true; otherwise e is left
+// receiving, and the caller decides whether it waits.
+bool
+ipc_arm(struct Env *e, void *dstva, size_t npages)
+{
+	struct IpcSend *is;
+	struct Env *s;
+	int r;
+
+	e->env_ipc_recving = true;
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_npages = npages;
+
+	while ((s = e->env_ipc_sendq)) {
+		is = ipc_dequeue(s);
+		r = ipc_deliver(s, e, is->is_value, is->is_srcva,
+				is->is_perm, is->is_npages);
+		kcache_free(ipc_send_cache, is);
+		ipc_sent(s, r);
+		if (r == 0)
+			return true;
+	}
+	return false;
+}
+
+// If e is blocked sending, give up: the send returns err.
+void
+ipc_cancel(struct Env *e, int err)
+{
+	if (!e->env_ipc_sendto)
+		return;
+	kcache_free(ipc_send_cache, ipc_dequeue(e));
+	e->env_ipc_call = false;
+	e->env_tf.tf_regs.reg_eax = err;
+}
+
+// e is going away: take it out of any queue, and fail the sends
+// waiting for it.
+void
+ipc_free(struct Env *e)
+{
+	struct Env *s;
+
+	ipc_cancel(e, -E_BAD_ENV);
+	while ((s = e->env_ipc_sendq)) {
+		kcache_free(ipc_send_cache, ipc_dequeue(s));
+		ipc_sent(s, -E_BAD_ENV);
+	}
+}
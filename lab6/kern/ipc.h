@@ -0,0 +1,20 @@
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void ipc_init(void);
+int ipc_check_send(void *srcva, unsigned perm, size_t npages);
+int ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+		void *srcva, unsigned perm, size_t npages);
+int ipc_enqueue(struct Env *e, struct Env *dst, uint32_t value,
+		void *srcva, unsigned perm, size_t npages);
+bool ipc_arm(struct Env *e, void *dstva, size_t npages);
+void ipc_cancel(struct Env *e, int err);
+void ipc_free(struct Env *e);
+void ipc_yield(void) __attribute__((noreturn));
+
+#endif	// !JOS_KERN_IPC_H
@@ -0,0 +1,423 @@
+// Kernel object allocator.
+//
+// Objects of one kind come from an object cache (struct Kcache), which
+// carves them out of slabs: pages cut into equal-sized objects.  A
+// slab's struct Kslab lists its free objects.  For objects of up to
+// KSLAB_ONSLAB bytes it sits at the end of the slab's page; larger
+// objects would waste too much of the page, so their struct Kslab comes
+// from a cache of its own.  The PageInfo of every slab page points to
+// its slab, which is how kfree finds the cache an object belongs to.
+//
+// A cache's constructor, if it has one, runs on each object once, when
+// its slab is made, rather than on every allocation; objects must be
+// freed in the state the constructor left them in.  So that the free
+// list does not clobber that state, such objects get an extra word at
+// the end to link them through.
+//
+// Each CPU keeps up to KCPUCACHE free objects of every cache, and moves
+// them to or from the slabs KCPUCACHE/2 at a time, under the cache's
+// lock.  Most allocations and frees therefore touch neither the lock
+// nor memory another CPU is using.  A cache keeps one entirely free
+// slab around; other slabs go back to page_free as soon as they are
+// free.
+//
+// kmalloc serves sizes of up to PGSIZE from caches of powers of two,
+// with every object aligned to its size.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kmalloc.h>
+
+#define NKCACHE		32
+#define KCPUCACHE	16
+#define KSLAB_ONSLAB	(PGSIZE / 8)
+#define KMALLOC_MIN	16
+#define KMALLOC_NSIZE	9	// KMALLOC_MIN to PGSIZE
+
+struct Kslab {
+	struct Kslab *ks_next;	// on one of its cache's lists
+	struct Kslab *ks_prev;
+	struct Kcache *ks_cache;
+	void *ks_mem;		// the page holding the objects
+	void *ks_free;		// free objects
+	unsigned ks_inuse;	// objects not on ks_free
+};
+
+// A CPU's free objects of one cache
+struct Kcpucache {
+	void *kp_obj[KCPUCACHE];
+	int kp_n;
+	uint32_t kp_nalloc;	// allocations on this CPU
+	uint32_t kp_nrefill;	// ... that had to go to the slabs
+};
+
+struct Kcache {
+	const char *kc_name;
+	size_t kc_size;		// object size
+	size_t kc_stride;	// distance from one object to the next
+	size_t kc_linkoff;	// where in a free object its free list link is
+	unsigned kc_perslab;	// objects in a slab
+	bool kc_offslab;	// struct Kslab comes from kslab_cache
+	void (*kc_ctor)(void *);
+
+	struct spinlock kc_lock;
+	struct Kslab *kc_partial;	// slabs with both free and used objects
+	struct Kslab *kc_full;		// slabs with no free objects
+	struct Kslab *kc_empty;		// an unused slab, or NULL
+	unsigned kc_nslab;
+
+	struct Kcpucache kc_cpu[NCPU];
+};
+
+#define LINK(kc, obj)	(*(void **) ((char *) (obj) + (kc)->kc_linkoff))
+
+static struct Kcache kcaches[NKCACHE];
+static int nkcache;
+static struct Kcache *kslab_cache;
+static struct Kcache *kmalloc_cache[KMALLOC_NSIZE];
+static const char *kmalloc_name[KMALLOC_NSIZE] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+	"kmalloc-4096"
+};
+
+static void check_kmalloc(void);
+
+// Make the caches kmalloc needs.  Call after mem_init.
+void
+kmalloc_init(void)
+{
+	int i;
+
+	kslab_cache = kcache_create("kslab", sizeof(struct Kslab), 0, NULL);
+	for (i = 0; i < KMALLOC_NSIZE; i++)
+		kmalloc_cache[i] = kcache_create(kmalloc_name[i],
+						 KMALLOC_MIN << i,
+						 KMALLOC_MIN << i, NULL);
+	check_kmalloc();
+}
+
+// Make a cache of objects of size bytes (at most PGSIZE), each aligned
+// to align bytes (a power of 2, or 0 for no particular alignment).  If
+// ctor is not NULL, it is called on every object when it is first made.
+// Caches are never destroyed; the kernel panics if it makes too many.
+struct Kcache *
+kcache_create(const char *name, size_t size, size_t align,
+	      void (*ctor)(void *))
+{
+	struct Kcache *kc;
+
+	if (nkcache == NKCACHE)
+		panic("kcache_create %s: too many caches", name);
+	if (align == 0)
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+
+	kc = &kcaches[nkcache++];
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_linkoff = ctor ? ROUNDUP(size, sizeof(void *)) : 0;
+	kc->kc_stride = ROUNDUP(MAX(size, kc->kc_linkoff + sizeof(void *)),
+				align);
+	if (kc->kc_stride > PGSIZE)
+		panic("kcache_create %s: objects of %d bytes are too big",
+		      name, size);
+	kc->kc_offslab = kc->kc_stride > KSLAB_ONSLAB;
+	if (kc->kc_offslab)
+		kc->kc_perslab = PGSIZE / kc->kc_stride;
+	else
+		kc->kc_perslab = (PGSIZE - sizeof(struct Kslab)) / kc->kc_stride;
+	__spin_initlock(&kc->kc_lock, (char *) name);
+	return kc;
+}
+
+//
+// Slabs.  The functions below are called with the cache's lock held.
+//
+
+static void
+slab_push(struct Kslab **list, struct Kslab *s)
+{
+	s->ks_prev = NULL;
+	s->ks_next = *list;
+	if (*list)
+		(*list)->ks_prev = s;
+	*list = s;
+}
+
+static void
+slab_remove(struct Kslab **list, struct Kslab *s)
+{
+	if (s->ks_prev)
+		s->ks_prev->ks_next = s->ks_next;
+	else
+		*list = s->ks_next;
+	if (s->ks_next)
+		s->ks_next->ks_prev = s->ks_prev;
+}
+
+// Make a new slab for kc, on its partial list.
+// Returns the slab, or NULL if out of memory.
+static struct Kslab *
+slab_grow(struct Kcache *kc)
+{
+	struct PageInfo *pp;
+	struct Kslab *s;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	if (!kc->kc_offslab)
+		s = (struct Kslab *) (page2kva(pp) + PGSIZE) - 1;
+	else if (!(s = kcache_alloc(kslab_cache))) {
+		page_free(pp);
+		return NULL;
+	}
+	pp->pp_slab = s;
+
+	s->ks_cache = kc;
+	s->ks_mem = page2kva(pp);
+	s->ks_free = NULL;
+	s->ks_inuse = 0;
+	for (i = kc->kc_perslab - 1; i >= 0; i--) {
+		obj = (char *) s->ks_mem + i * kc->kc_stride;
+		if (kc->kc_ctor)
+			kc->kc_ctor(obj);
+		LINK(kc, obj) = s->ks_free;
+		s->ks_free = obj;
+	}
+	slab_push(&kc->kc_partial, s);
+	kc->kc_nslab++;
+	return s;
+}
+
+// Give an unused slab's page back.
+static void
+slab_release(struct Kcache *kc, struct Kslab *s)
+{
+	struct PageInfo *pp = pa2page(PADDR(s->ks_mem));
+
+	pp->pp_slab = NULL;
+	if (kc->kc_offslab)
+		kcache_free(kslab_cache, s);
+	page_free(pp);
+	kc->kc_nslab--;
+}
+
+// Take an object out of kc's slabs, or return NULL if out of memory.
+static void *
+slab_take(struct Kcache *kc)
+{
+	struct Kslab *s;
+	void *obj;
+
+	if ((s = kc->kc_partial))
+		/* use it */;
+	else if ((s = kc->kc_empty)) {
+		kc->kc_empty = NULL;
+		slab_push(&kc->kc_partial, s);
+	} else if (!(s = slab_grow(kc)))
+		return NULL;
+
+	obj = s->ks_free;
+	s->ks_free = LINK(kc, obj);
+	if (++s->ks_inuse == kc->kc_perslab) {
+		slab_remove(&kc->kc_partial, s);
+		slab_push(&kc->kc_full, s);
+	}
+	return obj;
+}
+
+// Put obj back in its slab.
+static void
+slab_put(struct Kcache *kc, void *obj)
+{
+	struct Kslab *s = pa2page(PADDR(obj))->pp_slab;
+
+	assert(s && s->ks_cache == kc);
+	if (s->ks_inuse-- == kc->kc_perslab) {
+		slab_remove(&kc->kc_full, s);
+		slab_push(&kc->kc_partial, s);
+	}
+	LINK(kc, obj) = s->ks_free;
+	s->ks_free = obj;
+	if (s->ks_inuse == 0) {
+		slab_remove(&kc->kc_partial, s);
+		if (kc->kc_empty)
+			slab_release(kc, s);
+		else
+			kc->kc_empty = s;
+	}
+}
+
+//
+// Allocating and freeing objects.
+//
+
+// Allocate an object from kc.  Returns NULL if out of memory.
+void *
+kcache_alloc(struct Kcache *kc)
+{
+	struct Kcpucache *kp = &kc->kc_cpu[cpunum()];
+	void *obj;
+
+	if (kp->kp_n == 0) {
+		spin_lock(&kc->kc_lock);
+		while (kp->kp_n < KCPUCACHE / 2 && (obj = slab_take(kc)))
+			kp->kp_obj[kp->kp_n++] = obj;
+		spin_unlock(&kc->kc_lock);
+		kp->kp_nrefill++;
+		if (kp->kp_n == 0)
+			return NULL;
+	}
+	kp->kp_nalloc++;
+	return kp->kp_obj[--kp->kp_n];
+}
+
+// Free obj, which came from kcache_alloc(kc).
+void
+kcache_free(struct Kcache *kc, void *obj)
+{
+	struct Kcpucache *kp = &kc->kc_cpu[cpunum()];
+
+	if (kp->kp_n == KCPUCACHE) {
+		spin_lock(&kc->kc_lock);
+		while (kp->kp_n > KCPUCACHE / 2)
+			slab_put(kc, kp->kp_obj[--kp->kp_n]);
+		spin_unlock(&kc->kc_lock);
+	}
+	kp->kp_obj[kp->kp_n++] = obj;
+}
+
+// Allocate size bytes, aligned to the next power of 2 up from size.
+// Returns NULL if out of memory or size > PGSIZE.
+void *
+kmalloc(size_t size)
+{
+	int i;
+
+	for (i = 0; i < KMALLOC_NSIZE; i++)
+		if (size <= (KMALLOC_MIN << i))
+			return kcache_alloc(kmalloc_cache[i]);
+	return NULL;
+}
+
+// Free obj, which came from kmalloc or kcache_alloc.
+void
+kfree(void *obj)
+{
+	struct Kslab *s;
+
+	if (!obj)
+		return;
+	s = pa2page(PADDR(obj))->pp_slab;
+	assert(s);
+	kcache_free(s->ks_cache, obj);
+}
+
+// Print how much memory each cache uses, and how much of it is wasted.
+void
+kmalloc_report(void)
+{
+	struct Kcache *kc;
+	struct Kslab *s;
+	uint32_t used, cached, nalloc, nrefill, pages, waste, total;
+	int i, j;
+
+	cprintf("cache          size  used cached slabs  waste  allocs refills\n");
+	total = 0;
+	for (i = 0; i < nkcache; i++) {
+		kc = &kcaches[i];
+		spin_lock(&kc->kc_lock);
+		used = kc->kc_perslab * kc->kc_nslab;
+		if (kc->kc_empty)
+			used -= kc->kc_perslab;
+		for (s = kc->kc_partial; s; s = s->ks_next)
+			used -= kc->kc_perslab - s->ks_inuse;
+		cached = nalloc = nrefill = 0;
+		for (j = 0; j < NCPU; j++) {
+			cached += kc->kc_cpu[j].kp_n;
+			nalloc += kc->kc_cpu[j].kp_nalloc;
+			nrefill += kc->kc_cpu[j].kp_nrefill;
+		}
+		used -= cached;
+		pages = kc->kc_nslab;
+		spin_unlock(&kc->kc_lock);
+
+		// Waste is the part of the slabs' pages not holding objects in
+		// use: free objects, padding, and any struct Kslab.
+		waste = pages ? 100 - used * kc->kc_size * 100 / (pages * PGSIZE)
+			      : 0;
+		total += pages;
+		cprintf("%-14s %4d %5d %6d %5d %5d%% %7u %7u\n", kc->kc_name,
+			kc->kc_size, used, cached, kc->kc_nslab, waste,
+			nalloc, nrefill);
+	}
+	cprintf("%d pages in %d caches\n", total, nkcache);
+}
+
+//
+// Checks.
+//
+
+#define CHECK_MAGIC	0x5AB5AB5A
+#define CHECK_NOBJ	100
+
+static void
+check_ctor(void *obj)
+{
+	uint32_t *w = obj;
+
+	w[0] = CHECK_MAGIC;
+	w[49] = CHECK_MAGIC;
+}
+
+static void
+check_kmalloc(void)
+{
+	static void *objs[CHECK_NOBJ];
+	struct Kcache *kc;
+	uint32_t *w;
+	size_t size;
+	int i, j, pass;
+
+	// Objects with a constructor are constructed, aligned and distinct,
+	// and come back in the state they were freed in.
+	kc = kcache_create("check", 200, 64, check_ctor);
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < CHECK_NOBJ; i++) {
+			assert((w = objs[i] = kcache_alloc(kc)));
+			assert((uintptr_t) w % 64 == 0);
+			assert(w[0] == CHECK_MAGIC && w[49] == CHECK_MAGIC);
+			for (j = 0; j < i; j++)
+				assert(objs[j] != w);
+			memset(w + 1, i, 48 * sizeof(*w));
+		}
+		for (i = 0; i < CHECK_NOBJ; i++)
+			kcache_free(kc, objs[i]);
+	}
+
+	// kmalloc aligns each object to its size, and objects do not overlap.
+	for (size = 1; size <= PGSIZE; size *= 2) {
+		for (i = 0; i < 8; i++) {
+			assert((objs[i] = kmalloc(size)));
+			assert((uintptr_t) objs[i] % MAX(size, KMALLOC_MIN) == 0);
+			memset(objs[i], i, size);
+		}
+		for (i = 0; i < 8; i++) {
+			for (j = 0; j < size; j++)
+				assert(((uint8_t *) objs[i])[j] == i);
+			kfree(objs[i]);
+		}
+	}
+	assert(kmalloc(PGSIZE + 1) == NULL);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
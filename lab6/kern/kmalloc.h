@@ -0,0 +1,23 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Kcache;
+
+void kmalloc_init(void);
+
+struct Kcache *kcache_create(const char *name, size_t size, size_t align,
+			     void (*ctor)(void *));
+void *kcache_alloc(struct Kcache *kc);
+void kcache_free(struct Kcache *kc, void *obj);
+
+void *kmalloc(size_t size);
+void kfree(void *obj);
+
+void kmalloc_report(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
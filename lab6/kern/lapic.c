@@ -65,13 +65,12 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It starts out stopped; the
+	// scheduler sets it for each CPU's next event (lapic_timer_set).
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -180,3 +179,31 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an interrupt to the CPU whose local APIC ID is apicid.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	if (!lapic)
+		return;
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Interrupt this CPU after count bus cycles, or never if count is 0,
+// cancelling any interrupt it was set for before.
+void
+lapic_timer_set(uint32_t count)
+{
+	if (lapic)
+		lapicw(TICR, count);
+}
+
+// Return the bus cycles left before this CPU's timer goes off.
+uint32_t
+lapic_timer_left(void)
+{
+	return lapic ? lapic[TCCR] : 0;
+}
@@ -13,6 +13,7 @@
 #include <kern/trap.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/kmalloc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -47,7 +48,8 @@ static struct Command commands[] = {
 	{ "vaddrinfo", "Display information about virtual address", mon_vaddrinfo },
 	{ "pgdir", "Display the contents of a page directory or a page table", mon_pgdir },
 	{ "vminfo", "Display a summary of all the virtual address space", mon_vminfo },
-	{"envinfo", "Display information about environments", mon_envinfo}
+	{"envinfo", "Display information about environments", mon_envinfo},
+	{ "kmem", "Display kernel object cache usage", mon_kmem }
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -63,11 +65,7 @@ mon_envinfo(int argc, char **argv, struct Trapframe *tf)
 	char *status_arr[] = {"ENV_FREE", "ENV_DYING", "ENV_RUNNABLE",
 			      "ENV_RUNNING", "ENV_NOT_RUNNABLE"};
 
-	for (int i = 0; i < NENV; i++) {
-		const volatile struct Env *env = &envs[i];
-		if (env->env_status == ENV_FREE) {
-			continue;
-		}
+	for (const struct Env *env = env_live; env; env = env->env_link) {
 
 		char* status = (env->env_status < sizeof(status_arr)) ?
 			status_arr[env->env_status] : "(unknown)";
@@ -86,6 +84,13 @@ mon_envinfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmalloc_report();
+	return 0;
+}
+
 int
 mon_quit(int argc, char **argv, struct Trapframe *tf)
 {
@@ -24,4 +24,5 @@ int mon_vaddrinfo(int argc, char **argv, struct Trapframe *tf);
 int mon_pgdir(int argc, char **argv, struct Trapframe *tf);
 int mon_vminfo(int argc, char **argv, struct Trapframe *tf);
 int mon_envinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_kmem(int argc, char **argv, struct Trapframe *tf);
 #endif	// !JOS_KERN_MONITOR_H
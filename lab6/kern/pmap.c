@@ -12,6 +12,8 @@
 #include <kern/env.h>
 #include <kern/cpu.h>
 #include <kern/monitor.h>
+#include <kern/futex.h>
+#include <kern/vdso.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -66,6 +68,7 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void tlb_shootdown(pde_t *pgdir);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -160,10 +163,14 @@ mem_init(void)
 	memset(pages, 0, npages * sizeof(struct PageInfo));
 
 	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
+	// Make 'envs' point to KENVS, where env_alloc maps in the array of
+	// 'struct Env' a little at a time as it grows.
 	// LAB 3: Your code here.
-	envs = (struct Env *) boot_alloc(NENV * sizeof(struct Env));
-	memset(envs, 0, NENV * sizeof(struct Env));
+	envs = (struct Env *) KENVS;
+
+	// And the vDSO page, which is shared with every environment.
+	vdso = (struct Vdso *) boot_alloc(PGSIZE);
+	memset(vdso, 0, PGSIZE);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -191,13 +198,14 @@ mem_init(void)
 	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the 'envs' array read-only by the user at linear address UENVS
-	// (ie. perm = PTE_U | PTE_P).
+	// Map the vDSO page read-only by the user at UVDSO.  This also makes
+	// the page table for KENVS and UENVS, just below, so that the pages
+	// env_alloc maps there later show up in every address space.
 	// Permissions:
-	//    - the new image at UENVS  -- kernel R, user R
-	//    - envs itself -- kernel RW, user NONE
-	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U);
+	//    - the 'envs' array at UENVS -- kernel R, user R
+	//    - envs itself, at KENVS -- kernel RW, user NONE
+	static_assert(PDX(KENVS) == PDX(UVDSO) && PDX(UENVS) == PDX(UVDSO));
+	boot_map_region(kern_pgdir, UVDSO, PGSIZE, PADDR(vdso), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -544,9 +552,88 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	return pa2page(PTE_ADDR(*pte));
 }
 
+//
+// Reserve the page at va in pgdir for demand-zero allocation with
+// permissions perm, unless a page is mapped there already.  The page
+// is allocated, zeroed, the first time it is touched (see page_demand).
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+page_reserve(pde_t *pgdir, void *va, int perm)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, true);
+
+	if (!pte)
+		return -E_NO_MEM;
+	if (!(*pte & PTE_P))
+		*pte = (perm & ~PTE_P) | PTE_DZERO;
+	return 0;
+}
+
+//
+// If the page at va in pgdir is reserved by page_reserve, map a zeroed
+// page there now.  No TLB holds a PTE that is not present, so there is
+// nothing to invalidate.
+//
+// RETURNS:
+//   1 if it mapped a page, 0 if the page is not reserved
+//   -E_NO_MEM, if there is no memory for the page
+//
+int
+page_demand(pde_t *pgdir, void *va)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, false);
+	struct PageInfo *pp;
+
+	if (!pte || (*pte & (PTE_P | PTE_DZERO)) != PTE_DZERO)
+		return 0;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	*pte = page2pa(pp) | (*pte & PTE_SYSCALL & ~PTE_DZERO) | PTE_P;
+	return 1;
+}
+
+//
+// If the page at va in pgdir is copy-on-write, make it writable: give
+// pgdir a copy of its own, or, when no one else maps the page any more,
+// just let it write to the one it has.
+//
+// RETURNS:
+//   1 if the page is writable now, 0 if it is not copy-on-write
+//   -E_NO_MEM, if there is no memory for the copy
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	pte_t *pte;
+	struct PageInfo *pp = page_lookup(pgdir, va, &pte);
+	struct PageInfo *copy;
+	int perm;
+
+	if (!pp || (*pte & (PTE_COW | PTE_W)) != PTE_COW)
+		return 0;
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 1;
+	}
+	if (!(copy = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(copy), page2kva(pp), PGSIZE);
+	// The page table is there already, so this cannot fail.
+	page_insert(pgdir, copy, va, perm);
+	return 1;
+}
+
 //
 // Unmaps the physical page at virtual address 'va'.
-// If there is no physical page at that address, silently does nothing.
+// If there is no physical page at that address, silently does nothing
+// but drop any page_reserve reservation there.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -565,9 +652,14 @@ page_remove(pde_t *pgdir, void *va)
 	pte_t *pte_store = NULL;
 	struct PageInfo *pp = page_lookup(pgdir, va, &pte_store);
 	if (!pp) {
+		if ((pte_store = pgdir_walk(pgdir, va, false)))
+			*pte_store = 0;
 		return;
 	}
 	*pte_store = 0;
+	// Waiters may be waiting for a mapping to go away.
+	if (pp->pp_nwaiters)
+		futex_wake(page2pa(pp), PGSIZE, NENV);
 	page_decref(pp);
 	tlb_invalidate(pgdir, va);
 }
@@ -582,6 +674,29 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir);
+}
+
+// Other CPUs may be running pgdir too: another thread of the same
+// address space, or an environment the current one is changing.  Send
+// each of them an IPI to flush its TLB, and wait for the ones running
+// user code to do so.  The others are in the kernel, or on their way
+// in, and flush in trap() once they have the big kernel lock we hold.
+static void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+	bool sent = false;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_env && c->cpu_env->env_pgdir == pgdir) {
+			c->cpu_tlb_stale = true;
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+			sent = true;
+		}
+	for (c = cpus; sent && c < cpus + ncpu; c++)
+		while (c->cpu_tlb_stale && c->cpu_in_user)
+			asm volatile("pause");
 }
 
 //
@@ -645,16 +760,28 @@ static int user_mem_perm;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// Pages reserved for demand-zero allocation are allocated here, and
+// copy-on-write pages to be written are copied, so the kernel can go on
+// to use the range as if it had been there all along.
+//
 // Returns 0 if the user program can access this range of addresses,
-// and -E_FAULT otherwise.
+// -E_NO_MEM if there is no memory for one of those pages (the range is
+// fine, and the caller may try again), and -E_FAULT otherwise.
 //
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
 	char* addr = (char*)va;
+	int r;
 	for (char *c = addr; c < addr + len; c = ROUNDDOWN(c + PGSIZE, PGSIZE)) {
 		pte_t *pte = NULL;
+		if ((uintptr_t)c < UTOP
+		    && ((r = page_demand(env->env_pgdir, c)) < 0
+			|| ((perm & PTE_W) && (r = page_cow(env->env_pgdir, c)) < 0))) {
+			user_mem_check_addr = (uintptr_t)c;
+			return r;
+		}
 		struct PageInfo *p = page_lookup(env->env_pgdir, (void*)c, &pte);
 		if (!p || (*pte & perm) != perm || (uintptr_t)c >= ULIM) {
 			user_mem_check_addr = (uintptr_t)c;
@@ -669,13 +796,20 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // Checks that environment 'env' is allowed to access the range
 // of memory [va, va+len) with permissions 'perm | PTE_U | PTE_P'.
 // If it can, then the function simply returns.
-// If it cannot, 'env' is destroyed and, if env is the current
-// environment, this function will not return.
+// If it cannot, or there is no memory to fill it in, 'env' is destroyed
+// and, if env is the current environment, this function will not
+// return.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+	int r;
+
+	if ((r = user_mem_check(env, va, len, perm | PTE_U)) == -E_NO_MEM) {
+		cprintf("[%08x] user_mem_check out of memory for va %08x\n",
+			env->env_id, user_mem_check_addr);
+		env_destroy(env);	// may not return
+	} else if (r < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x ", env->env_id, user_mem_check_addr);
 		cprintf("actual pg perm: ");
@@ -863,10 +997,12 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
-	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	// check envs array (new test for lab 3): empty until env_alloc
+	for (i = KENVS; i < UVDSO; i += PGSIZE)
+		assert(check_va2pa(pgdir, i) == ~0);
+
+	// check the vDSO page
+	assert(check_va2pa(pgdir, UVDSO) == PADDR(vdso));
 
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
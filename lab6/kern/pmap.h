@@ -59,6 +59,9 @@ void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+int	page_reserve(pde_t *pgdir, void *va, int perm);
+int	page_demand(pde_t *pgdir, void *va);
+int	page_cow(pde_t *pgdir, void *va);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
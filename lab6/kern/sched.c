@@ -4,75 +4,384 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/vdso.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+#include <kern/sched.h>
+
+// Longest an environment runs before others get a turn
+#define SLICE		(10 * NSEC_PER_MSEC)
+
+// SCHED_FAIR weights by nice value, from NICE_MIN up; nice 0 is 1024.
+// Each step is a factor of about 1.25.
+static const uint32_t nice_weight[NICE_MAX - NICE_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45, 36, 29, 23, 18, 15
+};
+#define NICE_0_WEIGHT	1024
+
+// No runnable SCHED_FAIR environment is further behind than this
+static uint64_t min_vruntime;
+
+// How far a SCHED_SERVER environment's virtual run time may get ahead
+// of the SCHED_FAIR environments waiting for its CPU before it loses
+// its priority over them
+#define SERVER_LEAD	(4 * SLICE)
+
+// When the time slice of the environment each CPU is running ends
+static uint64_t slice_end[NCPU];
+
+// How often the queues are balanced, and when they next are
+#define BALANCE		(4 * SLICE)
+static uint64_t next_balance;
 
 void sched_halt(void);
+static void sched_balance(void);
+static struct Env *sched_steal(void);
 
 // Choose a user environment to run and run it.
+//
+// Each CPU has its own queue, cpu_queue: the environments that can run
+// whose env_cpunum is that CPU, which are the ones that last ran there
+// unless sched_balance or sched_set_affinity has moved them since.
+// Keeping an environment on one CPU keeps its caches and TLB entries
+// warm, and environments that are blocked cost the queue nothing.
+//
+// From this CPU's queue, a runnable SCHED_SERVER environment goes
+// first; they take turns in round-robin order around the queue,
+// starting just after the env this CPU was last running.  Servers are
+// charged virtual run time like everybody else, though, and one that
+// has run SERVER_LEAD longer than the SCHED_FAIR environment with the
+// least virtual run time yields to it, so that a busy server cannot
+// starve the rest of its CPU.  Otherwise the SCHED_FAIR environment
+// with the least virtual run time goes, which may be the one that was
+// running here.  Never choose an environment that's currently running
+// on another CPU (env_status == ENV_RUNNING).  If nothing in this CPU's
+// queue can run, take an environment from the queue of another CPU,
+// and only if there is none, halt the CPU.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-	// LAB 4: Your code here.
-
-	int begin = curenv ? ENVX(curenv->env_id) + 1 : 0;
-	int index = begin;
-	bool found = false;
-	for (int i = 0; i < NENV; i++) {
-		index = (begin + i) % NENV;
-		if (envs[index].env_status == ENV_RUNNABLE) {
-			found = true;
-			break;
+	struct Env *begin, *e, *fair = NULL, *server = NULL;
+
+	if (ncpu > 1 && time_nsec() >= next_balance)
+		sched_balance();
+
+	begin = thiscpu->cpu_queue;
+	if (curenv && curenv->env_cpunum == cpunum()
+	    && (curenv->env_status == ENV_RUNNING
+		|| curenv->env_status == ENV_RUNNABLE))
+		begin = curenv->env_qnext;
+	if ((e = begin))
+		do {
+			if (e->env_status != ENV_RUNNABLE)
+				continue;
+			if (e->env_sched_class == SCHED_SERVER) {
+				if (!server)
+					server = e;
+			} else if (!fair || e->env_vruntime < fair->env_vruntime)
+				fair = e;
+		} while ((e = e->env_qnext) != begin);
+
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && curenv->env_cpunum == cpunum()) {
+		sched_charge(curenv);
+		if (curenv->env_sched_class == SCHED_SERVER) {
+			if (!server)
+				server = curenv;
+		} else if (!fair || curenv->env_vruntime <= fair->env_vruntime)
+			fair = curenv;
+	}
+	if (server && (!fair || server->env_vruntime
+				< fair->env_vruntime + SERVER_LEAD))
+		env_run(server);
+	if (!fair)
+		fair = server;
+	if (!fair && ncpu > 1)
+		fair = sched_steal();
+	if (!fair)
+		sched_halt();
+	if (fair->env_sched_class == SCHED_FAIR)
+		min_vruntime = MAX(min_vruntime, fair->env_vruntime);
+	env_run(fair);
+}
+
+// Of the runnable environments on CPU from's queue that may run on CPU
+// to, choose one to move there: the SCHED_FAIR one that has had the
+// least run time, which has probably waited longest and so has the
+// least left in from's caches.  A SCHED_SERVER one only moves if there
+// is nothing else, since it hardly waits for its CPU.
+static struct Env *
+sched_migrant(int from, int to)
+{
+	struct Env *e, *best = NULL;
+
+	if ((e = cpus[from].cpu_queue))
+		do {
+			if (e->env_status != ENV_RUNNABLE
+			    || !(e->env_cpumask & (1U << to)))
+				continue;
+			if (!best || (best->env_sched_class == SCHED_SERVER
+				      && e->env_sched_class == SCHED_FAIR))
+				best = e;
+			else if (e->env_sched_class == SCHED_FAIR
+				 && e->env_vruntime < best->env_vruntime)
+				best = e;
+		} while ((e = e->env_qnext) != cpus[from].cpu_queue);
+	return best;
+}
+
+// Even out the CPUs' queues.  While the longest queue (counting the
+// environment running, if any) has two or more environments more than
+// the shortest, move one across, and wake the CPU it goes to if that
+// is halted.  Queues that differ by one stay as they are: moving an
+// environment would only make the other queue the longer.
+static void
+sched_balance(void)
+{
+	int load[NCPU] = { 0 };
+	int i, from, to;
+	struct Env *e;
+
+	next_balance = time_nsec() + BALANCE;
+	for (i = 0; i < ncpu; i++)
+		if ((e = cpus[i].cpu_queue))
+			do {
+				if (e->env_status == ENV_RUNNABLE
+				    || e->env_status == ENV_RUNNING)
+					load[i]++;
+			} while ((e = e->env_qnext) != cpus[i].cpu_queue);
+
+	while (1) {
+		from = to = 0;
+		for (i = 1; i < ncpu; i++) {
+			if (load[i] > load[from])
+				from = i;
+			if (load[i] < load[to])
+				to = i;
 		}
+		if (load[from] - load[to] < 2 || !(e = sched_migrant(from, to)))
+			return;
+		env_set_cpu(e, to);
+		load[from]--;
+		load[to]++;
+		if (cpus[to].cpu_status == CPU_HALTED)
+			lapic_ipi_cpu(cpus[to].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
 	}
+}
 
-	if (found) {
-		env_run(&envs[index]);
-	} else if (curenv && curenv->env_status == ENV_RUNNING) {
-		env_run(curenv);
-	} else {
-		sched_halt();
+// This CPU has nothing to run.  Find the CPU with the most environments
+// waiting in its queue that may run here, and take one of them, or
+// return NULL if there are none.
+static struct Env *
+sched_steal(void)
+{
+	int waiting[NCPU] = { 0 };
+	int i, from = -1;
+	struct Env *e;
+
+	for (i = 0; i < ncpu; i++)
+		if ((e = cpus[i].cpu_queue))
+			do {
+				if (e->env_status == ENV_RUNNABLE
+				    && (e->env_cpumask & (1U << cpunum())))
+					waiting[i]++;
+			} while ((e = e->env_qnext) != cpus[i].cpu_queue);
+	for (i = 0; i < ncpu; i++)
+		if (waiting[i] && (from < 0 || waiting[i] > waiting[from]))
+			from = i;
+	if (from < 0)
+		return NULL;
+	return sched_migrant(from, cpunum());
+}
+
+// Let e run only on the CPUs in cpumask, which must include one that
+// exists.  If e's queue is on another CPU, move it to the first CPU in
+// cpumask; should e be running on the CPU it left, that CPU's next
+// trip through env_run gives it up.
+void
+sched_set_affinity(struct Env *e, uint32_t cpumask)
+{
+	int from = e->env_cpunum, to;
+
+	e->env_cpumask = cpumask;
+	if (cpumask & (1U << from))
+		return;
+	for (to = 0; !(cpumask & (1U << to)); to++)
+		/* find the first */;
+	env_set_cpu(e, to);
+	if (e->env_status == ENV_RUNNABLE)
+		sched_wakeup(e);
+	else if (e->env_status == ENV_RUNNING && from != cpunum())
+		lapic_ipi_cpu(cpus[from].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+}
+
+// Bring e's run time up to date, if it is running.
+void
+sched_charge(struct Env *e)
+{
+	uint64_t now, ran;
+
+	if (!e->env_run_start)
+		return;
+	now = time_nsec();
+	ran = now - e->env_run_start;
+	e->env_runtime += ran;
+	e->env_vruntime += ran * NICE_0_WEIGHT / nice_weight[e->env_nice - NICE_MIN];
+	e->env_run_start = now;
+}
+
+// Environments each CPU has made runnable since it last left the
+// kernel: how many are on each CPU's queue, how many of those are
+// SCHED_SERVER, and the last of them and its queue.  'idle' has a bit
+// for each halted CPU already sent one of them.
+static struct {
+	unsigned nwoken[NCPU];
+	unsigned nserver[NCPU];
+	struct Env *woken;
+	int woken_cpu;
+	uint32_t idle;
+} wakeups[NCPU];
+
+// e has just become runnable.  If it has been asleep, let it catch up
+// with the others only so far: enough to get ahead, but not to
+// monopolize a CPU for what it missed.  This goes for servers too,
+// whose lead over the others is measured from there.
+//
+// If e's CPU is busy (this one included: it is in the kernel now, and
+// will go back to whatever it was running unless that blocks), move e
+// to a halted CPU that it may run on, so that it need not wait its
+// turn.  sched_kick sends that CPU an IPI.
+void
+sched_wakeup(struct Env *e)
+{
+	uint32_t idle = wakeups[cpunum()].idle;
+	int i;
+
+	if (min_vruntime > SLICE)
+		e->env_vruntime = MAX(e->env_vruntime, min_vruntime - SLICE);
+
+	if (cpus[e->env_cpunum].cpu_status != CPU_HALTED
+	    || (idle & (1U << e->env_cpunum)))
+		for (i = 0; i < ncpu; i++)
+			if (i != cpunum() && cpus[i].cpu_status == CPU_HALTED
+			    && !(idle & (1U << i))
+			    && (e->env_cpumask & (1U << i))) {
+				env_set_cpu(e, i);
+				break;
+			}
+	if (cpus[e->env_cpunum].cpu_status == CPU_HALTED)
+		wakeups[cpunum()].idle |= 1U << e->env_cpunum;
+	wakeups[cpunum()].nwoken[e->env_cpunum]++;
+	if (e->env_sched_class == SCHED_SERVER)
+		wakeups[cpunum()].nserver[e->env_cpunum]++;
+	wakeups[cpunum()].woken = e;
+	wakeups[cpunum()].woken_cpu = e->env_cpunum;
+}
+
+// This CPU is about to leave the kernel to run next (or to halt, if
+// next is NULL).  Halted CPUs only wake up for their own timed waits,
+// so send an IPI to each halted CPU with an environment made runnable
+// here on its queue, unless that is the one about to run here.  The
+// usual case is an IPC reply to an env that this CPU hands itself over
+// to, which needs no help.  A CPU running a SCHED_FAIR environment gets
+// an IPI too if a SCHED_SERVER environment on its queue woke up, so
+// that the server preempts it.
+static void
+sched_kick(struct Env *next)
+{
+	struct CpuInfo *c;
+	struct Env *cur;
+	int i;
+
+	if (next && wakeups[cpunum()].woken == next) {
+		i = wakeups[cpunum()].woken_cpu;
+		wakeups[cpunum()].nwoken[i]--;
+		if (next->env_sched_class == SCHED_SERVER)
+			wakeups[cpunum()].nserver[i]--;
 	}
-	panic("sched_yield attempted to return");
+	for (i = 0; i < ncpu; i++) {
+		c = &cpus[i];
+		cur = c->cpu_env;
+		if (c != thiscpu && wakeups[cpunum()].nwoken[i]
+		    && (c->cpu_status == CPU_HALTED
+			|| (wakeups[cpunum()].nserver[i] && cur
+			    && cur->env_status == ENV_RUNNING
+			    && cur->env_sched_class == SCHED_FAIR)))
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+		wakeups[cpunum()].nwoken[i] = 0;
+		wakeups[cpunum()].nserver[i] = 0;
+	}
+	wakeups[cpunum()].woken = NULL;
+	wakeups[cpunum()].idle = 0;
 }
 
-// halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// This CPU is about to run e, or to halt if e is NULL.  Wake up other
+// CPUs for anything else left to run, and set this CPU's timer for its
+// next event: the end of e's time slice, or the first timed wait
+// started on it.
+void
+sched_leave(struct Env *e)
+{
+	uint64_t deadline = futex_next();
+
+	sched_kick(e);
+	if (e) {
+		sched_charge(e);
+		// A new slice if e is just starting to run here, or its
+		// last one is over.
+		if (!e->env_run_start || e->env_run_start >= slice_end[cpunum()]) {
+			if (!e->env_run_start)
+				e->env_run_start = time_nsec();
+			slice_end[cpunum()] = e->env_run_start + SLICE;
+		}
+		deadline = MIN(deadline, slice_end[cpunum()]);
+	}
+	time_arm(deadline);
+}
+
+// halt this CPU when there is nothing to do. Wait until an interrupt
+// (its timer, or an IPI from sched_kick) wakes it up. This function
+// never returns.
 //
 void
 sched_halt(void)
 {
-	int i;
+	struct Env *e;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+	// An environment waiting with a timeout will be runnable soon.
+	for (e = env_live; e; e = e->env_link) {
+		if ((e->env_status == ENV_RUNNABLE ||
+		     e->env_status == ENV_RUNNING ||
+		     e->env_status == ENV_DYING ||
+		     e->env_futex_deadline))
 			break;
 	}
-	if (i == NENV) {
+	if (!e) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
+	// Mark that no environment is running on this CPU.  curenv may
+	// still be runnable, if it has been moved to another CPU's queue.
+	if (curenv) {
+		sched_charge(curenv);
+		curenv->env_run_start = 0;
+		if (curenv->env_status == ENV_RUNNING) {
+			env_set_status(curenv, ENV_RUNNABLE);
+			sched_wakeup(curenv);
+		}
+	}
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
+	vdso_run(NULL);
+	sched_leave(NULL);
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
@@ -6,7 +6,13 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_wakeup(struct Env *e);
+void sched_charge(struct Env *e);
+void sched_leave(struct Env *e);
+void sched_set_affinity(struct Env *e, uint32_t cpumask);
 
 #endif	// !JOS_KERN_SCHED_H
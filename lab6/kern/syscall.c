@@ -12,6 +12,8 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 #include <kern/e1000.h>
 
 // Print a string to the system console.
@@ -92,9 +94,45 @@ sys_exofork(void)
 	if ( err < 0) {
 		return err;
 	}
-	e->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(e, ENV_NOT_RUNNABLE);
 	e->env_tf = curenv->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_sched_class = curenv->env_sched_class;
+	e->env_nice = curenv->env_nice;
+	e->env_vruntime = curenv->env_vruntime;
+	e->env_cpumask = curenv->env_cpumask;
+	return e->env_id;
+}
+
+// Create a new thread: an environment like sys_exofork's, except that
+// it shares the current environment's address space instead of having
+// an empty one of its own.  It also starts with the current
+// environment's page fault upcall, and its exception stack is the page
+// below xstacktop.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+//	-E_INVAL if xstacktop is not page-aligned, or not in (0, UTOP].
+static envid_t
+sys_exothread(uintptr_t xstacktop)
+{
+	struct Env *e;
+	int r;
+
+	if (xstacktop % PGSIZE != 0 || xstacktop == 0 || xstacktop > UTOP)
+		return -E_INVAL;
+	if ((r = env_alloc_thread(&e, curenv)) < 0)
+		return r;
+	env_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_xstacktop = xstacktop;
+	e->env_sched_class = curenv->env_sched_class;
+	e->env_nice = curenv->env_nice;
+	e->env_vruntime = curenv->env_vruntime;
+	e->env_cpumask = curenv->env_cpumask;
 	return e->env_id;
 }
 
@@ -121,7 +159,71 @@ sys_env_set_status(envid_t envid, int status)
 	} else if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) {
 		return -E_INVAL;
 	}
-	e->env_status = status;
+	futex_cancel(e);
+	ipc_cancel(e, -E_INTR);
+	env_set_status(e, status);
+	if (status == ENV_RUNNABLE)
+		sched_wakeup(e);
+	return 0;
+}
+
+// Set envid's scheduling class to sched_class (SCHED_FAIR or
+// SCHED_SERVER) and its nice value to nice.  Only environments in the
+// SCHED_SERVER class may put others in it, or lower anybody's nice
+// value freely.  Others may raise their own nice value but never lower
+// it, and may give a child any nice value no lower than their own.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if sched_class or nice is out of range, or the caller
+//		may not use sched_class or nice.
+static int
+sys_env_set_priority(envid_t envid, int sched_class, int nice)
+{
+	struct Env *e;
+	int floor, r;
+
+	if ((r = envid2env(envid, &e, true)) < 0)
+		return r;
+	if ((sched_class != SCHED_FAIR && sched_class != SCHED_SERVER)
+	    || nice < NICE_MIN || nice > NICE_MAX)
+		return -E_INVAL;
+	if (curenv->env_sched_class != SCHED_SERVER) {
+		if (sched_class == SCHED_SERVER)
+			return -E_INVAL;
+		floor = (e != curenv && e->env_parent_id == curenv->env_id)
+			? curenv->env_nice : e->env_nice;
+		if (nice < floor)
+			return -E_INVAL;
+	}
+	sched_charge(e);
+	e->env_sched_class = sched_class;
+	e->env_nice = nice;
+	return 0;
+}
+
+// Let envid run only on the CPUs in cpumask: bit n for CPU n.  Bits for
+// CPUs that do not exist are ignored.  If envid is the caller and may
+// no longer run on this CPU, it moves before the call returns.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask names no CPU that exists.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, true)) < 0)
+		return r;
+	if (ncpu < 32)
+		cpumask &= (1U << ncpu) - 1;
+	if (!cpumask)
+		return -E_INVAL;
+	sched_set_affinity(e, cpumask);
 	return 0;
 }
 
@@ -132,6 +234,8 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if tf is not readable.
+//	-E_NO_MEM if there is no memory for a page of tf not yet allocated.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -233,6 +337,41 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return 0;
 }
 
+// Reserve [va, va + len) in the address space of 'envid' for demand-zero
+// allocation: each page of it is allocated, zeroed, and mapped with
+// permission 'perm' the first time anything touches it, without the
+// page fault reaching the environment.  Pages already mapped in the
+// range are left as they are.  sys_page_unmap drops a reservation.
+//
+// perm -- as for sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, or the range reaches past UTOP.
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_NO_MEM if there's no memory to allocate any necessary page
+//		tables, in which case part of the range may be reserved.
+static int
+sys_vm_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	uintptr_t a;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if ((uintptr_t) va % PGSIZE != 0 || (uintptr_t) va > UTOP
+	    || len > UTOP - (uintptr_t) va || (perm & ~PTE_SYSCALL) != 0)
+		return -E_INVAL;
+
+	for (a = (uintptr_t) va; a < (uintptr_t) va + len; a += PGSIZE)
+		if ((r = page_reserve(e->env_pgdir, (void *) a,
+				      perm | PTE_U | PTE_P)) < 0)
+			return r;
+	return 0;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -279,6 +418,10 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return err;
 	}
 
+	// A page reserved with sys_vm_reserve is allocated, to be shared.
+	if ((err = page_demand(src->env_pgdir, srcva)) < 0) {
+		return err;
+	}
 	pte_t *srcpte;
 	struct PageInfo *p = page_lookup(src->env_pgdir, srcva, &srcpte);
 	if (!p) {
@@ -319,8 +462,10 @@ sys_page_unmap(envid_t envid, void *va)
 }
 
 // Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// If srcva < UTOP, then also send the 'npages' pages currently mapped
+// starting at 'srcva', so that receiver gets duplicate mappings of the
+// same pages.  If the receiver asked for fewer pages, only that many
+// leading pages are sent.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -332,13 +477,14 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if pages were transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
 //
-// If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
+// If the sender wants to send pages but the receiver isn't asking for
+// any, then no page mapping is transferred, but no error occurs.
 // The ipc only happens when no errors occur.
 //
 // Returns 0 on success, < 0 on error.
@@ -347,89 +493,219 @@ sys_page_unmap(envid_t envid, void *va)
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned,
+//		or the npages pages at srcva run past UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//	-E_INVAL if srcva < UTOP but one of the pages is not mapped in the
+//		caller's address space.
+//	-E_INVAL if (perm & PTE_W), but one of the pages is read-only in
+//		the current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map the pages in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		 size_t npages)
 {
 	// LAB 4: Your code here.
 	int err = 0;
-	uintptr_t va = (uintptr_t)srcva;
 	struct Env *env = NULL;
 	if ((err = envid2env(envid, &env, false)) < 0) {
 		return err;
 	} else if (!env->env_ipc_recving) {
 		return -E_IPC_NOT_RECV;
-	} else if (va < UTOP && (va % PGSIZE) != 0) {
+	} else if ((err = ipc_check_send(srcva, perm, npages)) < 0) {
+		return err;
+	}
+	return ipc_deliver(curenv, env, value, srcva, perm, npages);
+}
+
+// Like sys_ipc_try_send, but if envid is not receiving, wait in line
+// until it is, rather than failing with -E_IPC_NOT_RECV.  Senders to
+// the same environment are served in the order they arrived.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, except -E_IPC_NOT_RECV, plus:
+//	-E_INVAL if envid is the current environment.
+//	-E_BAD_ENV if envid goes away before receiving.
+//	-E_INTR if the sender's status is set (sys_env_set_status) while
+//		it waits.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     size_t npages)
+{
+	struct Env *env;
+	int r;
+
+	if ((r = envid2env(envid, &env, false)) < 0)
+		return r;
+	if ((r = ipc_check_send(srcva, perm, npages)) < 0)
+		return r;
+	if (env->env_ipc_recving)
+		return ipc_deliver(curenv, env, value, srcva, perm, npages);
+	if (env == curenv)
 		return -E_INVAL;
-	} else if (va < UTOP && (perm & ~PTE_SYSCALL) != 0) {
+
+	curenv->env_ipc_call = false;
+	if ((r = ipc_enqueue(curenv, env, value, srcva, perm, npages)) < 0)
+		return r;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	ipc_yield();
+}
+
+// Send a request to envid as sys_ipc_send does (with at most one page
+// at srcva), then receive the reply as sys_ipc_recv does (at most one
+// page at dstva).  The caller is already receiving when envid gets the
+// request, so envid can reply with a plain send, and never has to wait.
+//
+// Returns 0 with the reply in the usual env_ipc_* fields, or < 0 on
+// error, as for sys_ipc_send, or if dstva < UTOP but is not
+// page-aligned (-E_INVAL).
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *env;
+	size_t npages = (uintptr_t) dstva < UTOP;
+	int r;
+
+	if ((r = envid2env(envid, &env, false)) < 0)
+		return r;
+	if ((r = ipc_check_send(srcva, perm, 1)) < 0)
+		return r;
+	if ((uintptr_t) dstva < UTOP && (uintptr_t) dstva % PGSIZE != 0)
+		return -E_INVAL;
+	if (env == curenv)
 		return -E_INVAL;
-	}
 
-	int received_perm = 0;
-	if (va < UTOP) {
-		pte_t *pte = NULL;
-		struct PageInfo *p = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (!p) {
-			return -E_INVAL;
-		} else if ((perm & PTE_W) && !(*pte & PTE_W)) {
-			return -E_INVAL;
-		}
-		if ((err = page_insert(env->env_pgdir,
-				       p,
-				       env->env_ipc_dstva,
-				       perm)) < 0) {
-			return err;
+	// The reply takes the place of any receive armed earlier with
+	// IPC_NOWAIT, so no other message can land while the request waits.
+	curenv->env_ipc_recving = false;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	if (env->env_ipc_recving) {
+		if ((r = ipc_deliver(curenv, env, value, srcva, perm, 1)) < 0)
+			return r;
+		if (ipc_arm(curenv, dstva, npages))
+			return 0;
+		env_set_status(curenv, ENV_NOT_RUNNABLE);
+	} else {
+		curenv->env_ipc_call = true;
+		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_npages = npages;
+		if ((r = ipc_enqueue(curenv, env, value, srcva, perm, 1)) < 0) {
+			curenv->env_ipc_call = false;
+			return r;
 		}
-		received_perm = perm;
 	}
-
-	env->env_ipc_value = value;
-	env->env_ipc_from = curenv->env_id;
-	env->env_ipc_perm = received_perm;
-
-	env->env_ipc_recving = false;
-	env->env_status = ENV_RUNNABLE;
-	return 0;
+	// Run the server now, if it was waiting for us.
+	ipc_yield();
 }
 
 // Block until a value is ready.  Record that you want to receive
-// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
-// mark yourself not runnable, and then give up the CPU.
+// using the env_ipc_recving, env_ipc_dstva and env_ipc_npages fields of
+// struct Env, mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP, then you are willing to receive up to 'npages'
+// pages of data, mapped starting at virtual address 'dstva'.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success because we'll set eax to 0 before yielding the CPU
+//
+// 'flags' may change this (see inc/env.h): IPC_NOWAIT records that you
+// want to receive and returns 0 without blocking; IPC_WAITARMED ignores
+// dstva and npages, and blocks only if a receive armed earlier is still
+// waiting for a message.
+//
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned,
+//		or the npages pages at dstva run past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, size_t npages, int flags)
 {
 	// LAB 4: Your code here.
 	uintptr_t va = (uintptr_t)dstva;
+	if (flags & IPC_WAITARMED) {
+		if (!curenv->env_ipc_recving)
+			return 0;
+		env_set_status(curenv, ENV_NOT_RUNNABLE);
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		ipc_yield();
+	}
 	if (va % PGSIZE != 0) {
 		return -E_INVAL;
 	}
-
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	curenv->env_ipc_recving = true;
 	if (va >= UTOP) {
-		curenv->env_tf.tf_regs.reg_eax = 0;
-		sched_yield(); // noreturn
+		npages = 0;
+	} else if (npages > (UTOP - va) / PGSIZE) {
+		return -E_INVAL;
 	}
-	curenv->env_ipc_dstva = dstva;
+
+	// Take the first message waiting to be sent, if there is one.
+	if (ipc_arm(curenv, dstva, npages) || (flags & IPC_NOWAIT))
+		return 0;
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
 
 	curenv->env_tf.tf_regs.reg_eax = 0;
-	sched_yield(); // noreturn
+	ipc_yield(); // noreturn
+}
+
+// Find the physical address of the word at user address addr, which
+// must be below UTOP.  A page reserved with sys_vm_reserve is allocated
+// first.
+static int
+futex_lookup(uint32_t *addr, physaddr_t *pa_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if ((uintptr_t) addr >= UTOP || (uintptr_t) addr % 4 != 0
+	    || page_demand(curenv->env_pgdir, addr) < 0
+	    || !(pp = page_lookup(curenv->env_pgdir, addr, &pte))
+	    || !(*pte & PTE_U))
+		return -E_INVAL;
+	*pa_store = page2pa(pp) + PGOFF(addr);
+	return 0;
+}
+
+// Block until another environment wakes the word at addr with
+// sys_futex_wake, unless the word no longer holds val.  Waiters meet on
+// the word's physical address, so it may be mapped anywhere in each
+// environment.  A nonzero timeout gives up after that many
+// milliseconds.  Removing any mapping of the page also wakes everyone
+// waiting on it, so waiting for another environment to let go of a
+// shared page works too.
+//
+// Returns 0 when woken or if *addr != val, -E_TIMEOUT on timeout.
+//	-E_INVAL if addr is not a word-aligned user address below UTOP.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, unsigned timeout)
+{
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_lookup(addr, &pa)) < 0)
+		return r;
+	if (*(uint32_t *) KADDR(pa) != val)
+		return 0;
+
+	futex_block(curenv, pa,
+		    timeout ? time_nsec() + (uint64_t) timeout * NSEC_PER_MSEC : 0);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Wake up to n environments waiting on the word at addr.
+// Returns the number woken, or -E_INVAL if addr is bad.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_lookup(addr, &pa)) < 0)
+		return r;
+	return futex_wake(pa, sizeof(uint32_t), n);
 }
 
 // Return the current time.
@@ -440,6 +716,19 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Sleep until the time is deadline, in nanoseconds since boot (as
+// vdso_time_nsec() reads it).  Returns 0, at once if the deadline has
+// passed.
+static int
+sys_sleep_until(uint64_t deadline)
+{
+	if (deadline <= time_nsec())
+		return 0;
+	futex_block(curenv, 0, deadline);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
 // transmit a packet.
 // returns -E_INVAL if size is bigger than allowed
 // returns -E_NIC_BUSY if transmission queue is full
@@ -463,6 +752,19 @@ sys_receive_packet(char *buf, int size)
 	return rx_packet(buf, size);
 }
 
+// sleep until the receive queue (or, if `tx`, the transmit queue) may
+// have become ready; returns at once if it already is.
+// returns 0; the caller should retry, as the wakeup may be spurious
+static int
+sys_net_wait(bool tx)
+{
+	if (e1000_wait(curenv, tx)) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
+	return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -471,6 +773,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Return any appropriate return value.
 	// LAB 3: Your code here.
 
+	curenv->env_syscalls++;
 	switch (syscallno) {
 	case SYS_cputs:
 		sys_cputs((const char*)a1, a2);
@@ -486,6 +789,8 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return 0;
 	case SYS_exofork:
 		return sys_exofork();
+	case SYS_exothread:
+		return sys_exothread(a1);
 	case SYS_env_set_status:
 		return sys_env_set_status((envid_t)a1, a2);
 	case SYS_env_set_pgfault_upcall:
@@ -497,11 +802,19 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			            (envid_t)a3, (void *)a4, (int)a5);
 	case SYS_page_unmap:
 		return sys_page_unmap((envid_t)a1, (void *)a2);
+	case SYS_vm_reserve:
+		return sys_vm_reserve((envid_t)a1, (void *)a2, (size_t)a3, (int)a4);
 	case SYS_ipc_recv:
-		return sys_ipc_recv((void *)a1);
+		return sys_ipc_recv((void *)a1, (size_t)a2, (int)a3);
 	case SYS_ipc_try_send:
 		return sys_ipc_try_send((envid_t)a1, (uint32_t)a2,
-					(void *)a3, (unsigned)a4);
+					(void *)a3, (unsigned)a4, (size_t)a5);
+	case SYS_ipc_send:
+		return sys_ipc_send((envid_t)a1, (uint32_t)a2,
+				    (void *)a3, (unsigned)a4, (size_t)a5);
+	case SYS_ipc_call:
+		return sys_ipc_call((envid_t)a1, (uint32_t)a2,
+				    (void *)a3, (unsigned)a4, (void *)a5);
 	case SYS_env_set_trapframe:
 		return sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
 	case SYS_time_msec:
@@ -510,6 +823,18 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_transmit_packet((char *)a1, (int)a2);
 	case SYS_receive_packet:
 		return sys_receive_packet((char *)a1, (int)a2);
+	case SYS_net_wait:
+		return sys_net_wait((bool)a1);
+	case SYS_futex_wait:
+		return sys_futex_wait((uint32_t *)a1, a2, (unsigned)a3);
+	case SYS_futex_wake:
+		return sys_futex_wake((uint32_t *)a1, (int)a2);
+	case SYS_sleep_until:
+		return sys_sleep_until(a1 | (uint64_t) a2 << 32);
+	case SYS_env_set_priority:
+		return sys_env_set_priority((envid_t) a1, (int) a2, (int) a3);
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity((envid_t) a1, a2);
 	default:
 		return -E_INVAL;
 	}
@@ -1,26 +1,94 @@
-#include <kern/time.h>
+// The clock and the per-CPU timers.
+//
+// Time is kept by the TSC, and each CPU's local APIC timer runs in
+// one-shot mode, set for that CPU's next event only (time_arm), so an
+// idle CPU with nothing to wait for is never interrupted.  Both are
+// calibrated at boot against the PIT, whose rate is known.
+
 #include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/vdso.h>
+
+// PIT channel 2, whose gate and output are in the keyboard
+// controller's port B.
+#define IO_PIT_CH2	0x42
+#define IO_PIT_CMD	0x43
+#define IO_PORTB	0x61
+#define PIT_HZ		1193182
 
-static unsigned int ticks;
+// Length of the calibration (at most 54 ms, for the PIT's 16-bit count)
+#define CALIBRATE_MS	50
 
+// The furthest ahead a timer is set; a later event is reached in steps.
+#define MAXARM		(1000 * NSEC_PER_MSEC)
+
+static uint64_t tsc_base;	// TSC at time 0
+static uint32_t tsc_per_ms;	// TSC cycles per millisecond
+static uint32_t lapic_per_ms;	// local APIC timer counts per millisecond
+
+// Measure the TSC and local APIC timer rates by timing CALIBRATE_MS of
+// PIT countdown, and start the clock.
 void
 time_init(void)
 {
-	ticks = 0;
+	uint32_t latch = PIT_HZ * CALIBRATE_MS / 1000;
+	uint64_t tsc0, tsc1;
+	uint32_t left;
+
+	// Gate channel 2 on, speaker off; one-shot countdown of latch.
+	outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01);
+	outb(IO_PIT_CMD, 0xB0);
+	outb(IO_PIT_CH2, latch & 0xFF);
+	outb(IO_PIT_CH2, latch >> 8);
+
+	lapic_timer_set(~0);
+	tsc0 = read_tsc();
+	// The channel's output goes high when the count runs out.
+	while (!(inb(IO_PORTB) & 0x20))
+		/* wait */;
+	tsc1 = read_tsc();
+	left = lapic_timer_left();
+	lapic_timer_set(0);
+
+	tsc_per_ms = (tsc1 - tsc0) / CALIBRATE_MS;
+	lapic_per_ms = (~0U - left) / CALIBRATE_MS;
+	if (tsc_per_ms == 0)
+		panic("time_init: cannot calibrate the TSC");
+	tsc_base = tsc0;
+
+	vdso->vd_tsc_base = tsc_base;
+	vdso->vd_tsc_per_ms = tsc_per_ms;
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// Nanoseconds since boot.
+uint64_t
+time_nsec(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	return vdso_tsc2nsec(read_tsc() - tsc_base, tsc_per_ms);
 }
 
+// Milliseconds since boot.
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return (read_tsc() - tsc_base) / tsc_per_ms;
+}
+
+// Interrupt this CPU (with IRQ_TIMER) at time_nsec() deadline, or, if
+// deadline is TIME_NEVER, not at all.  Replaces the previous setting.
+void
+time_arm(uint64_t deadline)
+{
+	uint64_t now, delta;
+
+	if (deadline == TIME_NEVER || lapic_per_ms == 0) {
+		lapic_timer_set(0);
+		return;
+	}
+	now = time_nsec();
+	delta = deadline > now ? MIN(deadline - now, MAXARM) : 0;
+	lapic_timer_set(MAX(delta * lapic_per_ms / NSEC_PER_MSEC, 1));
 }
@@ -4,8 +4,14 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+#include <inc/vdso.h>
+
+#define TIME_NEVER	(~(uint64_t) 0)
+
 void time_init(void);
-void time_tick(void);
+uint64_t time_nsec(void);
 unsigned int time_msec(void);
+void time_arm(uint64_t deadline);
 
 #endif /* JOS_KERN_TIME_H */
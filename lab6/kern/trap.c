@@ -14,6 +14,9 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/futex.h>
+#include <kern/e1000.h>
+#include <kern/vdso.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -108,6 +111,12 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + IRQ_KBD], false, GD_KT, irq_kbd, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], false, GD_KT, irq_serial, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], false, GD_KT, irq_spurious, 0);
+	static_assert(IRQ_PCI_FIRST == 9 && IRQ_PCI_LAST == 11);
+	SETGATE(idt[IRQ_OFFSET + 9], false, GD_KT, irq_pci9, 0);
+	SETGATE(idt[IRQ_OFFSET + 10], false, GD_KT, irq_pci10, 0);
+	SETGATE(idt[IRQ_OFFSET + 11], false, GD_KT, irq_pci11, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], false, GD_KT, irq_wakeup, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], false, GD_KT, irq_tlb, 0);
 
 	// ensure bootstrap cpu gets initialized too
 	trap_init_percpu();
@@ -251,9 +260,14 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 6: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
-		if (cpunum() == 0) {
-			time_tick();
-		}
+		vdso_tick();
+		futex_expire(time_nsec());
+		sched_yield(); // noreturn
+	}
+
+	// Another CPU made an environment runnable while we were halted.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_WAKEUP) {
+		lapic_eoi();
 		sched_yield(); // noreturn
 	}
 
@@ -270,6 +284,12 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Network card interrupts
+	if (e1000_irq && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		e1000_intr();
+		return;
+	}
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -293,6 +313,16 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// A TLB shootdown (see tlb_invalidate) just flushes this CPU's TLB.
+	// It must not wait for the big kernel lock, which the CPU that sent
+	// it holds until we have done so.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lcr3(rcr3());
+		thiscpu->cpu_tlb_stale = false;
+		lapic_eoi();
+		env_pop_tf(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -313,9 +343,16 @@ trap(struct Trapframe *tf)
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
+		thiscpu->cpu_in_user = false;
 		lock_kernel();
 		assert(curenv);
 
+		// A TLB shootdown may have come while we waited for the lock.
+		if (thiscpu->cpu_tlb_stale) {
+			lcr3(rcr3());
+			thiscpu->cpu_tlb_stale = false;
+		}
+
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
@@ -365,6 +402,15 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// A page reserved with sys_vm_reserve gets its zeroed page now, and
+	// a write to a copy-on-write page its own copy; either way the
+	// environment carries on as though it had always been there.
+	if (fault_va < UTOP
+	    && (page_demand(curenv->env_pgdir, (void *) fault_va) > 0
+		|| ((tf->tf_err & FEC_WR)
+		    && page_cow(curenv->env_pgdir, (void *) fault_va) > 0)))
+		env_run(curenv);
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -400,10 +446,12 @@ page_fault_handler(struct Trapframe *tf)
 		goto bad;
 	}
 
-	uintptr_t UXSTACKBOTTOM = UXSTACKTOP - PGSIZE;
+	// Each thread has its own exception stack, below env_xstacktop.
+	uintptr_t xstacktop = curenv->env_xstacktop;
+	uintptr_t UXSTACKBOTTOM = xstacktop - PGSIZE;
 
-	uintptr_t tftop = UXSTACKTOP;
-	if (tf->tf_esp >= UXSTACKBOTTOM && tf->tf_esp < UXSTACKTOP) {
+	uintptr_t tftop = xstacktop;
+	if (tf->tf_esp >= UXSTACKBOTTOM && tf->tf_esp < xstacktop) {
 		// if we are on the user exception stack, then
 		// place the next trap frame 4 bytes underneath
 		tftop = tf->tf_esp - 4;
@@ -52,6 +52,11 @@ void irq_timer();
 void irq_kbd();
 void irq_serial();
 void irq_spurious();
+void irq_pci9();
+void irq_pci10();
+void irq_pci11();
 void irq_error();
+void irq_wakeup();
+void irq_tlb();
 
 #endif /* JOS_KERN_TRAP_H */
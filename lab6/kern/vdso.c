@@ -0,0 +1,28 @@
+// Keeping the vDSO page (see inc/vdso.h) up to date.  time_init()
+// fills in the clock.
+
+#include <inc/assert.h>
+
+#include <kern/vdso.h>
+#include <kern/cpu.h>
+
+struct Vdso *vdso;
+
+// This CPU has taken a timer interrupt.
+void
+vdso_tick(void)
+{
+	static_assert(NCPU <= VDSO_NCPU);
+	vdso->vd_cpu[cpunum()].vc_ticks++;
+}
+
+// This CPU is about to run e, or to go idle if e is NULL.
+void
+vdso_run(struct Env *e)
+{
+	struct VdsoCpu *vc = &vdso->vd_cpu[cpunum()];
+
+	vc->vc_curenv = e ? e->env_id : 0;
+	__sync_synchronize();
+	vc->vc_gen++;
+}
@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_VDSO_H
+#define JOS_KERN_VDSO_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/vdso.h>
+#include <inc/env.h>
+
+extern struct Vdso *vdso;
+
+void vdso_tick(void);
+void vdso_run(struct Env *e);
+
+#endif	// !JOS_KERN_VDSO_H
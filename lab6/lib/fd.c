@@ -6,14 +6,14 @@
 #define MAXFD		32
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
-// Bottom of file data area.  We reserve one data page for each FD,
-// which devices can use if they choose.
+// Bottom of file data area.  We reserve FDDATAPAGES data pages for each
+// FD, which devices can use if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
-// Return the file data page for file descriptor index i
-#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
+// Return the file data area for file descriptor index i
+#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*FDDATAPAGES*PGSIZE))
 
 
 // --------------------------------------------------------------
@@ -174,7 +174,7 @@ close_all(void)
 int
 dup(int oldfdnum, int newfdnum)
 {
-	int r;
+	int i, r;
 	char *ova, *nva;
 	pte_t pte;
 	struct Fd *oldfd, *newfd;
@@ -187,9 +187,14 @@ dup(int oldfdnum, int newfdnum)
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 
-	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
-		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
-			goto err;
+	// Map the data pages before the Fd page, so that nobody ever sees
+	// more references to the Fd than to its data (see pipeisclosed).
+	for (i = 0; i < FDDATAPAGES; i++)
+		if ((uvpd[PDX(ova + i*PGSIZE)] & PTE_P)
+		    && (uvpt[PGNUM(ova + i*PGSIZE)] & PTE_P))
+			if ((r = sys_page_map(0, ova + i*PGSIZE, 0, nva + i*PGSIZE,
+					      uvpt[PGNUM(ova + i*PGSIZE)] & PTE_SYSCALL)) < 0)
+				goto err;
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
@@ -197,7 +202,8 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	sys_page_unmap(0, nva);
+	for (i = 0; i < FDDATAPAGES; i++)
+		sys_page_unmap(0, nva + i*PGSIZE);
 	return r;
 }
 
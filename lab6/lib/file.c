@@ -24,8 +24,49 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+// Reads and writes larger than a page go through a bulk window of
+// FSBULKPAGES pages at FSBULKVA shared with the file server, so each
+// one of up to FSBULKSIZE bytes takes a single round trip.  The data
+// is still copied between the window and the caller's buffer.  The
+// window is PTE_SHARE so that fork leaves the parent's mapping alone;
+// a child sets up a window of its own.
+
+static envid_t fsbulk_owner;	// env whose window is at FSBULKVA
+static envid_t fsbulk_failed;	// env that could not get a window
+
+// Make sure this environment has a bulk window.
+// Returns 0 on success, < 0 if bulk transfers are unavailable.
+static int
+fsbulk_setup(void)
+{
+	int i, r;
+	envid_t fsenv;
+
+	if (fsbulk_owner == thisenv->env_id)
+		return 0;
+	if (fsbulk_failed == thisenv->env_id)
+		return -E_NO_MEM;
+
+	fsbulk_failed = thisenv->env_id;
+	for (i = 0; i < FSBULKPAGES; i++)
+		if ((r = sys_page_alloc(0, (char *) FSBULKVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			goto fail;
+	fsenv = ipc_find_env(ENV_TYPE_FS);
+	ipc_send_pages(fsenv, FSREQ_BULK_SETUP, (void *) FSBULKVA, FSBULKPAGES,
+		       PTE_P|PTE_U|PTE_W);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+		goto fail;
+	fsbulk_owner = thisenv->env_id;
+	return 0;
+
+fail:
+	for (i = 0; i < FSBULKPAGES; i++)
+		sys_page_unmap(0, (char *) FSBULKVA + i * PGSIZE);
+	return r;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -117,6 +158,16 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (n > PGSIZE && fsbulk_setup() == 0) {
+		fsipcbuf.bulk.req_fileid = fd->fd_file.id;
+		fsipcbuf.bulk.req_n = MIN(n, FSBULKSIZE);
+		if ((r = fsipc(FSREQ_BULK_READ, NULL)) < 0)
+			return r;
+		assert(r <= MIN(n, FSBULKSIZE));
+		memmove(buf, (void *) FSBULKVA, r);
+		return r;
+	}
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -142,11 +193,24 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
 	int r;
+	size_t max_written = sizeof(fsipcbuf.write.req_buf);
+
+	// Like reads, only writes larger than a page are worth a bulk
+	// window.  One of a page or a little less goes in request-sized
+	// pieces, just as it did before there were windows.
+	if (n > PGSIZE && fsbulk_setup() == 0) {
+		fsipcbuf.bulk.req_fileid = fd->fd_file.id;
+		fsipcbuf.bulk.req_n = MIN(n, FSBULKSIZE);
+		memmove((void *) FSBULKVA, buf, fsipcbuf.bulk.req_n);
+		if ((r = fsipc(FSREQ_BULK_WRITE, NULL)) < 0)
+			return r;
+		assert(r <= MIN(n, FSBULKSIZE));
+		return r;
+	}
 
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 
-	size_t max_written = sizeof(fsipcbuf.write.req_buf);
 	memmove(fsipcbuf.write.req_buf, buf, MIN(max_written, n));
 
 	if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
@@ -181,6 +245,15 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
 
 // Synchronize disk with buffer cache
 int
@@ -192,3 +265,41 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Map the npages (at most FSMAPPAGES) pages of file fdnum starting at
+// the page-aligned offset at dstva.  The pages are the file server's
+// block cache pages: read-only, or copy-on-write if 'private'.  They
+// must lie within the file.
+// Returns 0 on success, < 0 on error.
+int
+read_map(int fdnum, off_t offset, void *dstva, size_t npages, bool private)
+{
+	static envid_t fsenv;
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	fsipcbuf.map.req_npages = npages;
+	fsipcbuf.map.req_private = private;
+	ipc_send(fsenv, FSREQ_MAP, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	return ipc_recv_pages(NULL, dstva, npages, NULL);
+}
+
+// Fetch the file server's statistics
+int
+fsstats(struct Fsret_stats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
@@ -2,61 +2,7 @@
 
 #include <inc/string.h>
 #include <inc/lib.h>
-
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
-//
-// Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
-//
-static void
-pgfault(struct UTrapframe *utf)
-{
-	void *addr = (void *) utf->utf_fault_va;
-	uint32_t err = utf->utf_err;
-	int r;
-
-//	cprintf("[%x] pgfault handler: %x\n", sys_getenvid(),  (uintptr_t)addr);
-
-	// Check that the faulting access was (1) a write, and (2) to a
-	// copy-on-write page.  If not, panic.
-	// Hint:
-	//   Use the read-only page table mappings at uvpt
-	//   (see <inc/memlayout.h>).
-
-	// LAB 4: Your code here.
-	pte_t pte = uvpt[(uintptr_t)addr >> PGSHIFT];
-
-	if (!(err & 2)) {
-		panic("pgfault was not a write. addr: %x err: %x", addr, err);
-	} else if (!(pte & PTE_COW)) {
-		panic("pgfault is not copy on write. addr: %x", addr);
-	}
-
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
-	// Hint:
-	//   You should make three system calls.
-	// LAB 4: Your code here.
-	int perm = PTE_P | PTE_U | PTE_W;
-	if ((r = sys_page_alloc(0, UTEMP, perm)) < 0) {
-		panic("sys_page_alloc: %e", r);
-	}
-	memmove(UTEMP, ROUNDDOWN(addr, PGSIZE), PGSIZE);
-	if ((r = sys_page_map(0,
-			      UTEMP,
-			      0,
-			      ROUNDDOWN(addr, PGSIZE),
-			      perm)) < 0) {
-		panic("sys_page_map %e", r);
-	}
-	if ((r = sys_page_unmap(0, UTEMP)) < 0) {
-		panic("unmap %e", r);
-	}
-}
+#include <inc/x86.h>
 
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
@@ -113,8 +59,43 @@ duppage(envid_t envid, unsigned pn)
 }
 
 //
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
+// Our virtual page pn is reserved for demand-zero allocation and has not
+// been touched yet.  Reserve the same page in the target envid, unless
+// the page is to be shared, in which case sys_page_map allocates it so
+// that both of us can map it.
+//
+static int
+resvpage(envid_t envid, unsigned pn)
+{
+	void *va = (void *)(pn * PGSIZE);
+	int perm = uvpt[pn] & PTE_SYSCALL & ~PTE_DZERO;
+	int r;
+
+	if (perm & PTE_SHARE)
+		r = sys_page_map(0, va, envid, va, perm | PTE_P);
+	else
+		r = sys_vm_reserve(envid, va, PGSIZE, perm);
+	if (r < 0)
+		panic("resvpage: %e", r);
+	return 0;
+}
+
+// Whether fork leaves page va out of the child: exception stacks, which
+// must never be copy-on-write, and the slots of threads other than the
+// calling one (see inc/lib.h), which do not exist in the child.
+static bool
+fork_skips(uintptr_t va, int slot)
+{
+	if (va < UTHREADS || va >= UXSTACKTOP)
+		return false;
+	if ((UXSTACKTOP - PGSIZE - va) % THREADSLOT == 0)
+		return true;
+	return (UXSTACKTOP - 1 - va) / THREADSLOT != slot;
+}
+
+//
+// User-level fork with copy-on-write.  The kernel copies a
+// copy-on-write page when it is first written to.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
 // Then mark the child as runnable and return.
@@ -132,13 +113,13 @@ envid_t
 fork(void)
 {
 	// LAB 4: Your code here.
-	set_pgfault_handler(pgfault);
-
 	envid_t envid = sys_exofork();
 	if (envid < 0) {
 		panic("sys_exofork: %e", envid);
 	} else if (envid == 0) {  // child
-		thisenv = &envs[ENVX(sys_getenvid())];
+		// The child has just the one thread, but its page fault
+		// handlers run on the exception stack of slot 0.
+		thisenv = thread_env[0] = &envs[ENVX(sys_getenvid())];
 		return envid;
 	}
 
@@ -149,39 +130,139 @@ fork(void)
 //		envid);
 
 	bool is_below_ulim = true;
+	int slot = thread_slot();
 	for (int i = 0; is_below_ulim && i < NPDENTRIES ; i++) {
 		if (!(uvpd[i] & PTE_P)) {
 			continue;
 		}
 		for (int j = 0; is_below_ulim && j < NPTENTRIES; j++) {
 			unsigned pn = i * NPTENTRIES + j;
-			if (pn == ((UXSTACKTOP - PGSIZE) >> PGSHIFT)) {
+			if (fork_skips(pn * PGSIZE, slot)) {
 				continue;
 			} else if (pn >= (UTOP >> PGSHIFT)) {
 				is_below_ulim = false;
 			} else if (uvpt[pn] & PTE_P) {
 //				cprintf("%x ", pn);
 				duppage(envid, pn);
+			} else if (uvpt[pn] & PTE_DZERO) {
+				// still untouched: the child gets its own
+				resvpage(envid, pn);
 			}
 		}
 	}
 //	cprintf("\n");
 
-	// install upcall
-	extern void _pgfault_upcall();
-	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
-	// allocate the user exception stack (not COW)
-	sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_W | PTE_U);
+	// install our upcall, if we have page fault handlers, and
+	// reserve the user exception stack for it (not COW)
+	if (thisenv->env_pgfault_upcall) {
+		sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall);
+		sys_vm_reserve(envid, (void *)(UXSTACKTOP - PGSIZE), PGSIZE,
+			       PTE_W | PTE_U);
+	}
 	// let the child start
 	sys_env_set_status(envid, ENV_RUNNABLE);
 
 	return envid;
 }
 
-// Challenge!
-int
-sfork(void)
+// The thread using each slot, or 0 if none has; slot 0 is always the
+// first thread's.  thread_lock guards it.
+static envid_t thread_id[NTHREAD];
+static volatile uint32_t thread_lock;
+
+// The top of the stack in a slot
+#define THREADSTACKTOP(slot)	(UXSTACKTOP - (slot) * THREADSLOT - 2 * PGSIZE)
+
+// Claim a slot whose thread, if it ever had one, has exited.
+// Returns the slot, or -E_NO_FREE_ENV if there is none.
+static int
+thread_slot_alloc(void)
+{
+	envid_t id;
+	int slot;
+
+	while (xchg(&thread_lock, 1) != 0)
+		sys_yield();
+	for (slot = 1; slot < NTHREAD; slot++) {
+		id = thread_id[slot];
+		if (id == 0 || (id > 0 && (envs[ENVX(id)].env_id != id
+					   || envs[ENVX(id)].env_status == ENV_FREE)))
+			break;
+	}
+	if (slot < NTHREAD)
+		thread_id[slot] = -1;
+	xchg(&thread_lock, 0);
+	return slot < NTHREAD ? slot : -E_NO_FREE_ENV;
+}
+
+// Make sure the pages of va through va + len - 1 are mapped, or will be
+// on first touch.
+static int
+thread_map(uintptr_t va, size_t len)
+{
+	return sys_vm_reserve(0, (void *) ROUNDDOWN(va, PGSIZE),
+			      ROUNDUP(len, PGSIZE), PTE_P|PTE_U|PTE_W);
+}
+
+// Where a thread made by sfork starts: run entry, then exit, just as
+// libmain runs umain.
+static void
+thread_main(void (*entry)(void *), void *arg)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	entry(arg);
+	exit();
+}
+
+//
+// Shared-memory fork.  Create a thread: an environment sharing our
+// address space, which calls entry(arg) on a fresh stack in a slot of
+// its own (see inc/lib.h) and exits when entry returns.  Nothing on the
+// caller's stack is copied, so arg must not point there unless the
+// caller waits for the thread before returning.
+//
+// Returns: the thread's envid, or < 0 on error.
+//
+envid_t
+sfork(void (*entry)(void *), void *arg)
+{
+	struct Trapframe tf;
+	uintptr_t top;
+	uint32_t *sp;
+	int slot, r;
+	envid_t envid;
+
+	if ((slot = thread_slot_alloc()) < 0)
+		return slot;
+	top = THREADSTACKTOP(slot);
+	if ((r = thread_map(top + PGSIZE, PGSIZE)) < 0
+	    || (r = thread_map(top - THREADSTACK, THREADSTACK)) < 0) {
+		thread_id[slot] = 0;
+		return r;
+	}
+
+	// The thread stays not runnable until it has its own trap frame,
+	// so it never returns from sys_exothread itself.
+	envid = sys_exothread((void *) (top + 2 * PGSIZE));
+	if (envid < 0) {
+		thread_id[slot] = 0;
+		return envid;
+	}
+
+	// Start it in thread_main, as if called with entry and arg from a
+	// function with no frame of its own.
+	sp = (uint32_t *) top;
+	*--sp = (uint32_t) arg;
+	*--sp = (uint32_t) entry;
+	*--sp = 0;
+	tf = envs[ENVX(envid)].env_tf;
+	tf.tf_esp = (uintptr_t) sp;
+	tf.tf_eip = (uintptr_t) thread_main;
+	tf.tf_regs.reg_ebp = 0;
+
+	thread_env[slot] = &envs[ENVX(envid)];
+	thread_id[slot] = envid;
+	if ((r = sys_env_set_trapframe(envid, &tf)) < 0
+	    || (r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sfork: %e", r);
+	return envid;
 }
@@ -0,0 +1,108 @@
+// Asynchronous file server requests through a ring shared with the
+// server (see struct Fsring in inc/fs.h).
+
+#include <inc/fs.h>
+#include <inc/lib.h>
+
+// The ring page, then its data pages, at FSRINGVA.  Like the bulk
+// window, the ring is PTE_SHARE so that fork leaves the parent's
+// mapping alone; a child sets up a ring of its own.
+static struct Fsring *const fsring = (struct Fsring *) FSRINGVA;
+static envid_t fsring_owner;	// env whose ring is at FSRINGVA
+static envid_t fsenv;
+
+// Set up this environment's ring.  Returns 0 on success, < 0 on error.
+int
+fsring_setup(void)
+{
+	int i, r;
+
+	if (fsring_owner == thisenv->env_id)
+		return 0;
+
+	for (i = 0; i < 1 + FSRINGDATAPAGES; i++)
+		if ((r = sys_page_alloc(0, (char *) FSRINGVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			goto fail;
+	fsenv = ipc_find_env(ENV_TYPE_FS);
+	ipc_send_pages(fsenv, FSREQ_RING_SETUP, (void *) FSRINGVA,
+		       1 + FSRINGDATAPAGES, PTE_P|PTE_U|PTE_W);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+		goto fail;
+	fsring_owner = thisenv->env_id;
+	return 0;
+
+fail:
+	for (i = 0; i < 1 + FSRINGDATAPAGES; i++)
+		sys_page_unmap(0, (char *) FSRINGVA + i * PGSIZE);
+	return r;
+}
+
+// Return the ring's FSRINGDATASIZE bytes of data pages, which requests
+// read into and write from.
+char *
+fsring_data(void)
+{
+	return (char *) FSRINGVA + PGSIZE;
+}
+
+// Queue an FSRING_* request on file descriptor fdnum, for n bytes at
+// file position offset, using the data pages from byte buf on.  'data'
+// comes back with the completion.  Wakes the server if it is idle.
+// Returns 0 on success, -E_NO_MEM if FSRINGNENT requests are already
+// outstanding, or another error.
+int
+fsring_submit(int op, int fdnum, off_t offset, size_t n, size_t buf,
+	      uint32_t data)
+{
+	struct Fsring_sqe *sqe;
+	struct Fd *fd;
+	int r;
+
+	if (fsring_owner != thisenv->env_id)
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if (fsring->r_sqtail - fsring->r_cqhead >= FSRINGNENT)
+		return -E_NO_MEM;
+
+	sqe = &fsring->r_sq[fsring->r_sqtail % FSRINGNENT];
+	sqe->sqe_op = op;
+	sqe->sqe_fileid = fd->fd_file.id;
+	sqe->sqe_offset = offset;
+	sqe->sqe_n = n;
+	sqe->sqe_buf = buf;
+	sqe->sqe_data = data;
+	__sync_synchronize();
+	fsring->r_sqtail++;
+
+	// Ring the doorbell if the server has gone to sleep.  If it is not
+	// receiving after all, it is busy and will see the request anyway.
+	__sync_synchronize();
+	if (fsring->r_idle)
+		sys_ipc_try_send(fsenv, FSREQ_RING_KICK, (void *) UTOP, 0);
+	return 0;
+}
+
+// Take the next completion, storing it in *cqe.  If there is none yet,
+// wait for one if block is set.  Returns 1 if a completion was taken,
+// 0 if not.
+int
+fsring_complete(struct Fsring_cqe *cqe, bool block)
+{
+	uint32_t tail;
+
+	while ((tail = fsring->r_cqtail) == fsring->r_cqhead) {
+		if (!block || fsring_owner != thisenv->env_id)
+			return 0;
+		__sync_fetch_and_add(&fsring->r_waiting, 1);
+		sys_futex_wait(&fsring->r_cqtail, tail, 0);
+		__sync_fetch_and_sub(&fsring->r_waiting, 1);
+	}
+	*cqe = fsring->r_cq[fsring->r_cqhead % FSRINGNENT];
+	__sync_synchronize();
+	fsring->r_cqhead++;
+	return 1;
+}
@@ -21,12 +21,20 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_pages(from_env_store, pg, 1, perm_store);
+}
+
+// Like ipc_recv, but accept up to 'npages' pages, mapped starting at 'pg'.
+// thisenv->env_ipc_npages says how many actually arrived.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t npages, int *perm_store)
 {
 	// LAB 4: Your code here.
 	if (!pg) {
 		pg = (void *)KERNBASE;
 	}
-	int err = sys_ipc_recv(pg);
+	int err = sys_ipc_recv_pages(pg, npages, 0);
 
 	envid_t env_store_ret = 0;
 	int perm_ret = 0;
@@ -46,15 +54,23 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// If 'toenv' is not receiving, this waits in the kernel, in line with
+// any other senders, until it is.  A wait cut short by a change to
+// this environment's status (-E_INTR) starts over.
+// It panics on any other error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	ipc_send_pages(to_env, val, pg, 1, perm);
+}
+
+// Like ipc_send, but send the 'npages' pages starting at 'pg'.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
 {
 	// LAB 4: Your code here.
 	// if pg is null, send something above ULIMIT to signal we don't want
@@ -62,18 +78,38 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (!pg) {
 		pg = (void *)KERNBASE;
 	}
-	while(true) {
-		int err = sys_ipc_try_send(to_env, val, pg, perm);
-		if (err == -E_IPC_NOT_RECV) {
-			sys_yield();
-		} else if (err == 0) {
-			break;
-		} else {
-			panic("ipc_send failed: %e", err);
-		}
+	int err;
+	while ((err = sys_ipc_send_pages(to_env, val, pg, npages, perm)) == -E_INTR)
+		;
+	if (err < 0) {
+		panic("ipc_send failed: %e", err);
 	}
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env', as
+// ipc_send does, and receive its reply, as ipc_recv does ('rcv_pg' is
+// where a page sent with the reply is mapped, if nonnull).  Returns the
+// value of the reply, or < 0 on error.  Like ipc_send, it starts over
+// if its wait to send is interrupted, since the request never went.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm, void *rcv_pg,
+	 int *perm_store)
+{
+	if (!pg) {
+		pg = (void *)KERNBASE;
+	}
+	if (!rcv_pg) {
+		rcv_pg = (void *)KERNBASE;
+	}
+	int err;
+	while ((err = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) == -E_INTR)
+		;
+	if (perm_store) {
+		*perm_store = (err >= 0) ? thisenv->env_ipc_perm : 0;
+	}
+	return (err >= 0) ? thisenv->env_ipc_value : err;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -81,7 +117,7 @@ envid_t
 ipc_find_env(enum EnvType type)
 {
 	int i;
-	for (i = 0; i < NENV; i++)
+	for (i = 0; i < vdso.vd_nenv; i++)
 		if (envs[i].env_type == type)
 			return envs[i].env_id;
 	return 0;
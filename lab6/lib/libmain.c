@@ -5,7 +5,7 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
+const volatile struct Env *thread_env[NTHREAD];
 const char *binaryname = "<unknown>";
 
 void
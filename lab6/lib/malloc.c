@@ -1,140 +1,556 @@
-
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 /*
- * Simple malloc/free.
+ * Size-class malloc/free.
+ *
+ * The heap is the address space from mbegin to mend.  Its first
+ * MAPPAGES pages hold the page map, one word for every heap page
+ * saying what the page belongs to; the pages after them are mapped
+ * from the bottom up, at least HEAPCHUNK at a time, and handed out
+ * as runs of whole pages.  Mapping them only reserves them with
+ * sys_vm_reserve: the kernel allocates each page, zeroed, when it is
+ * first touched, so memory that is never used costs nothing.
+ *
+ * Requests of up to MAXSMALL bytes are rounded up to one of NCLASS
+ * size classes and carved out of slabs: runs cut into objects of a
+ * single class, with a struct Slab at the front listing the free
+ * ones.  Each class keeps a list of its slabs that have free objects,
+ * so a freed object is reused by the next malloc of its class, and a
+ * slab that becomes entirely free goes back to the free runs.  Larger
+ * requests get a run of their own.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * Free runs are merged with their free neighbours and kept on lists
+ * by length, still mapped, so most allocations make no system calls
+ * at all.  Only when the free run at the top of the heap grows past
+ * HEAPTRIM pages are all but HEAPCHUNK of them unmapped.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Threads made by sfork share the heap, so it is guarded by a spin
+ * lock.  To keep most mallocs and frees away from the lock, each
+ * thread slot caches up to TCACHEMAX free objects of every class and
+ * takes or returns TCACHEBATCH at a time.
  */
-enum
-{
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
-};
-
-#define PTE_CONTINUED 0x200
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
-static uint8_t *mptr;
 
+#define NHEAPPAGE	((0x10000000 - 0x08000000) / PGSIZE)
+#define MAPPAGES	(NHEAPPAGE * sizeof(uint32_t) / PGSIZE)
+#define HEAPCHUNK	64
+#define HEAPTRIM	256
+
+#define PAGEVA(p)	(mbegin + (p) * PGSIZE)
+#define PAGENO(v)	(((uint8_t*) (v) - mbegin) / PGSIZE)
+
+/*
+ * Page map entries.  The first and last page of a run both record
+ * whether it is free or allocated and how many pages it has, so that
+ * freeing a run can find its neighbours.  Every page of a slab records
+ * the slab's class and how far the page is from the slab's first.
+ */
+#define PM_FREE		1
+#define PM_RUN		2
+#define PM_SLAB		3
+#define PM_KIND(m)	((m) & 3)
+#define PM_CLASS(m)	(((m) >> 2) & 0x3F)
+#define PM_N(m)		((m) >> 8)
+#define PM(n, c, kind)	(((n) << 8) | ((c) << 2) | (kind))
+
+static uint32_t *pagemap = (uint32_t*) 0x08000000;
+static size_t heapbrk;		/* first page not mapped, 0 before malloc_init */
+static size_t mapbrk;		/* page map pages mapped */
+
+/*
+ * Size classes.  A slab has room for about SLABMIN objects, rounded up
+ * to whole pages.
+ */
+#define NCLASS		24
+#define MAXSMALL	2048
+#define SLABMIN		8
+
+static const uint16_t class_size[NCLASS] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+
+/* class_of[(n + 15) / 16] is the class for n bytes */
+static uint8_t class_of[MAXSMALL / 16 + 1];
+
+struct Slab {
+	struct Slab *s_next;	/* on its class's list of slabs with room */
+	struct Slab *s_prev;
+	void *s_free;		/* free objects, linked through their first word */
+	uint16_t s_class;
+	uint16_t s_nfree;
+};
+
+#define SLABHDR		ROUNDUP(sizeof(struct Slab), 16)
+#define SLABPAGES(c)	(ROUNDUP(SLABMIN * class_size[c], PGSIZE) / PGSIZE)
+#define SLABOBJS(c)	((SLABPAGES(c) * PGSIZE - SLABHDR) / class_size[c])
+
+static struct Slab *partial[NCLASS];
+
+/*
+ * Free runs, linked through their first page.  bins[n] holds the runs
+ * of n pages, bins[0] all those of NBIN pages or more.
+ */
+#define NBIN		16
+
+struct Run {
+	struct Run *r_next;
+	struct Run *r_prev;
+};
+
+static struct Run *bins[NBIN];
+
+/*
+ * Per-thread caches of free objects.
+ */
+#define TCACHEMAX	32
+#define TCACHEBATCH	16
+
+struct Tcache {
+	void *t_free[NCLASS];
+	uint16_t t_count[NCLASS];
+};
+
+static struct Tcache tcache[NTHREAD];
+
+static volatile uint32_t heap_lock;
+
+static void
+lock_heap(void)
+{
+	while (xchg(&heap_lock, 1) != 0)
+		sys_yield();
+}
+
+static void
+unlock_heap(void)
+{
+	xchg(&heap_lock, 0);
+}
+
+static void
+malloc_init(void)
+{
+	int c, i;
+
+	for (i = 0, c = 0; i <= MAXSMALL / 16; i++) {
+		while (class_size[c] < i * 16)
+			c++;
+		class_of[i] = c;
+	}
+	heapbrk = MAPPAGES;
+}
+
+/*
+ * Runs of pages.
+ */
+
+static void
+run_mark(size_t p, size_t n, int kind)
+{
+	pagemap[p] = pagemap[p + n - 1] = PM(n, 0, kind);
+}
+
+static void
+run_insert(size_t p, size_t n)
+{
+	struct Run *r = (struct Run*) PAGEVA(p);
+	struct Run **bin = &bins[n < NBIN ? n : 0];
+
+	run_mark(p, n, PM_FREE);
+	r->r_prev = NULL;
+	r->r_next = *bin;
+	if (*bin)
+		(*bin)->r_prev = r;
+	*bin = r;
+}
+
+static void
+run_unlink(size_t p)
+{
+	struct Run *r = (struct Run*) PAGEVA(p);
+	size_t n = PM_N(pagemap[p]);
+
+	if (r->r_prev)
+		r->r_prev->r_next = r->r_next;
+	else
+		bins[n < NBIN ? n : 0] = r->r_next;
+	if (r->r_next)
+		r->r_next->r_prev = r->r_prev;
+}
+
+/*
+ * Put the n pages at p back on the free runs, merged with any free
+ * neighbours, and trim the top of the heap.
+ */
+static void
+run_free(size_t p, size_t n)
+{
+	size_t m;
+
+	if (PM_KIND(pagemap[p - 1]) == PM_FREE) {
+		m = PM_N(pagemap[p - 1]);
+		p -= m;
+		run_unlink(p);
+		n += m;
+	}
+	if (p + n < heapbrk && PM_KIND(pagemap[p + n]) == PM_FREE) {
+		run_unlink(p + n);
+		n += PM_N(pagemap[p + n]);
+	}
+
+	if (p + n == heapbrk && n > HEAPTRIM) {
+		for (m = HEAPCHUNK; m < n; m++)
+			sys_page_unmap(0, PAGEVA(p + m));
+		heapbrk = p + HEAPCHUNK;
+		n = HEAPCHUNK;
+	}
+	run_insert(p, n);
+}
+
+/*
+ * Map more pages at the top of the heap, at least HEAPCHUNK and enough
+ * to leave a free run of n pages there.  Returns 0 or -E_NO_MEM.
+ */
 static int
-isfree(void *v, size_t n)
+heap_grow(size_t n)
+{
+	size_t i, p, need, top;
+	int r;
+
+	top = 0;
+	if (mapbrk > 0 && PM_KIND(pagemap[heapbrk - 1]) == PM_FREE)
+		top = PM_N(pagemap[heapbrk - 1]);
+	n = MAX(n > top ? n - top : 0, HEAPCHUNK);
+	if (n > NHEAPPAGE - heapbrk)
+		return -E_NO_MEM;
+
+	need = ROUNDUP((heapbrk + n) * sizeof(uint32_t), PGSIZE) / PGSIZE;
+	if (mapbrk < need) {
+		if ((r = sys_vm_reserve(0, PAGEVA(mapbrk), (need - mapbrk) * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		mapbrk = need;
+	}
+
+	if ((r = sys_vm_reserve(0, PAGEVA(heapbrk), n * PGSIZE,
+				PTE_P|PTE_U|PTE_W)) < 0) {
+		for (i = 0; i < n; i++)
+			sys_page_unmap(0, PAGEVA(heapbrk + i));
+		return r;
+	}
+
+	p = heapbrk;
+	heapbrk += n;
+	if (top > 0) {
+		p -= top;
+		run_unlink(p);
+		n += top;
+	}
+	run_insert(p, n);
+	return 0;
+}
+
+/*
+ * Allocate a run of n pages, marked as a large allocation.
+ * Returns its first page, or 0 if out of memory.
+ */
+static size_t
+run_alloc(size_t n)
 {
-	uintptr_t va, end_va = (uintptr_t) v + n;
+	struct Run *r = NULL;
+	size_t b, p, m;
 
-	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
-		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+	for (b = n; b < NBIN && !r; b++)
+		r = bins[b];
+	for (r = r ? r : bins[0]; r; r = r->r_next)
+		if (PM_N(pagemap[PAGENO(r)]) >= n)
+			break;
+	if (!r) {
+		if (heap_grow(n) < 0)
 			return 0;
-	return 1;
+		return run_alloc(n);
+	}
+
+	p = PAGENO(r);
+	m = PM_N(pagemap[p]);
+	run_unlink(p);
+	if (m > n)
+		run_insert(p + n, m - n);
+	run_mark(p, n, PM_RUN);
+	return p;
 }
 
-void*
-malloc(size_t n)
+/*
+ * Slabs.
+ */
+
+static struct Slab *
+slab_of(void *v)
+{
+	size_t p = PAGENO(v);
+
+	return (struct Slab*) PAGEVA(p - PM_N(pagemap[p]));
+}
+
+static void
+slab_link(struct Slab *s)
+{
+	s->s_prev = NULL;
+	s->s_next = partial[s->s_class];
+	if (s->s_next)
+		s->s_next->s_prev = s;
+	partial[s->s_class] = s;
+}
+
+static void
+slab_unlink(struct Slab *s)
 {
-	int i, cont;
-	int nwrap;
-	uint32_t *ref;
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		partial[s->s_class] = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+}
+
+static struct Slab *
+slab_new(int c)
+{
+	struct Slab *s;
+	size_t p, i;
+	uint8_t *o;
+
+	if ((p = run_alloc(SLABPAGES(c))) == 0)
+		return NULL;
+	for (i = 0; i < SLABPAGES(c); i++)
+		pagemap[p + i] = PM(i, c, PM_SLAB);
+
+	s = (struct Slab*) PAGEVA(p);
+	s->s_class = c;
+	s->s_nfree = SLABOBJS(c);
+	s->s_free = NULL;
+	for (i = s->s_nfree; i-- > 0; ) {
+		o = (uint8_t*) s + SLABHDR + i * class_size[c];
+		*(void**) o = s->s_free;
+		s->s_free = o;
+	}
+	slab_link(s);
+	return s;
+}
+
+/* Take a free object of class c, or NULL if out of memory. */
+static void *
+obj_get(int c)
+{
+	struct Slab *s;
 	void *v;
 
-	if (mptr == 0)
-		mptr = mbegin;
+	if (!(s = partial[c]) && !(s = slab_new(c)))
+		return NULL;
+	v = s->s_free;
+	s->s_free = *(void**) v;
+	if (--s->s_nfree == 0)
+		slab_unlink(s);
+	return v;
+}
+
+/* Return an object to its slab, and the slab to the free runs if it is
+ * now unused and its class has another slab with room. */
+static void
+obj_put(void *v)
+{
+	struct Slab *s = slab_of(v);
+	int c = s->s_class;
 
-	n = ROUNDUP(n, 4);
+	*(void**) v = s->s_free;
+	s->s_free = v;
+	if (s->s_nfree++ == 0)
+		slab_link(s);
+	if (s->s_nfree == SLABOBJS(c) && (s->s_prev || s->s_next)) {
+		slab_unlink(s);
+		run_free(PAGENO(s), SLABPAGES(c));
+	}
+}
 
-	if (n >= MAXMALLOC)
-		return 0;
+/*
+ * Thread caches.
+ */
 
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
-		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
-	}
-
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
-	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
-		mptr += PGSIZE;
-		if (mptr == mend) {
-			mptr = mbegin;
-			if (++nwrap == 2)
-				return 0;	/* out of address space */
-		}
+static int
+tcache_fill(struct Tcache *t, int c)
+{
+	void *v;
+	int i;
+
+	lock_heap();
+	for (i = 0; i < TCACHEBATCH && (v = obj_get(c)); i++) {
+		*(void**) v = t->t_free[c];
+		t->t_free[c] = v;
+		t->t_count[c]++;
 	}
+	unlock_heap();
+	return t->t_free[c] ? 0 : -E_NO_MEM;
+}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+static void
+tcache_drain(struct Tcache *t, int c, int n)
+{
+	void *v;
+
+	lock_heap();
+	while (n-- > 0 && (v = t->t_free[c])) {
+		t->t_free[c] = *(void**) v;
+		t->t_count[c]--;
+		obj_put(v);
 	}
+	unlock_heap();
+}
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
-	return v;
+/*
+ * The interface.
+ */
+
+/* The number of bytes usable at v, which malloc returned. */
+static size_t
+chunk_size(void *v)
+{
+	uint32_t m;
+
+	assert(mbegin + MAPPAGES * PGSIZE <= (uint8_t*) v && (uint8_t*) v < mend);
+	m = pagemap[PAGENO(v)];
+	if (PM_KIND(m) == PM_SLAB)
+		return class_size[PM_CLASS(m)];
+	if (PM_KIND(m) != PM_RUN || (uintptr_t) v % PGSIZE != 0)
+		panic("malloc: bad pointer %08x", v);
+	return PM_N(m) * PGSIZE;
+}
+
+void*
+malloc(size_t n)
+{
+	struct Tcache *t;
+	size_t p;
+	void *v;
+	int c;
+
+	if (heapbrk == 0) {
+		lock_heap();
+		if (heapbrk == 0)
+			malloc_init();
+		unlock_heap();
+	}
+
+	if (n <= MAXSMALL) {
+		c = class_of[(n + 15) / 16];
+		t = &tcache[thread_slot()];
+		if (!t->t_free[c] && tcache_fill(t, c) < 0)
+			return 0;
+		v = t->t_free[c];
+		t->t_free[c] = *(void**) v;
+		t->t_count[c]--;
+		return v;
+	}
+
+	if (n > (size_t) (mend - mbegin))
+		return 0;
+	lock_heap();
+	p = run_alloc(ROUNDUP(n, PGSIZE) / PGSIZE);
+	unlock_heap();
+	return p ? PAGEVA(p) : 0;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	struct Tcache *t;
+	uint32_t m;
+	int c;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
-
-	c = ROUNDDOWN(v, PGSIZE);
+	chunk_size(v);
+	m = pagemap[PAGENO(v)];
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	if (PM_KIND(m) == PM_SLAB) {
+		c = PM_CLASS(m);
+		t = &tcache[thread_slot()];
+		*(void**) v = t->t_free[c];
+		t->t_free[c] = v;
+		if (++t->t_count[c] > TCACHEMAX)
+			tcache_drain(t, c, TCACHEBATCH);
+		return;
 	}
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	lock_heap();
+	run_free(PAGENO(v), PM_N(m));
+	unlock_heap();
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+	void *v;
+
+	if (size != 0 && nmemb > (size_t) -1 / size)
+		return 0;
+	if ((v = malloc(nmemb * size)) != 0)
+		memset(v, 0, nmemb * size);
+	return v;
 }
 
+/*
+ * Small chunks stay put as long as the new size needs the same class.
+ * Large ones shrink in place, and grow in place into a free run that
+ * follows them; anything else is copied.
+ */
+void*
+realloc(void *v, size_t n)
+{
+	size_t old, p, m, have, want;
+	void *nv;
+
+	if (v == 0)
+		return malloc(n);
+	if (n == 0) {
+		free(v);
+		return 0;
+	}
+
+	old = chunk_size(v);
+	if (old <= MAXSMALL) {
+		if (n <= MAXSMALL && class_of[(n + 15) / 16]
+		    == PM_CLASS(pagemap[PAGENO(v)]))
+			return v;
+	} else if (n > MAXSMALL && n <= (size_t) (mend - mbegin)) {
+		p = PAGENO(v);
+		have = old / PGSIZE;
+		want = ROUNDUP(n, PGSIZE) / PGSIZE;
+		lock_heap();
+		if (want < have) {
+			run_mark(p, want, PM_RUN);
+			run_free(p + want, have - want);
+		} else if (want > have && p + have < heapbrk
+			   && PM_KIND(m = pagemap[p + have]) == PM_FREE
+			   && have + PM_N(m) >= want) {
+			run_unlink(p + have);
+			if (have + PM_N(m) > want)
+				run_insert(p + want, have + PM_N(m) - want);
+			run_mark(p, want, PM_RUN);
+			have = want;
+		}
+		unlock_heap();
+		if (want <= have)
+			return v;
+	}
+
+	if ((nv = malloc(n)) == 0)
+		return 0;
+	memmove(nv, v, MIN(old, n));
+	free(v);
+	return nv;
+}
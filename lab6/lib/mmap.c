@@ -0,0 +1,231 @@
+// Memory-mapped files.
+//
+// mmap only records the mapping; pages are brought in one at a time by
+// a page fault handler that asks the file server for the block cache
+// page holding them.  MAP_SHARED pages are mapped read-only, and share
+// their physical page with the block cache and with every other
+// environment that mapped the same page, until somebody changes the
+// file: the server then gives itself a fresh copy (see bc_unshare), so
+// a mapped page keeps the contents it had when it was first touched.
+// MAP_PRIVATE pages come copy-on-write and are copied on first write.
+//
+// A fault the server cannot satisfy, such as one on a page past the
+// end of the file, is passed on to the program's own page fault
+// handler, much as Unix would send SIGBUS.
+
+#include <inc/lib.h>
+
+#define debug 0
+
+// Mappings are placed in [MMAPBASE, MMAPTOP).  While a mapping exists,
+// we keep its file's Fd page mapped at MMAPFDVA(i) so that the file
+// stays open on the server even if the caller closes the descriptor.
+#define MMAPBASE	0x60000000
+#define MMAPTOP		0x80000000
+#define NMMAP		32
+#define MMAPFDVA(i)	(MMAPTOP + (i) * PGSIZE)
+
+struct Mmap {
+	uintptr_t mm_va;	// first page, 0 if slot unused
+	size_t mm_len;		// bytes, a multiple of PGSIZE
+	off_t mm_offset;	// file offset of mm_va
+	int mm_prot;
+	int mm_flags;
+};
+
+static struct Mmap mmaps[NMMAP];
+
+// Requests from the fault handler use their own page, since the fault
+// may have interrupted a request being built in fsipcbuf.
+static union Fsipc mmapipcbuf __attribute__((aligned(PGSIZE)));
+
+static struct Mmap *
+mmap_find(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaps[i].mm_va && va >= mmaps[i].mm_va
+		    && va - mmaps[i].mm_va < mmaps[i].mm_len)
+			return &mmaps[i];
+	return 0;
+}
+
+// Fetch the page of m at va from the file server.
+static int
+mmap_fetch(struct Mmap *m, uintptr_t va)
+{
+	static envid_t fsenv;
+	struct Fd *fd = (struct Fd *) MMAPFDVA(m - mmaps);
+	int r;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	mmapipcbuf.map.req_fileid = fd->fd_file.id;
+	mmapipcbuf.map.req_offset = m->mm_offset + (va - m->mm_va);
+	mmapipcbuf.map.req_npages = 1;
+	mmapipcbuf.map.req_private = (m->mm_flags & MAP_PRIVATE) != 0;
+	return ipc_call(fsenv, FSREQ_MAP, &mmapipcbuf, PTE_P | PTE_W | PTE_U,
+			(void *) va, NULL);
+}
+
+// Page fault handler for mapped files.
+static int
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	struct Mmap *m;
+	int r;
+
+	if (!(m = mmap_find(va)))
+		return 0;
+	if (debug)
+		cprintf("mmap_pgfault %08x err %x\n", utf->utf_fault_va, utf->utf_err);
+
+	if ((utf->utf_err & FEC_WR) && !(m->mm_prot & PROT_WRITE))
+		return 0;
+	if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+		return 0;
+	if ((r = mmap_fetch(m, va)) < 0) {
+		if (debug)
+			cprintf("mmap: fetching %08x: %e\n", va, r);
+		return 0;
+	}
+	// A write to a private page faults again, on a copy-on-write page
+	// this time, and the kernel copies it.
+	return 1;
+}
+
+// Find len bytes of free address space for a mapping.
+static uintptr_t
+mmap_place(size_t len)
+{
+	uintptr_t va = MMAPBASE;
+	int i;
+
+ retry:
+	for (i = 0; i < NMMAP; i++)
+		if (mmaps[i].mm_va && mmaps[i].mm_va < va + len
+		    && va < mmaps[i].mm_va + mmaps[i].mm_len) {
+			va = mmaps[i].mm_va + mmaps[i].mm_len;
+			goto retry;
+		}
+	if (va + len > MMAPTOP || va + len < va)
+		return 0;
+	return va;
+}
+
+// Is anything mapped, or reserved, at va?
+static bool
+va_in_use(uintptr_t va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & (PTE_P|PTE_DZERO));
+}
+
+// Map len bytes of the open file fdnum, starting at offset, into memory.
+// 'addr' is where to put the mapping, or 0 to let mmap choose; 'prot' is
+// PROT_READ, optionally with PROT_WRITE; 'flags' is MAP_SHARED or
+// MAP_PRIVATE.  Shared mappings cannot be writable.  If there is
+// anything at addr already, mmap fails, unless 'flags' includes
+// MAP_FIXED, in which case it is unmapped.
+//
+// Pages come from the file as it is when they are first touched, and do
+// not change after that (see serve_map).
+//
+// Returns the address of the mapping, or a negative error code cast to
+// a pointer (see mmap_error).
+void *
+mmap(void *addr, size_t len, int prot, int flags, int fdnum, off_t offset)
+{
+	struct Fd *fd;
+	struct Mmap *m;
+	uintptr_t va;
+	int i, r, type = flags & ~MAP_FIXED;
+
+	len = ROUNDUP(len, PGSIZE);
+	if (len == 0 || offset < 0 || offset % PGSIZE != 0
+	    || (uintptr_t) addr % PGSIZE != 0 || !(prot & PROT_READ)
+	    || (type != MAP_SHARED && type != MAP_PRIVATE)
+	    || (type == MAP_SHARED && (prot & PROT_WRITE))
+	    || ((flags & MAP_FIXED) && !addr))
+		return (void *) -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return (void *) r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return (void *) -E_NOT_SUPP;
+
+	if (addr) {
+		va = (uintptr_t) addr;
+		if (va + len > UTOP || va + len < va)
+			return (void *) -E_INVAL;
+		if (flags & MAP_FIXED) {
+			if ((r = munmap(addr, len)) < 0)
+				return (void *) r;
+		} else
+			for (i = 0; i < len; i += PGSIZE)
+				if (mmap_find(va + i) || va_in_use(va + i))
+					return (void *) -E_INVAL;
+	} else if (!(va = mmap_place(len)))
+		return (void *) -E_NO_MEM;
+
+	for (i = 0; i < NMMAP; i++)
+		if (!mmaps[i].mm_va)
+			break;
+	if (i == NMMAP)
+		return (void *) -E_NO_MEM;
+	m = &mmaps[i];
+
+	if ((r = sys_page_map(0, fd, 0, (void *) MMAPFDVA(i),
+			      PTE_P|PTE_U|PTE_SHARE)) < 0)
+		return (void *) r;
+
+	add_pgfault_handler(mmap_pgfault);
+	m->mm_va = va;
+	m->mm_len = len;
+	m->mm_offset = offset;
+	m->mm_prot = prot;
+	m->mm_flags = flags;
+	return (void *) va;
+}
+
+// Unmap the pages covering [addr, addr + len).  This may remove whole
+// mappings or trim their ends, but not split one in two.
+//
+// Returns 0 on success, < 0 on error.
+int
+munmap(void *addr, size_t len)
+{
+	uintptr_t va = (uintptr_t) addr, end;
+	struct Mmap *m;
+	int i;
+
+	if (va % PGSIZE != 0)
+		return -E_INVAL;
+	end = va + ROUNDUP(len, PGSIZE);
+
+	for (m = mmaps; m < mmaps + NMMAP; m++) {
+		if (!m->mm_va || end <= m->mm_va || m->mm_va + m->mm_len <= va)
+			continue;
+		if (va > m->mm_va && end < m->mm_va + m->mm_len)
+			return -E_INVAL;
+	}
+
+	for (i = 0; va + i < end; i += PGSIZE)
+		sys_page_unmap(0, (void *) (va + i));
+
+	for (m = mmaps; m < mmaps + NMMAP; m++) {
+		if (!m->mm_va || end <= m->mm_va || m->mm_va + m->mm_len <= va)
+			continue;
+		if (va <= m->mm_va && m->mm_va + m->mm_len <= end) {
+			sys_page_unmap(0, (void *) MMAPFDVA(m - mmaps));
+			m->mm_va = 0;
+		} else if (va <= m->mm_va) {
+			m->mm_offset += end - m->mm_va;
+			m->mm_len -= end - m->mm_va;
+			m->mm_va = end;
+		} else
+			m->mm_len = va - m->mm_va;
+	}
+	return 0;
+}
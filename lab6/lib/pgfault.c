@@ -10,34 +10,78 @@
 // Assembly language pgfault entrypoint defined in lib/pfentry.S.
 extern void _pgfault_upcall(void);
 
-// Pointer to currently installed C-language pgfault handler.
-void (*_pgfault_handler)(struct UTrapframe *utf);
+// Library handlers (mmap) see each fault first and return nonzero if
+// they resolved it; the handler installed with set_pgfault_handler sees
+// the rest.  Copy-on-write faults never get this far: the kernel copies
+// the page itself.
+#define NLIBHANDLERS	4
 
-//
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
-// The first time we register a handler, we need to
-// allocate an exception stack (one page of memory with its top
-// at UXSTACKTOP), and tell the kernel to call the assembly-language
-// _pgfault_upcall routine when a page fault occurs.
-//
-void
-set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+static int (*lib_handlers[NLIBHANDLERS])(struct UTrapframe *utf);
+static void (*user_handler)(struct UTrapframe *utf);
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
 {
-	int r;
+	int i;
 
-	if (_pgfault_handler == 0) {
+	for (i = 0; i < NLIBHANDLERS && lib_handlers[i]; i++)
+		if (lib_handlers[i](utf))
+			return;
+	if (!user_handler)
+		panic("unhandled page fault at va %08x, eip %08x, err %x",
+		      utf->utf_fault_va, utf->utf_eip, utf->utf_err);
+	user_handler(utf);
+}
+
+// Pointer to the C-language function pfentry.S calls on a page fault.
+void (*_pgfault_handler)(struct UTrapframe *utf) = pgfault_dispatch;
+
+// The first time we register a handler, we need to
+// reserve an exception stack (one page of memory with its top
+// at UXSTACKTOP, or the thread's env_xstacktop), which the kernel allocates
+// when it first pushes a fault onto it, and tell the kernel to call the
+// assembly-language _pgfault_upcall routine when a page fault occurs.
+static void
+pgfault_init(void)
+{
+	if (thisenv->env_pgfault_upcall == 0) {
 		// First time through!
 		// LAB 4: Your code here.
-		int err = sys_page_alloc(0,
-					 (void *)(UXSTACKTOP - PGSIZE),
-					 PTE_W | PTE_U);
+		int err = sys_vm_reserve(0,
+					 (void *)(thisenv->env_xstacktop - PGSIZE),
+					 PGSIZE, PTE_W | PTE_U);
 		if (err < 0) {
-			panic("sys_page_alloc: %e", err);
+			panic("sys_vm_reserve: %e", err);
 		}
 		sys_env_set_pgfault_upcall(0, _pgfault_upcall);
 	}
+}
+
+//
+// Set the page fault handler function.
+// It is called for every fault no library handler claims.
+//
+void
+set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+{
+	pgfault_init();
+	user_handler = handler;
+}
+
+//
+// Add a library page fault handler, unless it is already installed.
+// It should return nonzero if it resolved the fault.
+//
+void
+add_pgfault_handler(int (*handler)(struct UTrapframe *utf))
+{
+	int i;
 
-	// Save handler pointer for assembly to call.
-	_pgfault_handler = handler;
+	pgfault_init();
+	for (i = 0; i < NLIBHANDLERS && lib_handlers[i]; i++)
+		if (lib_handlers[i] == handler)
+			return;
+	if (i == NLIBHANDLERS)
+		panic("add_pgfault_handler: too many handlers");
+	lib_handlers[i] = handler;
 }
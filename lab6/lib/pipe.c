@@ -17,20 +17,32 @@ struct Dev devpipe =
 	.dev_stat =	devpipe_stat,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+// The pipe header lives in the first page of the fd data area, and the
+// ring buffer in the PIPEBUFPAGES pages after it.  Both ends map all of
+// them, so data is copied straight from the writer's buffer into the
+// ring and from there into the reader's.
+#define PIPEBUFPAGES	8
+#define PIPEBUFSIZ	(PIPEBUFPAGES * PGSIZE)
+
+// How long a blocked end sleeps before looking again whether the other
+// end has gone away.  Closing normally wakes it right away.
+#define PIPEWAIT	50
 
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
-	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	volatile uint32_t p_rpos;	// read position
+	volatile uint32_t p_wpos;	// write position
+	volatile uint32_t p_rsleep;	// readers waiting for p_wpos to move
+	volatile uint32_t p_wsleep;	// writers waiting for p_rpos to move
 };
 
+#define PIPEBUF(p)	((uint8_t *) (p) + PGSIZE)
+
 int
 pipe(int pfd[2])
 {
-	int r;
+	int i, r;
 	struct Fd *fd0, *fd1;
-	void *va;
+	char *va0, *va1;
 
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
@@ -41,12 +53,17 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
-	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err3;
+	// allocate the pipe structure and buffer as the first data pages
+	// in both
+	va0 = fd2data(fd0);
+	va1 = fd2data(fd1);
+	for (i = 0; i < 1 + PIPEBUFPAGES; i++) {
+		if ((r = sys_page_alloc(0, va0 + i*PGSIZE, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err2;
+		if ((r = sys_page_map(0, va0 + i*PGSIZE, 0, va1 + i*PGSIZE,
+				      PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err2;
+	}
 
 	// set up fd structures
 	fd0->fd_dev_id = devpipe.dev_id;
@@ -56,15 +73,17 @@ pipe(int pfd[2])
 	fd1->fd_omode = O_WRONLY;
 
 	if (debug)
-		cprintf("[%08x] pipecreate %08x\n", thisenv->env_id, uvpt[PGNUM(va)]);
+		cprintf("[%08x] pipecreate %08x\n", thisenv->env_id, uvpt[PGNUM(va0)]);
 
 	pfd[0] = fd2num(fd0);
 	pfd[1] = fd2num(fd1);
 	return 0;
 
-    err3:
-	sys_page_unmap(0, va);
     err2:
+	for (i = 0; i < 1 + PIPEBUFPAGES; i++) {
+		sys_page_unmap(0, va0 + i*PGSIZE);
+		sys_page_unmap(0, va1 + i*PGSIZE);
+	}
 	sys_page_unmap(0, fd1);
     err1:
 	sys_page_unmap(0, fd0);
@@ -101,11 +120,31 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Wait for the other end to move *pos on from old, counting ourselves
+// in *nsleep meanwhile so that it knows to wake us.
+static void
+pipe_sleep(volatile uint32_t *nsleep, volatile uint32_t *pos, uint32_t old)
+{
+	__sync_fetch_and_add(nsleep, 1);
+	sys_futex_wait(pos, old, PIPEWAIT);
+	__sync_fetch_and_sub(nsleep, 1);
+}
+
+// Wake whoever is waiting for *pos to move, once it has.
+static void
+pipe_wakeup(volatile uint32_t *nsleep, volatile uint32_t *pos)
+{
+	__sync_synchronize();
+	if (*nsleep)
+		sys_futex_wake(pos, NENV);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
-	size_t i;
+	size_t i, m;
+	uint32_t rpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -114,8 +153,8 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+	for (i = 0; i < n; i += m) {
+		while ((rpos = p->p_rpos) == p->p_wpos) {
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
@@ -123,15 +162,19 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer fills it
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(&p->p_rsleep, &p->p_wpos, rpos);
 		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+		// take as much as is there, up to the end of the buffer.
+		// wait to advance rpos until the bytes are taken!
+		m = MIN(MIN(n - i, p->p_wpos - rpos),
+			PIPEBUFSIZ - rpos % PIPEBUFSIZ);
+		memmove(buf + i, PIPEBUF(p) + rpos % PIPEBUFSIZ, m);
+		__sync_synchronize();
+		p->p_rpos = rpos + m;
+		pipe_wakeup(&p->p_wsleep, &p->p_rpos);
 	}
 	return i;
 }
@@ -140,7 +183,8 @@ static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, m;
+	uint32_t wpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,23 +193,27 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = 0; i < n; i += m) {
+		while ((wpos = p->p_wpos) - p->p_rpos == PIPEBUFSIZ) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a reader drains it
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_sleep(&p->p_wsleep, &p->p_rpos, wpos - PIPEBUFSIZ);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// fill as much room as there is, up to the end of the buffer.
+		// wait to advance wpos until the bytes are stored!
+		m = MIN(MIN(n - i, PIPEBUFSIZ - (wpos - p->p_rpos)),
+			PIPEBUFSIZ - wpos % PIPEBUFSIZ);
+		memmove(PIPEBUF(p) + wpos % PIPEBUFSIZ, buf + i, m);
+		__sync_synchronize();
+		p->p_wpos = wpos + m;
+		pipe_wakeup(&p->p_rsleep, &p->p_wpos);
 	}
 
 	return i;
@@ -185,7 +233,14 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	char *va = fd2data(fd);
+	int i;
+
+	// Unmap the header last: _pipeisclosed compares its references
+	// with the Fd's.  Unmapping it also wakes anyone asleep on it.
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	for (i = PIPEBUFPAGES; i > 0; i--)
+		(void) sys_page_unmap(0, va + i*PGSIZE);
+	return sys_page_unmap(0, va);
 }
 
@@ -11,6 +11,7 @@ static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
 
+
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
 // argv: pointer to null-terminated array of pointers to strings,
@@ -260,12 +261,20 @@ error:
 	return r;
 }
 
+// Map a program segment into the child.  Whole pages of the file are
+// mapped straight from the file server's block cache, up to FSMAPPAGES
+// per request: read-only segments share the cache pages, and writable
+// ones get them copy-on-write.  The server leaves the pages alone from
+// then on, so later changes to the file do not reach the child.  A page
+// that the file only partly fills is copied, since the rest of it must
+// read as zero.  The pages past the file, the bss, are left for the
+// kernel to allocate on first touch.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, j, n, r;
+	int mapperm = (perm & PTE_W) ? (perm & ~PTE_W) | PTE_COW : perm;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -276,11 +285,27 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
+	for (i = 0; i < memsz; i += n * PGSIZE) {
+		n = 1;
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// reserve the rest of the segment as blank pages
+			n = ROUNDUP(memsz - i, PGSIZE) / PGSIZE;
+			if ((r = sys_vm_reserve(child, (void*) (va + i),
+						n * PGSIZE, perm)) < 0)
+				return r;
+		} else if (i + PGSIZE <= filesz) {
+			// whole pages from the block cache
+			n = MIN((filesz - i) / PGSIZE, FSMAPPAGES);
+			if ((r = read_map(fd, fileoffset + i, UTEMP, n,
+					  perm & PTE_W)) < 0)
 				return r;
+			for (j = 0; j < n; j++)
+				if ((r = sys_page_map(0, UTEMP + j * PGSIZE, child,
+						      (void*) (va + i + j * PGSIZE),
+						      mapperm)) < 0)
+					panic("spawn: sys_page_map cached: %e", r);
+			for (j = 0; j < n; j++)
+				sys_page_unmap(0, UTEMP + j * PGSIZE);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
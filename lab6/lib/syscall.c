@@ -58,7 +58,12 @@ sys_env_destroy(envid_t envid)
 envid_t
 sys_getenvid(void)
 {
-	 return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
+	envid_t envid;
+
+	// Usually answered from the vDSO page, without a trap
+	if ((envid = vdso_getenvid()) != 0)
+		return envid;
+	return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
 }
 
 void
@@ -85,6 +90,12 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_vm_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_vm_reserve, 0, envid, (uint32_t) va, len, perm, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -108,19 +119,44 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
-	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+	return sys_ipc_try_send_pages(envid, value, srcva, 1, perm);
+}
+
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, size_t npages, int perm)
+{
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, npages);
+}
+
+int
+sys_ipc_send_pages(envid_t envid, uint32_t value, void *srcva, size_t npages, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, npages);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
 }
 
 int
 sys_ipc_recv(void *dstva)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return sys_ipc_recv_pages(dstva, 1, 0);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, size_t npages, int flags)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, flags, 0, 0);
 }
 
 unsigned int
 sys_time_msec(void)
 {
-	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+	// Read off the TSC, using the vDSO page
+	return vdso_time_msec();
 }
 
 int
@@ -134,3 +170,39 @@ sys_receive_packet(char *buf, int size)
 {
 	return syscall(SYS_receive_packet, 0, (uint32_t)buf, (uint32_t)size, 0, 0, 0);
 }
+
+int
+sys_net_wait(bool tx)
+{
+	return syscall(SYS_net_wait, 0, tx, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t)addr, val, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t)addr, n, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int sched_class, int nice)
+{
+	return syscall(SYS_env_set_priority, 0, envid, sched_class, nice, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 0, envid, cpumask, 0, 0, 0);
+}
+
+int
+sys_sleep_until(uint64_t nsec)
+{
+	return syscall(SYS_sleep_until, 0, (uint32_t) nsec, nsec >> 32, 0, 0, 0);
+}
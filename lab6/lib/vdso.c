@@ -0,0 +1,54 @@
+// Reading the vDSO page (see inc/vdso.h), which the kernel keeps up to
+// date for us, instead of asking the kernel.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// The CPU we were running on at some point during the call, read off
+// the task register, which the kernel loads with GD_TSS0 + (cpu << 3).
+static inline int
+vdso_cpu(void)
+{
+	uint16_t sel;
+
+	asm volatile("str %0" : "=r" (sel) : : "memory");
+	return (sel - GD_TSS0) >> 3;
+}
+
+// Return the calling environment's id, or 0 if the vDSO page cannot
+// tell.  The CPU's vc_curenv is ours as long as we have not been
+// switched out, which we would see as a change of CPU or of vc_gen.
+envid_t
+vdso_getenvid(void)
+{
+	const volatile struct VdsoCpu *vc;
+	uint32_t gen;
+	envid_t envid;
+	int cpu;
+
+	do {
+		cpu = vdso_cpu();
+		if (cpu < 0 || cpu >= VDSO_NCPU)
+			return 0;
+		vc = &vdso.vd_cpu[cpu];
+		gen = vc->vc_gen;
+		envid = vc->vc_curenv;
+	} while (vdso_cpu() != cpu || vc->vc_gen != gen);
+	return envid;
+}
+
+// Return the time in milliseconds since boot, as the kernel's
+// time_msec() would.
+unsigned int
+vdso_time_msec(void)
+{
+	return (read_tsc() - vdso.vd_tsc_base) / vdso.vd_tsc_per_ms;
+}
+
+// Return the time in nanoseconds since boot, as sys_sleep_until
+// counts it.
+uint64_t
+vdso_time_nsec(void)
+{
+	return vdso_tsc2nsec(read_tsc() - vdso.vd_tsc_base, vdso.vd_tsc_per_ms);
+}
@@ -27,7 +27,7 @@ input(envid_t ns_envid)
 		while ((len = sys_receive_packet(nsipcbuf.pkt.jp_data,
 						 PGSIZE - sizeof(int)))
 		       == -E_RX_EMPTY) {
-			sys_yield();
+			sys_net_wait(false);
 		}
 		nsipcbuf.pkt.jp_len = len;
 		ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_U | PTE_W | PTE_P);
@@ -38,6 +38,7 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 
     cur_tc->tc_wait_addr = addr;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_wait_until = msec;
 
     while (p < msec) {
 	if (p < s)
@@ -53,6 +54,21 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 
     cur_tc->tc_wait_addr = 0;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_wait_until = 0;
+}
+
+// Return the earliest time (in sys_time_msec terms) that another thread
+// waits in thread_wait until, or ~0 if none does.
+uint32_t
+thread_next_deadline(void) {
+    struct thread_context *tc = thread_queue.tq_first;
+    uint32_t deadline = ~0;
+    while (tc) {
+	if (tc->tc_wait_until && tc->tc_wait_until < deadline)
+	    deadline = tc->tc_wait_until;
+	tc = tc->tc_queue_link;
+    }
+    return deadline;
 }
 
 int
@@ -110,13 +126,16 @@ thread_create(thread_id_t *tid, const char *name,
     thread_set_name(tc, name);
     tc->tc_tid = alloc_tid();
 
-    tc->tc_stack_bottom = malloc(stack_size);
+    tc->tc_stack_bottom = malloc(PGSIZE + stack_size);
     if (!tc->tc_stack_bottom) {
 	free(tc);
 	return -E_NO_MEM;
     }
+    // The guard page: overflowing the stack faults instead of
+    // scribbling on whatever malloc put below it.
+    sys_page_unmap(0, tc->tc_stack_bottom);
 
-    void *stacktop = tc->tc_stack_bottom + stack_size;
+    void *stacktop = tc->tc_stack_bottom + PGSIZE + stack_size;
     // Terminate stack unwinding
     stacktop = stacktop - 4;
     memset(stacktop, 0, 4);
@@ -141,6 +160,8 @@ thread_clean(struct thread_context *tc) {
     int i;
     for (i = 0; i < tc->tc_nonhalt; i++)
 	tc->tc_onhalt[i](tc->tc_tid);
+    // malloc expects the guard page back
+    sys_vm_reserve(0, tc->tc_stack_bottom, PGSIZE, PTE_P|PTE_U|PTE_W);
     free(tc->tc_stack_bottom);
     free(tc);
 }
@@ -6,7 +6,9 @@
 
 #define THREAD_NUM_ONHALT 4
 enum { name_size = 32 };
-enum { stack_size = PGSIZE };
+// Each thread's stack is stack_size bytes of malloc'd, demand-zero
+// pages, with an unmapped guard page below it to catch overflows.
+enum { stack_size = 4 * PGSIZE };
 
 struct thread_context;
 
@@ -25,6 +27,7 @@ struct thread_context {
     struct jos_jmp_buf	tc_jb;
     volatile uint32_t	*tc_wait_addr;
     volatile char	tc_wakeup;
+    uint32_t		tc_wait_until;	// thread_wait deadline, 0 if none
     void		(*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
     int			tc_nonhalt;
     struct thread_context *tc_queue_link;
@@ -41,7 +41,7 @@ output(envid_t ns_envid)
 				if (err == 0) {
 					break;
 				} else if (err == -E_NIC_BUSY) {
-					sys_yield();
+					sys_net_wait(true);
 				} else {
 					panic("unexpected error: %e", err);
 				}
@@ -162,7 +162,7 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 
 static void
 process_timer(envid_t envid) {
-	uint32_t start, now, to;
+	uint32_t start, now, to, next;
 
 	if (envid != timer_envid) {
 		cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
@@ -173,7 +173,12 @@ process_timer(envid_t envid) {
 	thread_yield();
 	now = sys_time_msec();
 
+	// Come back after TIMER_INTERVAL, or sooner if a thread's
+	// thread_wait times out before then.
 	to = TIMER_INTERVAL - (now - start);
+	next = thread_next_deadline();
+	if (next < now + to)
+		to = next > now ? next - now : 1;
 	ipc_send(envid, to, 0, 0);
 }
 
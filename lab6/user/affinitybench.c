@@ -0,0 +1,117 @@
+// CPU affinity benchmark, best run with CPUS=4.  Times IPC round trips
+// between two processes left to the scheduler, which keeps them on one
+// CPU, and then pinned to two different CPUs.  Then times the primes
+// sieve: a chain of one process per prime, each passing on the numbers
+// its prime does not divide.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND		10000
+#define NSIEVE		2000
+
+static uint32_t
+pingpong(envid_t who)
+{
+	uint64_t start;
+	uint32_t i;
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++)
+		if (ipc_call(who, i, 0, 0, 0, 0) != i + 1)
+			panic("affinitybench: bad reply");
+	ipc_send(who, NROUND, 0, 0);
+	wait(who);
+	return (read_tsc() - start) / NROUND;
+}
+
+static envid_t
+echo(void)
+{
+	envid_t who;
+	uint32_t i;
+
+	if ((who = fork()) != 0)
+		return who;
+	while ((i = ipc_recv(&who, 0, 0)) != NROUND)
+		ipc_send(who, i + 1, 0, 0);
+	exit();
+	return 0;
+}
+
+static envid_t root;
+static int depth;
+
+// One stage of the sieve.  The first number that reaches a stage is its
+// prime; a 0 ends the run, and the stage that gets it first reports how
+// many primes there were.
+static void
+sieve(void)
+{
+	envid_t next;
+	uint32_t p, i;
+
+top:
+	if ((p = ipc_recv(0, 0, 0)) == 0) {
+		ipc_send(root, depth, 0, 0);
+		exit();
+	}
+	depth++;
+	next = 0;
+	while (1) {
+		i = ipc_recv(0, 0, 0);
+		if (i != 0 && i % p == 0)
+			continue;
+		if (!next && (next = fork()) < 0)
+			panic("fork: %e", next);
+		if (next == 0)
+			goto top;
+		ipc_send(next, i, 0, 0);
+		if (i == 0)
+			exit();
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint32_t local, pinned = 0, i, nprime, start, sieved;
+	int r;
+
+	local = pingpong(echo());
+
+	who = echo();
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	if (sys_env_set_affinity(who, 1 << 1) == 0)
+		pinned = pingpong(who);
+	else {
+		ipc_send(who, NROUND, 0, 0);
+		wait(who);
+	}
+	if ((r = sys_env_set_affinity(0, ~0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+
+	root = thisenv->env_id;
+	start = sys_time_msec();
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		sieve();
+		return;
+	}
+	for (i = 2; i < NSIEVE; i++)
+		ipc_send(who, i, 0, 0);
+	ipc_send(who, 0, 0, 0);
+	nprime = ipc_recv(0, 0, 0);
+	sieved = sys_time_msec() - start;
+
+	cprintf("affinitybench: %u cycles per round trip on one CPU, ", local);
+	if (pinned)
+		cprintf("%u across two\n", pinned);
+	else
+		cprintf("only one CPU\n");
+	cprintf("affinitybench: %u primes below %u in %u ms\n",
+		nprime, NSIEVE, sieved);
+}
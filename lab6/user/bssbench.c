@@ -0,0 +1,65 @@
+// Demand-zero benchmark.  This program has BSSSIZE bytes of bss, most
+// of which it never touches.  Time NSPAWN spawns of it that exit at
+// once, and count the pages of our own address space that are mapped,
+// and those only reserved, waiting for their first touch; then touch
+// the whole bss and count again.
+
+#include <inc/lib.h>
+
+#define BSSSIZE		(4 * 1024 * 1024)
+#define NSPAWN		20
+
+static uint8_t big[BSSSIZE];
+
+// Count the pages below UTOP that are mapped, and those still reserved.
+static void
+count(int *mapped, int *reserved)
+{
+	uintptr_t va;
+	pte_t pte;
+
+	*mapped = *reserved = 0;
+	for (va = 0; va < UTOP; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va += PTSIZE - PGSIZE;
+			continue;
+		}
+		pte = uvpt[PGNUM(va)];
+		if (pte & PTE_P)
+			(*mapped)++;
+		else if (pte & PTE_DZERO)
+			(*reserved)++;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, elapsed;
+	int i, r, mapped, reserved;
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		big[BSSSIZE / 2] = 1;
+		return;
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < NSPAWN; i++) {
+		if ((r = spawnl("bssbench", "bssbench", "-c", 0)) < 0)
+			panic("spawn bssbench: %e", r);
+		wait(r);
+	}
+	elapsed = sys_time_msec() - start;
+
+	count(&mapped, &reserved);
+	cprintf("bssbench: %d spawns with %d KB of bss in %u ms; "
+		"%d pages mapped, %d reserved\n",
+		NSPAWN, BSSSIZE / 1024, elapsed, mapped, reserved);
+
+	for (i = 0; i < BSSSIZE; i += PGSIZE)
+		if (big[i] != 0)
+			panic("bss byte %d is %d", i, big[i]);
+	count(&mapped, &reserved);
+	cprintf("bssbench: after reading all the bss, "
+		"%d pages mapped, %d reserved\n", mapped, reserved);
+}
@@ -0,0 +1,51 @@
+// Copy-on-write benchmark.  Fill NPAGE pages, then fork NFORK children
+// one after another, each of which writes to every page and exits, so
+// that every write is a copy-on-write fault.  Then time the same writes
+// in a parent that no child shares its pages with any more, where each
+// fault just makes the page writable again.
+
+#include <inc/lib.h>
+
+#define NPAGE		256
+#define NFORK		20
+
+static uint8_t buf[NPAGE * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+scribble(void)
+{
+	int i;
+
+	for (i = 0; i < NPAGE; i++)
+		buf[i * PGSIZE] = i;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, tcopy, talone;
+	envid_t who;
+	int i;
+
+	scribble();
+
+	start = sys_time_msec();
+	for (i = 0; i < NFORK; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			scribble();
+			exit();
+		}
+		wait(who);
+	}
+	tcopy = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	scribble();
+	talone = sys_time_msec() - start;
+
+	cprintf("cowbench: %d forks writing %d pages each in %u ms; "
+		"%d writes to pages no longer shared in %u ms\n",
+		NFORK, NPAGE, tcopy, NPAGE, talone);
+}
@@ -0,0 +1,46 @@
+// Small-file create benchmark: create NFILE files in a fresh directory,
+// writing a few bytes to each, then remove them all.  Every close
+// flushes the file, so this measures how cheaply the file server makes
+// metadata changes durable.  Compare against a disk made with
+// "fsformat -j 0", which has no journal and writes metadata in place.
+
+#include <inc/lib.h>
+
+#define NFILE		200
+#define DIR		"/createbench"
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN], buf[128];
+	unsigned start, created, removed;
+	int fd, i, r;
+
+	memset(buf, 'x', sizeof buf);
+	if ((fd = open(DIR, O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+		panic("open %s: %e", DIR, fd);
+	close(fd);
+
+	start = sys_time_msec();
+	for (i = 0; i < NFILE; i++) {
+		snprintf(path, sizeof path, DIR "/f%d", i);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", path, fd);
+		if ((r = write(fd, buf, sizeof buf)) != sizeof buf)
+			panic("write %s: %e", path, r);
+		close(fd);
+	}
+	created = sys_time_msec();
+
+	for (i = 0; i < NFILE; i++) {
+		snprintf(path, sizeof path, DIR "/f%d", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	removed = sys_time_msec();
+
+	cprintf("createbench: %d files created in %u ms, removed and synced in %u ms\n",
+		NFILE, created - start, removed - created);
+}
@@ -0,0 +1,38 @@
+// Directory lookup benchmark: create NFILES files in one directory,
+// then open each of them again.
+
+#include <inc/lib.h>
+
+#define NFILES	10000
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	int i, fd;
+	unsigned start, created, opened;
+
+	if ((fd = open("/dirbench", O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+		panic("open /dirbench: %e", fd);
+	close(fd);
+
+	start = sys_time_msec();
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "/dirbench/file%d", i);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL)) < 0)
+			panic("create %s: %e", path, fd);
+		close(fd);
+	}
+	created = sys_time_msec();
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "/dirbench/file%d", i);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			panic("open %s: %e", path, fd);
+		close(fd);
+	}
+	opened = sys_time_msec();
+
+	cprintf("dirbench: %d creates in %u ms, %d opens in %u ms\n",
+		NFILES, created - start, NFILES, opened - created);
+}
@@ -0,0 +1,59 @@
+// Environment table benchmark: make NIDLE environments with sys_exofork,
+// which never run and cost one page directory each, more than the 1024
+// there used to be room for.  Time NYIELD calls to sys_yield before and
+// while they exist; with only runnable environments on the scheduler's
+// queues, the idle ones should not slow it down.  Then time a system
+// call that finds each of them by envid, and freeing them all.
+
+#include <inc/lib.h>
+
+#define NIDLE		4000
+#define NYIELD		20000
+
+static envid_t idle[NIDLE];
+
+static unsigned
+yields(void)
+{
+	unsigned start = sys_time_msec();
+	int i;
+
+	for (i = 0; i < NYIELD; i++)
+		sys_yield();
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned t0, tmake, t1, tlook, tfree, start;
+	int i, r;
+
+	t0 = yields();
+
+	start = sys_time_msec();
+	for (i = 0; i < NIDLE; i++)
+		if ((idle[i] = sys_exofork()) < 0)
+			panic("sys_exofork %d: %e", i, idle[i]);
+		else if (idle[i] == 0)
+			panic("an idle environment ran");
+	tmake = sys_time_msec() - start;
+
+	t1 = yields();
+
+	start = sys_time_msec();
+	for (i = 0; i < NIDLE; i++)
+		if ((r = sys_env_set_priority(idle[i], SCHED_FAIR, 0)) < 0)
+			panic("sys_env_set_priority %08x: %e", idle[i], r);
+	tlook = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	for (i = 0; i < NIDLE; i++)
+		if ((r = sys_env_destroy(idle[i])) < 0)
+			panic("sys_env_destroy %08x: %e", idle[i], r);
+	tfree = sys_time_msec() - start;
+
+	cprintf("envbench: %d envs made in %u ms, looked up in %u ms, "
+		"freed in %u ms; %d yields %u ms alone, %u ms among them\n",
+		NIDLE, tmake, tlook, tfree, NYIELD, t0, t1);
+}
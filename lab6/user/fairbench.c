@@ -0,0 +1,77 @@
+// Scheduler benchmark: run NSPIN CPU-bound children at different nice
+// values for PERIOD ms and report the CPU time each got, then time file
+// server round trips and 1 ms sleeps while they are still spinning.
+// The children's shares should follow their weights, and the file
+// server, which is in the SCHED_SERVER class, should answer about as
+// fast as on an idle system.
+
+#include <inc/lib.h>
+
+#define NSPIN		3
+#define PERIOD		1000
+#define NROUND		50
+
+static const int nice[NSPIN] = { 0, 0, 5 };
+
+// Time NROUND opens of /motd, in microseconds each.
+static unsigned
+fs_roundtrip(void)
+{
+	uint64_t start;
+	int fd, i;
+
+	start = vdso_time_nsec();
+	for (i = 0; i < NROUND; i++) {
+		if ((fd = open("/motd", O_RDONLY)) < 0)
+			panic("open /motd: %e", fd);
+		close(fd);
+	}
+	return (vdso_time_nsec() - start) / NROUND / 1000;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t spinner[NSPIN];
+	uint64_t start, deadline, late;
+	unsigned idle_us, busy_us, stop;
+	int i, r;
+
+	idle_us = fs_roundtrip();
+
+	stop = sys_time_msec() + 2 * PERIOD;
+	for (i = 0; i < NSPIN; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			while (sys_time_msec() < stop)
+				/* spin */;
+			return;
+		}
+		spinner[i] = r;
+		if ((r = sys_env_set_priority(spinner[i], SCHED_FAIR, nice[i])) < 0)
+			panic("sys_env_set_priority: %e", r);
+	}
+
+	start = vdso_time_nsec();
+	sys_sleep_until(start + PERIOD * (uint64_t) NSEC_PER_MSEC);
+	for (i = 0; i < NSPIN; i++)
+		cprintf("fairbench: nice %d spinner ran %u ms of %d\n", nice[i],
+			(uint32_t) (envs[ENVX(spinner[i])].env_runtime / NSEC_PER_MSEC),
+			PERIOD);
+
+	busy_us = fs_roundtrip();
+	late = 0;
+	for (i = 0; i < NROUND; i++) {
+		deadline = vdso_time_nsec() + NSEC_PER_MSEC;
+		sys_sleep_until(deadline);
+		late += vdso_time_nsec() - deadline;
+	}
+	cprintf("fairbench: file server round trip %u us idle, %u us with spinners\n",
+		idle_us, busy_us);
+	cprintf("fairbench: 1 ms sleeps wake up %u us late with spinners\n",
+		(uint32_t) (late / NROUND / 1000));
+
+	for (i = 0; i < NSPIN; i++)
+		wait(spinner[i]);
+}
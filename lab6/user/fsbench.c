@@ -0,0 +1,49 @@
+// File I/O throughput benchmark: write a FILESIZE file and read it
+// back, first one page per call and then in large chunks.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(2 * 1024 * 1024)
+
+static char buf[1024 * 1024];
+
+static void
+run(const char *path, size_t chunk)
+{
+	int fd, r;
+	size_t off, n;
+	unsigned start, wrote, read_back;
+
+	start = sys_time_msec();
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	for (off = 0; off < FILESIZE; off += chunk)
+		for (n = 0; n < chunk; n += r)
+			if ((r = write(fd, buf + n, chunk - n)) < 0)
+				panic("write %s: %e", path, r);
+	close(fd);
+	wrote = sys_time_msec();
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	for (off = 0; (r = read(fd, buf, chunk)) > 0; off += r)
+		;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	if (off != FILESIZE)
+		panic("read %s: got %d bytes, expected %d", path, off, FILESIZE);
+	close(fd);
+	read_back = sys_time_msec();
+
+	cprintf("fsbench: %d-byte chunks: %d KB written in %u ms, read in %u ms\n",
+		chunk, FILESIZE / 1024, wrote - start, read_back - wrote);
+}
+
+void
+umain(int argc, char **argv)
+{
+	memset(buf, 'x', sizeof(buf));
+	run("/fsbench", PGSIZE);
+	run("/fsbench", sizeof(buf));
+	remove("/fsbench");
+}
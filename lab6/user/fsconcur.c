@@ -0,0 +1,96 @@
+// Concurrent read benchmark: NREADER clients each read a small cached
+// file NREAD times, first on their own and then while another client
+// reads through files that are not in the file server's block cache
+// yet.  If the server served one request at a time, the cached reads
+// would wait for every one of the other client's disk reads.
+
+#include <inc/lib.h>
+
+#define NREADER		4
+#define NREAD		500
+
+static char buf[PGSIZE];
+
+static void
+hot_reader(void)
+{
+	int fd, i, r;
+
+	if ((fd = open("/motd", O_RDONLY)) < 0)
+		panic("open /motd: %e", fd);
+	for (i = 0; i < NREAD; i++) {
+		seek(fd, 0);
+		if ((r = read(fd, buf, sizeof buf)) < 0)
+			panic("read /motd: %e", r);
+	}
+	close(fd);
+}
+
+// Read every regular file in the root directory.
+static void
+cold_reader(void)
+{
+	struct File f;
+	char path[MAXPATHLEN];
+	int dirfd, fd, r;
+
+	if ((dirfd = open("/", O_RDONLY)) < 0)
+		panic("open /: %e", dirfd);
+	while (readn(dirfd, &f, sizeof f) == sizeof f) {
+		if (!f.f_name[0] || f.f_type != FTYPE_REG)
+			continue;
+		snprintf(path, sizeof path, "/%s", f.f_name);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			continue;
+		while ((r = read(fd, buf, sizeof buf)) > 0)
+			;
+		close(fd);
+	}
+	close(dirfd);
+}
+
+// Returns how long the hot readers took, in milliseconds.
+static unsigned
+run(bool with_cold)
+{
+	envid_t hot[NREADER], cold = 0;
+	unsigned start, elapsed;
+	int i;
+
+	start = sys_time_msec();
+	if (with_cold) {
+		if ((cold = fork()) < 0)
+			panic("fork: %e", cold);
+		if (cold == 0) {
+			cold_reader();
+			exit();
+		}
+	}
+	for (i = 0; i < NREADER; i++) {
+		if ((hot[i] = fork()) < 0)
+			panic("fork: %e", hot[i]);
+		if (hot[i] == 0) {
+			hot_reader();
+			exit();
+		}
+	}
+	for (i = 0; i < NREADER; i++)
+		wait(hot[i]);
+	elapsed = sys_time_msec() - start;
+	if (cold)
+		wait(cold);
+	return elapsed;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned alone, mixed;
+
+	hot_reader();
+	alone = run(0);
+	mixed = run(1);
+	cprintf("fsconcur: %d clients x %d cached reads: %u ms alone, "
+		"%u ms beside a client reading uncached files\n",
+		NREADER, NREAD, alone, mixed);
+}
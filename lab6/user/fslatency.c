@@ -0,0 +1,53 @@
+// File server latency under load: NCLIENT forked clients each make
+// NREQ small reads of /motd as fast as they can.  Every read is one
+// round trip to the file server, so the clients spend most of their
+// time queued behind each other.  Each client times its own requests
+// and reports the total to the parent, which prints the mean latency.
+
+#include <inc/lib.h>
+
+#define NCLIENT		32
+#define NREQ		100
+#define FILE		"/motd"
+
+static unsigned
+client(void)
+{
+	char buf[64];
+	unsigned start;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %e", FILE, fd);
+	start = sys_time_msec();
+	for (i = 0; i < NREQ; i++)
+		if ((r = seek(fd, 0)) < 0 || (r = readn(fd, buf, sizeof buf)) < 0)
+			panic("read %s: %e", FILE, r);
+	r = sys_time_msec() - start;
+	close(fd);
+	return r;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id;
+	unsigned start, elapsed, total;
+	int i, r;
+
+	start = sys_time_msec();
+	for (i = 0; i < NCLIENT; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			ipc_send(parent, client(), 0, 0);
+			exit();
+		}
+	}
+	for (total = 0, i = 0; i < NCLIENT; i++)
+		total += ipc_recv(NULL, 0, NULL);
+	elapsed = sys_time_msec() - start;
+
+	cprintf("fslatency: %d clients x %d reads in %u ms, mean latency %u us\n",
+		NCLIENT, NREQ, elapsed, total * 1000 / (NCLIENT * NREQ));
+}
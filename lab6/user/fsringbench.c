@@ -0,0 +1,60 @@
+// Asynchronous file server benchmark: read a FILESIZE file one page at
+// a time, first with read(), one round trip per page, and then through
+// the request ring with up to DEPTH reads in flight.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(2 * 1024 * 1024)
+#define DEPTH		32
+#define FILE		"/fsringbench"
+
+static char buf[PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsring_cqe cqe;
+	unsigned start, sync_ms, ring_ms;
+	size_t off, done, submitted;
+	int fd, r;
+
+	if ((fd = open(FILE, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILE, fd);
+	for (off = 0; off < FILESIZE; off += PGSIZE) {
+		memset(buf, off / PGSIZE, PGSIZE);
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", FILE, r);
+	}
+
+	start = sys_time_msec();
+	seek(fd, 0);
+	for (off = 0; off < FILESIZE; off += PGSIZE)
+		if ((r = readn(fd, buf, PGSIZE)) != PGSIZE)
+			panic("read %s: %e", FILE, r);
+	sync_ms = sys_time_msec() - start;
+
+	if ((r = fsring_setup()) < 0)
+		panic("fsring_setup: %e", r);
+	start = sys_time_msec();
+	for (submitted = done = 0; done < FILESIZE / PGSIZE; done++) {
+		// Keep DEPTH reads in flight, each in its own data page
+		for (; submitted < FILESIZE / PGSIZE && submitted - done < DEPTH;
+		     submitted++)
+			if ((r = fsring_submit(FSRING_READ, fd, submitted * PGSIZE,
+					       PGSIZE, (submitted % DEPTH) * PGSIZE,
+					       submitted)) < 0)
+				panic("fsring_submit: %e", r);
+		fsring_complete(&cqe, 1);
+		if (cqe.cqe_res != PGSIZE)
+			panic("ring read %d: %e", cqe.cqe_data, cqe.cqe_res);
+		if (fsring_data()[(cqe.cqe_data % DEPTH) * PGSIZE]
+		    != (char) cqe.cqe_data)
+			panic("ring read %d: bad data", cqe.cqe_data);
+	}
+	ring_ms = sys_time_msec() - start;
+
+	close(fd);
+	remove(FILE);
+	cprintf("fsringbench: %d KB in pages: %u ms with read, %u ms through the ring\n",
+		FILESIZE / 1024, sync_ms, ring_ms);
+}
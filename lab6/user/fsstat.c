@@ -0,0 +1,16 @@
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+	struct Fsret_stats st;
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %e", r);
+	printf("dentry cache: %u lookups, %u hits (%u negative)",
+	       st.ret_lookups, st.ret_hits, st.ret_neghits);
+	if (st.ret_lookups)
+		printf(", %u%% hit rate", st.ret_hits * 100 / st.ret_lookups);
+	printf("\n");
+}
@@ -0,0 +1,41 @@
+// Idle CPU benchmark: sleep for a while with the rest of the system
+// idle, then report how many times each other environment ran in the
+// meantime.  Environments that wait by spinning on sys_yield show up
+// with thousands of runs a second; ones that sleep in the kernel only
+// run when there is something for them to do.
+
+#include <inc/lib.h>
+
+#define PERIOD		2000
+
+static uint32_t runs[NENV];
+static uint32_t sleeper;
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, elapsed;
+	uint32_t n, total;
+	int i;
+
+	for (i = 0; i < vdso.vd_nenv; i++)
+		runs[i] = envs[i].env_runs;
+
+	start = sys_time_msec();
+	while ((elapsed = sys_time_msec() - start) < PERIOD)
+		sys_futex_wait(&sleeper, 0, PERIOD - elapsed);
+
+	total = 0;
+	for (i = 0; i < vdso.vd_nenv; i++) {
+		if (envs[i].env_status == ENV_FREE
+		    || envs[i].env_id == thisenv->env_id)
+			continue;
+		n = envs[i].env_runs - runs[i];
+		if (n > 0)
+			cprintf("idlebench: env %08x (type %d) ran %u times\n",
+				envs[i].env_id, envs[i].env_type, n);
+		total += n;
+	}
+	cprintf("idlebench: %u runs/s by other environments while idle\n",
+		total * 1000 / elapsed);
+}
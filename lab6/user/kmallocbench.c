@@ -0,0 +1,87 @@
+// Kernel allocator benchmark.  A sender that finds its receiver not
+// receiving waits in line, and the kernel keeps its message in an
+// object from a kernel object cache until the receiver takes it; a
+// sender that sends again straight after waking usually does just that.
+// So NMSG messages from a sender to a receiver on the same CPU cost
+// roughly NMSG/2 kernel allocations and frees besides the IPC itself.
+//
+// Time one such pair alone, then one pair on every CPU at once.  With
+// per-CPU object caches the second should take no longer than the
+// first, the big kernel lock permitting.  Run with CPUS=4.
+
+#include <inc/lib.h>
+
+#define NMSG		20000
+#define MAXPAIR		8
+
+// Send NMSG messages to recv, or receive them if recv is 0, on cpu.
+static void
+talk(int cpu, envid_t recv)
+{
+	int i, r;
+
+	if ((r = sys_env_set_affinity(0, 1 << cpu)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	for (i = 0; i < NMSG; i++) {
+		if (recv) {
+			if ((r = sys_ipc_send_pages(recv, i, (void *) UTOP,
+						    0, 0)) < 0)
+				panic("send: %e", r);
+		} else {
+			if ((r = sys_ipc_recv((void *) UTOP)) < 0)
+				panic("recv: %e", r);
+			if (thisenv->env_ipc_value != i)
+				panic("message %d arrived as number %d",
+				      thisenv->env_ipc_value, i);
+		}
+	}
+}
+
+static envid_t
+pinned(int cpu, envid_t recv)
+{
+	envid_t who;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		talk(cpu, recv);
+		exit();
+	}
+	return who;
+}
+
+static unsigned
+run(int npair)
+{
+	envid_t recv[MAXPAIR], send[MAXPAIR];
+	unsigned start = sys_time_msec();
+	int i;
+
+	for (i = 0; i < npair; i++) {
+		recv[i] = pinned(i, 0);
+		send[i] = pinned(i, recv[i]);
+	}
+	for (i = 0; i < npair; i++) {
+		wait(send[i]);
+		wait(recv[i]);
+	}
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned t1, tn;
+	int ncpu;
+
+	for (ncpu = 1; ncpu < MAXPAIR; ncpu++)
+		if (sys_env_set_affinity(0, 1 << ncpu) < 0)
+			break;
+	sys_env_set_affinity(0, ~0);
+
+	t1 = run(1);
+	tn = run(ncpu);
+	cprintf("kmallocbench: %d messages: %u ms on 1 CPU, "
+		"%u ms on each of %d\n", NMSG, t1, tn, ncpu);
+}
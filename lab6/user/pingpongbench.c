@@ -0,0 +1,55 @@
+// IPC round-trip benchmark, after pingpong: bounce a counter between
+// two processes NROUND times, first with ipc_send and ipc_recv on both
+// sides, then with the client using ipc_call.  Reports the mean cycles
+// per round trip of each.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND		10000
+
+static void
+echo(envid_t who)
+{
+	uint32_t i;
+
+	while (1) {
+		i = ipc_recv(&who, 0, 0);
+		ipc_send(who, i + 1, 0, 0);
+		if (i + 1 == 2 * NROUND)
+			return;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t i, sendrecv, call;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		echo(0);
+		return;
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(who, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i + 1)
+			panic("pingpongbench: bad reply");
+	}
+	sendrecv = read_tsc() - start;
+
+	start = read_tsc();
+	for (; i < 2 * NROUND; i++)
+		if (ipc_call(who, i, 0, 0, 0, 0) != i + 1)
+			panic("pingpongbench: bad reply");
+	call = read_tsc() - start;
+
+	wait(who);
+	cprintf("pingpongbench: %u cycles per send/recv round trip, %u per call\n",
+		sendrecv / NROUND, call / NROUND);
+}
@@ -0,0 +1,52 @@
+// Pipe throughput benchmark: a child writes NBYTES into a pipe in
+// CHUNK-sized writes while the parent reads them back, checking the
+// data as it goes.  Measures both the copying and how promptly each
+// end is woken when the other makes progress.
+
+#include <inc/lib.h>
+
+#define NBYTES		(4 << 20)
+#define CHUNK		8192
+
+static uint8_t buf[CHUNK];
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, elapsed;
+	int p[2], i, n, r;
+	uint32_t total;
+	envid_t child;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[0]);
+		for (total = 0; total < NBYTES; total += CHUNK) {
+			for (i = 0; i < CHUNK; i++)
+				buf[i] = total + i;
+			if ((r = write(p[1], buf, CHUNK)) != CHUNK)
+				panic("write: %e", r);
+		}
+		close(p[1]);
+		exit();
+	}
+
+	close(p[1]);
+	start = sys_time_msec();
+	for (total = 0; (n = read(p[0], buf, CHUNK)) > 0; total += n)
+		for (i = 0; i < n; i++)
+			if (buf[i] != (uint8_t) (total + i))
+				panic("pipebench: bad byte at %u", total + i);
+	elapsed = sys_time_msec() - start;
+	if (n < 0)
+		panic("read: %e", n);
+	if (total != NBYTES)
+		panic("pipebench: read %u bytes, expected %u", total, NBYTES);
+	close(p[0]);
+	wait(child);
+
+	cprintf("pipebench: %u KB in %u ms\n", total >> 10, elapsed);
+}
@@ -0,0 +1,37 @@
+// Timer benchmark: sleep NSLEEP times for a millisecond with
+// sys_sleep_until and report how late the wakeups were on average, then
+// sleep for PERIOD and count the timer interrupts every CPU took in
+// the meantime.  With one-shot timers, an idle CPU takes none.
+
+#include <inc/lib.h>
+
+#define NSLEEP		100
+#define PERIOD		1000
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t ticks[VDSO_NCPU];
+	uint64_t deadline, late, now;
+	int i;
+
+	late = 0;
+	for (i = 0; i < NSLEEP; i++) {
+		deadline = vdso_time_nsec() + NSEC_PER_MSEC;
+		sys_sleep_until(deadline);
+		if ((now = vdso_time_nsec()) < deadline)
+			panic("sys_sleep_until: woke up %u ns early",
+			      (uint32_t) (deadline - now));
+		late += now - deadline;
+	}
+	cprintf("sleepbench: 1 ms sleeps wake up %u us late on average\n",
+		(uint32_t) (late / NSLEEP / 1000));
+
+	for (i = 0; i < VDSO_NCPU; i++)
+		ticks[i] = vdso.vd_cpu[i].vc_ticks;
+	sys_sleep_until(vdso_time_nsec() + PERIOD * (uint64_t) NSEC_PER_MSEC);
+	for (i = 0; i < VDSO_NCPU; i++)
+		if (vdso.vd_cpu[i].vc_ticks != ticks[i])
+			cprintf("sleepbench: CPU %d took %u timer interrupts in %d ms\n",
+				i, vdso.vd_cpu[i].vc_ticks - ticks[i], PERIOD);
+}
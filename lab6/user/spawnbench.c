@@ -0,0 +1,45 @@
+// Program launch benchmark: spawn a trivial program NSPAWN times, waiting
+// for each to exit, then have the shell run a three-stage pipeline NPIPE
+// times.  Both are dominated by loading program images.
+
+#include <inc/lib.h>
+
+#define NSPAWN		50
+#define NPIPE		10
+#define SCRIPT		"/spawnbench.sh"
+#define OUTPUT		"/spawnbench.out"
+
+static const char script[] = "cat /motd | num | cat > " OUTPUT "\n";
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, spawned, piped;
+	int fd, i, r;
+
+	if ((fd = open(SCRIPT, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", SCRIPT, fd);
+	if ((r = write(fd, script, sizeof script - 1)) != sizeof script - 1)
+		panic("write %s: %e", SCRIPT, r);
+	close(fd);
+
+	start = sys_time_msec();
+	for (i = 0; i < NSPAWN; i++) {
+		if ((r = spawnl("/echo", "echo", "-n", 0)) < 0)
+			panic("spawn /echo: %e", r);
+		wait(r);
+	}
+	spawned = sys_time_msec();
+
+	for (i = 0; i < NPIPE; i++) {
+		if ((r = spawnl("/sh", "sh", SCRIPT, 0)) < 0)
+			panic("spawn /sh: %e", r);
+		wait(r);
+	}
+	piped = sys_time_msec();
+
+	remove(SCRIPT);
+	remove(OUTPUT);
+	cprintf("spawnbench: %d spawns in %u ms, %d pipelines in %u ms\n",
+		NSPAWN, spawned - start, NPIPE, piped - spawned);
+}
@@ -0,0 +1,41 @@
+// Load balancing benchmark: time the forktree and stresssched programs
+// from launch until every process they forked has exited.  Run it with
+// each of CPUS=1 to 8 to see how well the work spreads.
+
+#include <inc/lib.h>
+
+static int
+nlive(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < vdso.vd_nenv; i++)
+		if (envs[i].env_status != ENV_FREE)
+			n++;
+	return n;
+}
+
+static unsigned
+run(const char *prog)
+{
+	unsigned start = sys_time_msec();
+	int n = nlive();
+	int r;
+
+	if ((r = spawnl(prog, prog, 0)) < 0)
+		panic("spawn %s: %e", prog, r);
+	while (nlive() > n)
+		sys_sleep_until(vdso_time_nsec() + NSEC_PER_MSEC);
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned forktree, stresssched;
+
+	forktree = run("/forktree");
+	stresssched = run("/stresssched");
+	cprintf("stealbench: forktree in %u ms, stresssched in %u ms\n",
+		forktree, stresssched);
+}
@@ -0,0 +1,43 @@
+// Sync latency benchmark: time sync() on a file system with nothing to
+// write, and with a single dirty data block.  Both should cost about an
+// IPC round trip plus the disk writes actually needed, however large the
+// disk is; a server that looks at every block on the disk pays for its
+// size on every sync.
+
+#include <inc/lib.h>
+
+#define NSYNC		200
+#define FILE		"/syncbench"
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, idle, onedirty;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILE, fd);
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+
+	start = sys_time_msec();
+	for (i = 0; i < NSYNC; i++)
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+	idle = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	for (i = 0; i < NSYNC; i++) {
+		seek(fd, 0);
+		if ((r = write(fd, &i, sizeof i)) != sizeof i)
+			panic("write %s: %e", FILE, r);
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+	}
+	onedirty = sys_time_msec() - start;
+
+	close(fd);
+	remove(FILE);
+	cprintf("syncbench: %d syncs: %u ms idle, %u ms with one dirty block\n",
+		NSYNC, idle, onedirty);
+}
@@ -0,0 +1,56 @@
+// Test the window between arming a receive with IPC_NOWAIT and blocking
+// in a send, which is how the file server replies to a client while
+// waiting for its next request.  A message that arrives in that window
+// must not cut the send short: the sender still has to be asleep in
+// the send until its target takes the page.
+
+#include <inc/lib.h>
+
+#define TEMP_ADDR	((char *) 0xa00000)
+
+const char *msg = "the page sent while a receive was armed";
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, who, slow, fast;
+	uint32_t v;
+	int r;
+
+	if ((slow = fork()) < 0)
+		panic("fork: %e", slow);
+	if (slow == 0) {
+		// Receive only after the interloper below has sent.
+		sys_sleep_until(vdso_time_nsec() + 200 * NSEC_PER_MSEC);
+		v = ipc_recv(&who, TEMP_ADDR, 0);
+		if (who != parent || v != 1 || strcmp(TEMP_ADDR, msg) != 0)
+			panic("receiver got the wrong message");
+		ipc_send(parent, 2, 0, 0);
+		return;
+	}
+	if ((fast = fork()) < 0)
+		panic("fork: %e", fast);
+	if (fast == 0) {
+		sys_sleep_until(vdso_time_nsec() + 50 * NSEC_PER_MSEC);
+		ipc_send(parent, 3, 0, 0);
+		return;
+	}
+
+	if ((r = sys_page_alloc(0, TEMP_ADDR, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	strcpy(TEMP_ADDR, msg);
+	if ((r = sys_ipc_recv_pages((void *) UTOP, 0, IPC_NOWAIT)) < 0)
+		panic("sys_ipc_recv_pages: %e", r);
+	if ((r = sys_ipc_send_pages(slow, 1, TEMP_ADDR, 1, PTE_P|PTE_U)) < 0)
+		panic("sys_ipc_send_pages: %e", r);
+	if (envs[ENVX(slow)].env_ipc_from != parent)
+		panic("send returned before the page was taken");
+	sys_page_unmap(0, TEMP_ADDR);
+
+	if (thisenv->env_ipc_recving || thisenv->env_ipc_from != fast
+	    || thisenv->env_ipc_value != 3)
+		panic("message sent to the armed receive was lost");
+	if (ipc_recv(&who, 0, 0) != 2 || who != slow)
+		panic("receiver did not answer");
+	cprintf("testipcsend is good\n");
+}
@@ -1,12 +1,160 @@
+// Try out malloc interactively, or run its benchmarks with "bench" (or
+// "testmalloc -b" from the shell).
+//
+// The benchmarks time:
+//	pairs	NPAIR malloc/free pairs of a small struct, as lwIP's
+//		st_args come and go;
+//	churn	NCHURN frees and mallocs of random sizes up to 1KB in a
+//		working set of NLIVE chunks, like httpd's requests;
+//	large	NLARGE malloc/free pairs of LARGESIZE bytes;
+//	realloc	growing a buffer to REALLOCMAX bytes REALLOCSTEP at a time;
+//	threads	churn in NTHR threads made by sfork, all at once.
+// Every chunk is filled with a pattern that is checked before it is
+// freed.
+
 #include <inc/lib.h>
 
+#define NPAIR		100000
+#define NCHURN		100000
+#define NLIVE		512
+#define NLARGE		2000
+#define LARGESIZE	(64 * 1024)
+#define REALLOCMAX	(256 * 1024)
+#define REALLOCSTEP	64
+#define NTHR		4
+
+struct chunk {
+	uint8_t *c_v;
+	size_t c_n;
+};
+
+static struct chunk live[NTHR][NLIVE];
+
+static uint32_t
+rnd(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void
+fill(struct chunk *c, size_t n)
+{
+	if ((c->c_v = malloc(n)) == 0)
+		panic("malloc %d failed", n);
+	c->c_n = n;
+	memset(c->c_v, (uintptr_t) c->c_v >> 4, n);
+}
+
+static void
+drop(struct chunk *c)
+{
+	size_t i;
+
+	if (!c->c_v)
+		return;
+	for (i = 0; i < c->c_n; i++)
+		if (c->c_v[i] != (uint8_t) ((uintptr_t) c->c_v >> 4))
+			panic("chunk %08x of %d bytes overwritten at %d",
+			      c->c_v, c->c_n, i);
+	free(c->c_v);
+	c->c_v = 0;
+}
+
+static void
+churn(struct chunk *set, uint32_t seed, int nop)
+{
+	int i;
+
+	for (i = 0; i < nop; i++) {
+		struct chunk *c = &set[rnd(&seed) % NLIVE];
+		drop(c);
+		fill(c, 1 + rnd(&seed) % 1024);
+	}
+}
+
+// Thread i's share of the threads benchmark
+static void
+churner(void *i)
+{
+	churn(live[(int) i], (int) i + 1, NCHURN / NTHR);
+}
+
+static void
+bench(void)
+{
+	unsigned start, tpair, tchurn, tlarge, trealloc, tthread;
+	envid_t who[NTHR];
+	uint8_t *v;
+	size_t n, i;
+
+	start = sys_time_msec();
+	for (i = 0; i < NPAIR; i++) {
+		if ((v = malloc(12)) == 0)
+			panic("malloc 12 failed");
+		free(v);
+	}
+	tpair = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	churn(live[0], 1, NCHURN);
+	for (i = 0; i < NLIVE; i++)
+		drop(&live[0][i]);
+	tchurn = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	for (i = 0; i < NLARGE; i++) {
+		if ((v = malloc(LARGESIZE)) == 0)
+			panic("malloc %d failed", LARGESIZE);
+		v[0] = v[LARGESIZE - 1] = i;
+		free(v);
+	}
+	tlarge = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	v = 0;
+	for (n = REALLOCSTEP; n <= REALLOCMAX; n += REALLOCSTEP) {
+		if ((v = realloc(v, n)) == 0)
+			panic("realloc %d failed", n);
+		v[n - 1] = n / REALLOCSTEP;
+	}
+	for (n = REALLOCSTEP; n <= REALLOCMAX; n += REALLOCSTEP)
+		if (v[n - 1] != (uint8_t) (n / REALLOCSTEP))
+			panic("realloc lost the byte at %d", n - 1);
+	free(v);
+	trealloc = sys_time_msec() - start;
+
+	// Each thread churns its own set, and the first thread frees what
+	// the others leave behind.
+	start = sys_time_msec();
+	for (i = 1; i < NTHR; i++) {
+		if ((who[i] = sfork(churner, (void *) i)) < 0)
+			panic("sfork: %e", who[i]);
+	}
+	churn(live[0], 1, NCHURN / NTHR);
+	for (i = 1; i < NTHR; i++)
+		wait(who[i]);
+	for (i = 0; i < NTHR * NLIVE; i++)
+		drop(&live[i / NLIVE][i % NLIVE]);
+	tthread = sys_time_msec() - start;
+
+	printf("testmalloc: %d pairs %u ms, churn %u ms, large %u ms, "
+	       "realloc %u ms, %d threads %u ms\n", NPAIR, tpair, tchurn,
+	       tlarge, trealloc, NTHR, tthread);
+}
+
 void
 umain(int argc, char **argv)
 {
 	char *buf;
-	int n;
+	int n, size;
 	void *v;
 
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		bench();
+		exit();
+	}
+
 	while (1) {
 		buf = readline("> ");
 		if (buf == 0)
@@ -18,7 +166,19 @@ umain(int argc, char **argv)
 			n = strtol(buf + 7, 0, 0);
 			v = malloc(n);
 			printf("\t0x%x\n", (uintptr_t) v);
-		} else
+		} else if (memcmp(buf, "calloc ", 7) == 0) {
+			n = strtol(buf + 7, &buf, 0);
+			size = strtol(buf, 0, 0);
+			v = calloc(n, size);
+			printf("\t0x%x\n", (uintptr_t) v);
+		} else if (memcmp(buf, "realloc ", 8) == 0) {
+			v = (void*) strtol(buf + 8, &buf, 0);
+			n = strtol(buf, 0, 0);
+			v = realloc(v, n);
+			printf("\t0x%x\n", (uintptr_t) v);
+		} else if (strcmp(buf, "bench") == 0)
+			bench();
+		else
 			printf("?unknown command\n");
 	}
 }
@@ -0,0 +1,93 @@
+#include <inc/lib.h>
+
+#define FILESIZE	(3 * PGSIZE + 100)
+
+char buf[FILESIZE];
+
+static uintptr_t faulted;
+
+// Catch the fault on a mapped page past the end of the file.
+static void
+past_eof(struct UTrapframe *utf)
+{
+	int r;
+
+	faulted = utf->utf_fault_va;
+	if ((r = sys_page_alloc(0, (void *) ROUNDDOWN(faulted, PGSIZE),
+				PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r;
+	char *p, *q, *e;
+	envid_t child;
+
+	for (i = 0; i < FILESIZE; i++)
+		buf[i] = 'a' + i % 26;
+	if ((fd = open("/testmmap", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /testmmap: %e", fd);
+	if ((r = write(fd, buf, FILESIZE)) != FILESIZE)
+		panic("write /testmmap: %e", r);
+
+	if ((r = mmap_error(p = mmap(0, FILESIZE, PROT_READ, MAP_SHARED, fd, 0))))
+		panic("mmap shared: %e", r);
+	if ((r = mmap_error(q = mmap(0, FILESIZE, PROT_READ|PROT_WRITE,
+				     MAP_PRIVATE, fd, 0))))
+		panic("mmap private: %e", r);
+	if ((r = mmap_error(e = mmap(0, FILESIZE + PGSIZE, PROT_READ,
+				     MAP_SHARED, fd, 0))))
+		panic("mmap past the end: %e", r);
+	if (!mmap_error(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)))
+		panic("writable shared mapping allowed");
+	if (mmap_error(mmap(ROUNDUP((char *) buf, PGSIZE), PGSIZE, PROT_READ,
+			    MAP_SHARED, fd, 0)) != -E_INVAL)
+		panic("mapping over memory in use allowed");
+	close(fd);
+
+	if (memcmp(p, buf, FILESIZE) != 0)
+		panic("shared mapping does not match file");
+	cprintf("shared mapping is good\n");
+
+	q[PGSIZE] = '!';
+	if (p[PGSIZE] != buf[PGSIZE] || q[PGSIZE] != '!')
+		panic("private write leaked into shared mapping");
+	if ((fd = open("/testmmap", O_RDONLY)) < 0)
+		panic("open /testmmap: %e", fd);
+	if ((r = readn(fd, buf, FILESIZE)) != FILESIZE || buf[PGSIZE] == '!')
+		panic("private write reached the file");
+	close(fd);
+	cprintf("private mapping is good\n");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (memcmp(p, buf, FILESIZE) != 0 || q[PGSIZE] != '!')
+			panic("mappings differ in child");
+		q[0] = '?';
+		exit();
+	}
+	wait(child);
+	if (q[0] != buf[0])
+		panic("child's private write reached parent");
+	cprintf("mappings survive fork\n");
+
+	set_pgfault_handler(past_eof);
+	if (e[0] != buf[0] || e[ROUNDUP(FILESIZE, PGSIZE)] != 0
+	    || faulted != (uintptr_t) e + ROUNDUP(FILESIZE, PGSIZE))
+		panic("fault past the end of the file not passed on");
+	if ((r = munmap(e, FILESIZE + PGSIZE)) < 0)
+		panic("munmap: %e", r);
+	cprintf("faults past the end are good\n");
+
+	if ((r = remove("/testmmap")) != -E_BUSY)
+		panic("removing a mapped file: got %e", r);
+	if ((r = munmap(p, FILESIZE)) < 0)
+		panic("munmap: %e", r);
+	if ((r = munmap(q, FILESIZE)) < 0)
+		panic("munmap: %e", r);
+	remove("/testmmap");
+	cprintf("munmap is good\n");
+}
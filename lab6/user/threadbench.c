@@ -0,0 +1,77 @@
+// Thread benchmark: sum a shared array with 1, 2 and 4 threads made by
+// sfork, each taking an equal share of it, and report how long each
+// takes.  With CPUS=4 the threads should run in parallel.  Also checks
+// that the threads really share memory, and that each has its own
+// thisenv.
+
+#include <inc/lib.h>
+
+#define NWORD		(1 << 18)
+#define NPASS		32
+#define MAXTHREAD	4
+
+static uint32_t data[NWORD];
+static uint32_t sums[MAXTHREAD];
+static envid_t ids[MAXTHREAD];
+static int nthreads;	// threads in the current run
+
+static void
+sum(int i, int nthread)
+{
+	uint32_t s = 0;
+	int j, pass;
+
+	for (pass = 0; pass < NPASS; pass++)
+		for (j = i; j < NWORD; j += nthread)
+			s += data[j];
+	sums[i] = s;
+	ids[i] = thisenv->env_id;
+}
+
+// The sum for thread i, made by sfork
+static void
+summer(void *i)
+{
+	sum((int) i, nthreads);
+}
+
+static unsigned
+run(int nthread)
+{
+	envid_t who[MAXTHREAD];
+	unsigned start = sys_time_msec();
+	uint32_t total = 0;
+	int i;
+
+	nthreads = nthread;
+	for (i = 1; i < nthread; i++)
+		if ((who[i] = sfork(summer, (void *) i)) < 0)
+			panic("sfork: %e", who[i]);
+	sum(0, nthread);
+	for (i = 1; i < nthread; i++) {
+		wait(who[i]);
+		if (ids[i] != who[i])
+			panic("thread %d has thisenv %08x, not %08x",
+			      i, ids[i], who[i]);
+	}
+	for (i = 0; i < nthread; i++)
+		total += sums[i];
+	if (total != (uint32_t) NPASS * (NWORD / 2) * (NWORD - 1))
+		panic("threads summed %u", total);
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned t1, t2, t4;
+	int i;
+
+	for (i = 0; i < NWORD; i++)
+		data[i] = i;
+	t1 = run(1);
+	t2 = run(2);
+	t4 = run(4);
+	cprintf("threadbench: %u ms with 1 thread, %u with 2, %u with 4\n",
+		t1, t2, t4);
+}
@@ -0,0 +1,53 @@
+// vDSO benchmark: count the system calls the other environments (the
+// network server and its helpers, mostly) make while the system is
+// idle, and time NREAD reads of the clock and our env id, which should
+// not enter the kernel at all.
+
+#include <inc/lib.h>
+
+#define PERIOD		2000
+#define NREAD		100000
+
+static uint32_t syscalls[NENV];
+static uint32_t sleeper;
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, elapsed;
+	uint32_t n, total, mine;
+	int i;
+
+	for (i = 0; i < vdso.vd_nenv; i++)
+		syscalls[i] = envs[i].env_syscalls;
+
+	start = sys_time_msec();
+	while ((elapsed = sys_time_msec() - start) < PERIOD)
+		sys_futex_wait(&sleeper, 0, PERIOD - elapsed);
+
+	total = 0;
+	for (i = 0; i < vdso.vd_nenv; i++) {
+		if (envs[i].env_status == ENV_FREE
+		    || envs[i].env_id == thisenv->env_id)
+			continue;
+		n = envs[i].env_syscalls - syscalls[i];
+		if (n > 0)
+			cprintf("vdsobench: env %08x (type %d) made %u system calls\n",
+				envs[i].env_id, envs[i].env_type, n);
+		total += n;
+	}
+	cprintf("vdsobench: %u system calls/s by other environments while idle\n",
+		total * 1000 / elapsed);
+
+	mine = thisenv->env_syscalls;
+	start = sys_time_msec();
+	for (i = 0; i < NREAD; i++)
+		if (sys_getenvid() != thisenv->env_id)
+			panic("sys_getenvid: wrong id");
+	for (i = 0; i < NREAD; i++)
+		if (sys_time_msec() < start)
+			panic("sys_time_msec: time went backwards");
+	elapsed = sys_time_msec() - start;
+	cprintf("vdsobench: %d time and env id reads in %u ms, %u system calls\n",
+		2 * NREAD, elapsed, thisenv->env_syscalls - mine);
+}